@@ -0,0 +1,393 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ASYNCLOG_B_QUQUQ_H_
+#define _ASYNCLOG_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <type_traits>
+#include "lap.hpp"
+#include "cpu.hpp"
+
+// Asynchronous logger: hot threads enqueue binary records, one background thread formats them.
+//
+//   async_logger<> log("/var/log/app.log", LOG_DROP);
+//   log.start();
+//   ASYNC_LOG(log, "order %lu filled at %lu", id, price);      // any thread
+//   log.stop();                                                 // drains, then closes the file
+//
+// A record is the format string's id, the TSC and up to MAX_ARGS integer or pointer arguments,
+// 2 + nargs words. Nothing is formatted or copied on the calling thread: ASYNC_LOG registers
+// its format string once per call site and looks up the thread's writer once per call site,
+// thread and logger, after that a call is a TSC read and one enqueue_all() into the thread's own
+// lap_queue<> (lap_queue<> because arguments may be 0, which queue<> reserves).
+//
+// The backend thread drains the writers' queues round-robin, up to BATCH records each, formats
+// "<tsc> [T<writer>] <message>\n" into BUFFERS buffers of BUFFER_SIZE bytes and hands them to
+// the kernel in one writev() when they are full or the writers run dry. Lines are in order per
+// thread, not across threads. When idle the backend sleeps idle_sleep_us.
+//
+// A full queue means the backend is behind. LOG_DROP returns at once and counts the record; the
+// backend writes "[T<writer>] <n> records dropped" when it notices. LOG_BLOCK spins until the
+// record fits, for logs that must be complete.
+//
+// Formats must expect 64-bit integers (%lu, %ld, %lx, %p for pointers): every argument is
+// passed to snprintf() as a uint64_t.
+
+enum log_full_policy {
+  LOG_DROP = 0,
+  LOG_BLOCK
+};
+
+#ifndef ASYNC_LOG_MAX_FORMATS
+#define ASYNC_LOG_MAX_FORMATS 1024
+#endif
+
+// Format strings by id, one table for the process so that ids cached at call sites are good for
+// every logger. The strings must outlive the loggers; past the limit, lines come out as "?".
+class async_log_formats
+{
+public:
+  static uint32_t id(char const *format)
+  {
+    table &t = get_table();
+    pthread_mutex_lock(&t.lock);
+    uint32_t i = 0;
+    size_t const n = t.count.load(std::memory_order_relaxed);
+    while ( i < n && t.formats[i] != format ) { ++i; }
+    if ( i == n && n < ASYNC_LOG_MAX_FORMATS ) {
+      t.formats[n] = format;
+      t.count.store(n + 1, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&t.lock);
+    return i;
+  }
+
+  // For ids that came through a queue: registered before the record was enqueued.
+  static char const * get(uint32_t id)
+  {
+    table &t = get_table();
+    return id < t.count.load(std::memory_order_acquire) ? t.formats[id] : "?";
+  }
+
+private:
+  struct table {
+    pthread_mutex_t lock;
+    std::atomic<size_t> count;
+    char const *formats[ASYNC_LOG_MAX_FORMATS];
+  };
+
+  static table & get_table()
+  {
+    static table t = { PTHREAD_MUTEX_INITIALIZER, {0}, { NULL } };
+    return t;
+  }
+};
+
+// Loggers are numbered for the process, so that a call site can tell a logger from one that
+// was destroyed before it at the same address.
+inline uint64_t async_log_next_serial()
+{
+  static std::atomic<uint64_t> next(0);
+  return next.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+template<size_t QUEUE_SIZE = (1024 * 8), size_t MAX_THREADS = 64, size_t MAX_ARGS = 6, size_t BATCH = 256, size_t BUFFER_SIZE = (64 * 1024), size_t BUFFERS = 16>
+class async_logger
+{
+  static_assert(MAX_ARGS <= 6, "format() passes at most 6 arguments");
+
+public:
+  typedef lap_queue<QUEUE_SIZE> queue_t;
+
+  class writer
+  {
+  public:
+    template<typename... ARGS>
+    bool log(uint32_t format, ARGS... args)
+    {
+      static_assert(sizeof...(ARGS) <= MAX_ARGS, "too many log arguments");
+      uint64_t const words[2 + sizeof...(ARGS)] = {
+        ((uint64_t)format << 8) | sizeof...(ARGS), cpu::read_tsc(), to_word(args)...
+      };
+      while ( !this->q.enqueue_all(words, 2 + sizeof...(ARGS)) ) {
+        if ( this->policy == LOG_DROP ) {
+          this->dropped.store(this->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+          return false;
+        }
+        cpu::relax();
+      }
+      return true;
+    }
+
+    uint64_t dropped_records() const { return this->dropped.load(std::memory_order_relaxed); }
+
+  private:
+    friend class async_logger;
+
+    template<typename T>
+    static uint64_t to_word(T v)
+    {
+      static_assert(std::is_integral<T>::value || std::is_pointer<T>::value || std::is_enum<T>::value,
+        "log arguments must be integers or pointers");
+      return word(v, std::is_pointer<T>());
+    }
+    template<typename T> static uint64_t word(T v, std::true_type) { return (uint64_t)(uintptr_t)v; }
+    template<typename T> static uint64_t word(T v, std::false_type) { return (uint64_t)v; }
+
+    queue_t q;
+    log_full_policy policy;
+    pthread_t thread;
+    uint32_t id;
+    std::atomic<uint64_t> dropped __attribute__ ((aligned(64)));
+    uint64_t reported;    // backend: drops already written
+  };
+
+  async_logger(char const *path, log_full_policy policy_ = LOG_DROP, unsigned idle_sleep_us_ = 100)
+    : policy(policy_), idle_sleep_us(idle_sleep_us_), serial(async_log_next_serial())
+    , num_writers(0), stopping(false)
+    , records(0), bytes(0), writes(0), iov_count(0), used(0)
+  {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if ( fd < 0 ) { perror("async_logger: open"); }
+    pthread_mutex_init(&lock, NULL);
+    for(size_t i = 0; i < BUFFERS; ++i) { buffers[i] = new char[BUFFER_SIZE]; }
+  }
+
+  ~async_logger()
+  {
+    for(size_t i = 0; i < num_writers.load(std::memory_order_relaxed); ++i) { delete writers[i]; }
+    for(size_t i = 0; i < BUFFERS; ++i) { delete [] buffers[i]; }
+    pthread_mutex_destroy(&lock);
+    if ( fd >= 0 ) { close(fd); }
+  }
+
+  bool ok() const { return fd >= 0; }
+
+  // Never the same for two loggers of the process, never 0.
+  uint64_t instance() const { return serial; }
+
+  void start() { pthread_create(&backend, NULL, backend_main, this); }
+
+  // Once no thread logs any more: writes everything queued, then returns.
+  void stop()
+  {
+    stopping.store(true, std::memory_order_release);
+    pthread_join(backend, NULL);
+  }
+
+  // Id of a format string, registered on first use (see async_log_formats).
+  static uint32_t format_id(char const *format) { return async_log_formats::id(format); }
+
+  // The calling thread's writer, created on first use; NULL past MAX_THREADS.
+  writer * thread_writer()
+  {
+    pthread_t const self = pthread_self();
+    pthread_mutex_lock(&lock);
+    size_t const n = num_writers.load(std::memory_order_relaxed);
+    writer *w = NULL;
+    for(size_t i = 0; i < n && !w; ++i) {
+      if ( pthread_equal(writers[i]->thread, self) ) { w = writers[i]; }
+    }
+    if ( !w && n < MAX_THREADS ) {
+      w = new writer();
+      w->policy = policy;
+      w->thread = self;
+      w->id = (uint32_t)n;
+      w->dropped.store(0, std::memory_order_relaxed);
+      w->reported = 0;
+      writers[n] = w;
+      num_writers.store(n + 1, std::memory_order_release); // the backend picks it up
+    }
+    pthread_mutex_unlock(&lock);
+    return w;
+  }
+
+  uint64_t records_written() const { return records; }   // after stop()
+  uint64_t bytes_written() const { return bytes; }
+  uint64_t writev_calls() const { return writes; }
+
+private:
+  static void * backend_main(void *arg)
+  {
+    static_cast<async_logger *>(arg)->run();
+    return NULL;
+  }
+
+  void run()
+  {
+    for(;;) {
+      bool const finishing = stopping.load(std::memory_order_acquire);
+      size_t const n = num_writers.load(std::memory_order_acquire);
+      size_t taken = 0;
+      for(size_t i = 0; i < n; ++i) { taken += this->drain(*writers[i]); }
+      if ( taken ) { continue; }
+
+      this->flush();
+      if ( finishing ) { break; } // nothing was left after the last thread stopped
+      usleep(idle_sleep_us);
+    }
+  }
+
+  size_t drain(writer &w)
+  {
+    uint64_t const dropped = w.dropped.load(std::memory_order_relaxed);
+    if ( dropped != w.reported ) {
+      char *p = this->line_space();
+      int const len = snprintf(p, LINE_SIZE, "[T%u] %lu records dropped\n", w.id,
+        (unsigned long)(dropped - w.reported));
+      this->commit(len);
+      w.reported = dropped;
+    }
+
+    size_t k = 0;
+    uint64_t header;
+    while ( k < BATCH && w.q.dequeue(&header) == queue_t::SUCCESS ) {
+      uint64_t words[1 + MAX_ARGS];
+      size_t const nargs = header & 0xff;
+      for(size_t j = 0; j < 1 + nargs; ++j) {
+        // the rest of the record was enqueued together with the header
+        while ( w.q.dequeue(&words[j]) != queue_t::SUCCESS ) { cpu::relax(); }
+      }
+      this->format(w.id, (uint32_t)(header >> 8), words[0], nargs, words + 1);
+      ++k;
+    }
+    return k;
+  }
+
+  void format(uint32_t thread, uint32_t id, uint64_t tsc, size_t nargs, uint64_t const *a)
+  {
+    char *p = this->line_space();
+    int len = snprintf(p, LINE_SIZE, "%lu [T%u] ", (unsigned long)tsc, thread);
+    char const *f = async_log_formats::get(id);
+    size_t const room = LINE_SIZE - len - 1;
+    int m;
+    switch ( nargs ) {
+      case 0: m = snprintf(p + len, room, "%s", f); break;
+      case 1: m = snprintf(p + len, room, f, a[0]); break;
+      case 2: m = snprintf(p + len, room, f, a[0], a[1]); break;
+      case 3: m = snprintf(p + len, room, f, a[0], a[1], a[2]); break;
+      case 4: m = snprintf(p + len, room, f, a[0], a[1], a[2], a[3]); break;
+      case 5: m = snprintf(p + len, room, f, a[0], a[1], a[2], a[3], a[4]); break;
+      default: m = snprintf(p + len, room, f, a[0], a[1], a[2], a[3], a[4], a[5]); break;
+    }
+    len += (m < 0) ? 0 : ((size_t)m >= room ? (int)room - 1 : m);
+    p[len++] = '\n';
+    this->commit(len);
+    ++records;
+  }
+
+  // Space for one line at the end of the current buffer, moving to the next one (and writing all
+  // of them out when none is left) if the line might not fit.
+  char * line_space()
+  {
+    if ( BUFFER_SIZE - used < LINE_SIZE ) {
+      iov[iov_count].iov_base = buffers[iov_count];
+      iov[iov_count].iov_len = used;
+      ++iov_count;
+      used = 0;
+      if ( iov_count == BUFFERS ) { this->write_out(); }
+    }
+    return buffers[iov_count] + used;
+  }
+
+  void commit(int len) { used += (size_t)len; }
+
+  void flush()
+  {
+    if ( used ) {
+      iov[iov_count].iov_base = buffers[iov_count];
+      iov[iov_count].iov_len = used;
+      ++iov_count;
+      used = 0;
+    }
+    this->write_out();
+  }
+
+  void write_out()
+  {
+    size_t first = 0;
+    while ( first < iov_count && fd >= 0 ) {
+      ssize_t const r = writev(fd, iov + first, (int)(iov_count - first));
+      if ( r < 0 ) {
+        perror("async_logger: writev");
+        break;
+      }
+      ++writes;
+      bytes += (uint64_t)r;
+      // partial write: skip what went out, retry the rest
+      size_t done = (size_t)r;
+      while ( first < iov_count && done >= iov[first].iov_len ) { done -= iov[first++].iov_len; }
+      if ( first < iov_count ) {
+        iov[first].iov_base = (char *)iov[first].iov_base + done;
+        iov[first].iov_len -= done;
+      }
+    }
+    iov_count = 0;
+  }
+
+  enum { LINE_SIZE = 512 };
+
+  log_full_policy policy;
+  unsigned idle_sleep_us;
+  uint64_t const serial;
+  int fd;
+  pthread_t backend;
+  pthread_mutex_t lock;
+
+  writer *writers[MAX_THREADS];
+  std::atomic<size_t> num_writers;
+  std::atomic<bool> stopping;
+
+  /* Backend only. */
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t writes;
+  char *buffers[BUFFERS];
+  struct iovec iov[BUFFERS];
+  size_t iov_count;
+  size_t used;
+};
+
+// One format registration per call site. The writer is cached per call site and thread together
+// with the instance() of its logger, and looked up again when the call site logs to another
+// logger, or to a new one at the address of a destroyed one.
+#define ASYNC_LOG(logger, format, ...) \
+  do { \
+    auto &async_log_logger_ = (logger); \
+    static uint32_t const async_log_format_ = async_log_logger_.format_id(format); \
+    static thread_local uint64_t async_log_instance_ = 0; \
+    static thread_local decltype(async_log_logger_.thread_writer()) async_log_writer_ = NULL; \
+    if ( async_log_instance_ != async_log_logger_.instance() ) { \
+      async_log_writer_ = async_log_logger_.thread_writer(); \
+      async_log_instance_ = async_log_logger_.instance(); \
+    } \
+    if ( async_log_writer_ ) { async_log_writer_->log(async_log_format_, ##__VA_ARGS__); } \
+  } while (0)
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _BRIDGE_B_QUQUQ_H_
+#define _BRIDGE_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// Carries a queue<> stream over a stream socket (Unix-domain or TCP).
+//
+//   this box:   bridge_sender<> s(local_in, fd);    s.start();
+//               producer: local_in.enqueue(v) ... ; s.finish(); s.join();
+//
+//   other box:  bridge_receiver<> r(local_out, fd); r.start();
+//               consumer: dequeue from local_out; once r.ended(), drain with dequeue_unbatched()
+//               r.join();
+//
+// The sender takes everything local_in holds, up to one buffer, and writes it as one frame:
+// an 8-byte header (element count, flags) and the elements. So a burst costs one send(), and
+// a busy stream is written in frames of BUFFER_BYTES, not element by element. An idle stream
+// is written as soon as there is anything, there is no timer. finish() ends the stream: the
+// sender drains local_in (including the tail consumer batching holds back) and sends an
+// end-of-stream frame.
+//
+// The receiver reads as much as the socket has, up to BUFFER_BYTES, and enqueues every whole
+// frame into local_out. A partial frame at the end of a read waits for the next one.
+//
+// Backpressure needs no messages of its own. While local_out is full the receiver stops reading,
+// the socket buffers fill up and the sender blocks in send(). It then stops draining local_in,
+// and the producer gets BUFFER_FULL as if the consumer were local.
+//
+// Elements are sent in host byte order: both ends must agree on element_type and endianness.
+// A socket error, or the peer closing before the end of the stream, sets failed() and stops
+// the stage (the receiver also sets ended()). max_batch limits the elements per frame, 1 sends
+// every element on its own.
+
+// Socket setup, -1 on error (with perror).
+struct bridge_socket
+{
+  static int listen_unix(char const *path)
+  {
+    sockaddr_un a;
+    if ( !unix_address(path, &a) ) { return -1; }
+    unlink(path);
+    return listen_on(AF_UNIX, (sockaddr const *)&a, sizeof(a));
+  }
+
+  static int connect_unix(char const *path)
+  {
+    sockaddr_un a;
+    if ( !unix_address(path, &a) ) { return -1; }
+    return connect_to(AF_UNIX, (sockaddr const *)&a, sizeof(a));
+  }
+
+  // port 0 picks a free port, see bound_port()
+  static int listen_tcp(char const *host, uint16_t port)
+  {
+    sockaddr_in a;
+    if ( !tcp_address(host, port, &a) ) { return -1; }
+    return listen_on(AF_INET, (sockaddr const *)&a, sizeof(a));
+  }
+
+  static int connect_tcp(char const *host, uint16_t port)
+  {
+    sockaddr_in a;
+    if ( !tcp_address(host, port, &a) ) { return -1; }
+    int const fd = connect_to(AF_INET, (sockaddr const *)&a, sizeof(a));
+    if ( fd >= 0 ) { no_delay(fd); }
+    return fd;
+  }
+
+  static uint16_t bound_port(int fd)
+  {
+    sockaddr_in a;
+    socklen_t len = sizeof(a);
+    if ( getsockname(fd, (sockaddr *)&a, &len) != 0 ) { return 0; }
+    return ntohs(a.sin_port);
+  }
+
+  static int accept_one(int listen_fd)
+  {
+    int const fd = accept(listen_fd, NULL, NULL);
+    if ( fd < 0 ) {
+      perror("Error: bridge accept");
+      return -1;
+    }
+    sockaddr_storage a;
+    socklen_t len = sizeof(a);
+    if ( getsockname(fd, (sockaddr *)&a, &len) == 0 && a.ss_family == AF_INET ) { no_delay(fd); }
+    return fd;
+  }
+
+private:
+  static bool unix_address(char const *path, sockaddr_un *a)
+  {
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(a->sun_path) ) {
+      fprintf(stderr, "Error: bridge socket path too long: %s\n", path);
+      return false;
+    }
+    strcpy(a->sun_path, path);
+    return true;
+  }
+
+  static bool tcp_address(char const *host, uint16_t port, sockaddr_in *a)
+  {
+    memset(a, 0, sizeof(*a));
+    a->sin_family = AF_INET;
+    a->sin_port = htons(port);
+    if ( inet_pton(AF_INET, host, &a->sin_addr) != 1 ) {
+      fprintf(stderr, "Error: bridge address: %s\n", host);
+      return false;
+    }
+    return true;
+  }
+
+  static int listen_on(int family, sockaddr const *a, socklen_t len)
+  {
+    int const fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( fd < 0 ) {
+      perror("Error: bridge socket");
+      return -1;
+    }
+    int const one = 1;
+    if ( family == AF_INET ) { setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); }
+    if ( bind(fd, a, len) != 0 || listen(fd, 1) != 0 ) {
+      perror("Error: bridge bind/listen");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static int connect_to(int family, sockaddr const *a, socklen_t len)
+  {
+    int const fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( fd < 0 ) {
+      perror("Error: bridge socket");
+      return -1;
+    }
+    if ( connect(fd, a, len) != 0 ) {
+      perror("Error: bridge connect");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // frames are written whole, Nagle would only hold back the last one of a burst
+  static void no_delay(int fd)
+  {
+    int const one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+};
+
+struct bridge_frame
+{
+  enum { END_OF_STREAM = 1 };
+
+  uint32_t count;
+  uint32_t flags;
+};
+
+template<typename Q = queue<>, size_t BUFFER_BYTES = (64 * 1024)>
+class bridge_sender
+{
+public:
+  typedef typename Q::element_type element_type;
+
+  static size_t frame_capacity() { return CAPACITY; }
+
+  bridge_sender(Q &q, int fd, size_t max_batch = 0)
+    : q(q), fd(fd), max_batch(max_batch && max_batch < CAPACITY ? max_batch : CAPACITY)
+    , finishing(false), failed_flag(false), frames_count(0), elements_count(0), bytes_count(0)
+  { }
+
+  void start() { pthread_create(&thread, NULL, sender_main, this); }
+
+  // After the producer's last enqueue(): end the stream once local_in is drained.
+  void finish() { this->finishing.store(true, std::memory_order_release); }
+
+  void join() { pthread_join(thread, NULL); }
+
+  // The stage itself, for callers running it on their own thread.
+  void run()
+  {
+    uint64_t spins = 0;
+    for(;;) {
+      // read the flag first: everything enqueued before finish() is then visible to take()
+      bool const last = this->finishing.load(std::memory_order_acquire);
+      size_t const n = this->fill();
+      if ( n ) {
+        if ( !this->send_frame(n, 0) ) { return; }
+        continue;
+      }
+      if ( last ) {
+        this->send_frame(0, bridge_frame::END_OF_STREAM);
+        return;
+      }
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+  }
+
+  bool failed() const { return this->failed_flag.load(std::memory_order_acquire); }
+  uint64_t frames() const { return this->frames_count; }
+  uint64_t elements() const { return this->elements_count; }
+  uint64_t bytes() const { return this->bytes_count; }
+
+private:
+  enum { CAPACITY = (BUFFER_BYTES - sizeof(bridge_frame)) / sizeof(element_type) };
+
+  static void * sender_main(void *arg)
+  {
+    static_cast<bridge_sender *>(arg)->run();
+    return NULL;
+  }
+
+  bool take(element_type *v)
+  {
+    if ( !this->q.can_dequeue() ) { return false; } // skip the backtracking probes while idle
+    return this->q.dequeue(v) == Q::SUCCESS || this->q.dequeue_unbatched(v) == Q::SUCCESS;
+  }
+
+  size_t fill()
+  {
+    element_type *const e = reinterpret_cast<element_type *>(this->buffer + sizeof(bridge_frame));
+    size_t n = 0;
+    while ( n < this->max_batch && this->take(&e[n]) ) { ++n; }
+    return n;
+  }
+
+  bool send_frame(size_t n, uint32_t flags)
+  {
+    bridge_frame *const h = reinterpret_cast<bridge_frame *>(this->buffer);
+    h->count = (uint32_t)n;
+    h->flags = flags;
+    size_t const len = sizeof(bridge_frame) + n * sizeof(element_type);
+    for(size_t done = 0; done < len; ) {
+      ssize_t const w = send(this->fd, this->buffer + done, len - done, MSG_NOSIGNAL);
+      if ( w < 0 ) {
+        if ( errno == EINTR ) { continue; }
+        perror("Error: bridge send");
+        this->failed_flag.store(true, std::memory_order_release);
+        return false;
+      }
+      done += (size_t)w;
+    }
+    ++this->frames_count;
+    this->elements_count += n;
+    this->bytes_count += len;
+    return true;
+  }
+
+  Q &q;
+  int const fd;
+  size_t const max_batch;
+  pthread_t thread;
+  std::atomic<bool> finishing;
+  std::atomic<bool> failed_flag;
+  uint64_t frames_count;
+  uint64_t elements_count;
+  uint64_t bytes_count;
+  uint8_t buffer[BUFFER_BYTES] __attribute__ ((aligned(64)));
+};
+
+template<typename Q = queue<>, size_t BUFFER_BYTES = (64 * 1024)>
+class bridge_receiver
+{
+public:
+  typedef typename Q::element_type element_type;
+
+  bridge_receiver(Q &q, int fd)
+    : q(q), fd(fd), ended_flag(false), failed_flag(false), frames_count(0), elements_count(0)
+    , reads_count(0), full_count(0)
+  { }
+
+  void start() { pthread_create(&thread, NULL, receiver_main, this); }
+  void join() { pthread_join(thread, NULL); }
+
+  void run()
+  {
+    size_t have = 0;
+    for(;;) {
+      ssize_t const r = recv(this->fd, this->buffer + have, BUFFER_BYTES - have, 0);
+      if ( r <= 0 ) {
+        if ( r < 0 && errno == EINTR ) { continue; }
+        if ( r < 0 ) { perror("Error: bridge recv"); }
+        else { fprintf(stderr, "Error: bridge peer closed before end of stream\n"); }
+        this->failed_flag.store(true, std::memory_order_release);
+        break;
+      }
+      ++this->reads_count;
+      have += (size_t)r;
+
+      size_t at = 0;
+      bool eos = false;
+      while ( !eos && have - at >= sizeof(bridge_frame) ) {
+        bridge_frame const *const h = reinterpret_cast<bridge_frame const *>(this->buffer + at);
+        size_t const len = sizeof(bridge_frame) + h->count * sizeof(element_type);
+        if ( len > BUFFER_BYTES ) {
+          fprintf(stderr, "Error: bridge frame of %u elements does not fit\n", h->count);
+          this->failed_flag.store(true, std::memory_order_release);
+          eos = true;
+          break;
+        }
+        if ( have - at < len ) { break; }
+        this->deliver(reinterpret_cast<element_type const *>(h + 1), h->count);
+        eos = (h->flags & bridge_frame::END_OF_STREAM) != 0;
+        ++this->frames_count;
+        at += len;
+      }
+      if ( eos ) { break; }
+      // keep the partial frame, the next read completes it
+      memmove(this->buffer, this->buffer + at, have - at);
+      have -= at;
+    }
+    this->ended_flag.store(true, std::memory_order_release);
+  }
+
+  // Everything the sender sent is in local_out (or the stream failed).
+  bool ended() const { return this->ended_flag.load(std::memory_order_acquire); }
+  bool failed() const { return this->failed_flag.load(std::memory_order_acquire); }
+  uint64_t frames() const { return this->frames_count; }
+  uint64_t elements() const { return this->elements_count; }
+  uint64_t reads() const { return this->reads_count; }
+  uint64_t full() const { return this->full_count; }   // enqueues that found local_out full
+
+private:
+  static void * receiver_main(void *arg)
+  {
+    static_cast<bridge_receiver *>(arg)->run();
+    return NULL;
+  }
+
+  void deliver(element_type const *e, size_t n)
+  {
+    uint64_t spins = 0;
+    for(size_t i = 0; i < n; ++i) {
+      while ( this->q.enqueue(e[i]) != Q::SUCCESS ) {
+        ++this->full_count;
+        cpu::relax();
+        if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+      }
+    }
+    this->elements_count += n;
+  }
+
+  Q &q;
+  int const fd;
+  pthread_t thread;
+  std::atomic<bool> ended_flag;
+  std::atomic<bool> failed_flag;
+  uint64_t frames_count;
+  uint64_t elements_count;
+  uint64_t reads_count;
+  uint64_t full_count;
+  uint8_t buffer[BUFFER_BYTES] __attribute__ ((aligned(64)));
+};
+
+#endif
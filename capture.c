@@ -0,0 +1,193 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "capture.h"
+
+int capture_open(struct capture_stream *s, uint32_t side, uint32_t id, size_t bytes)
+{
+	memset(s, 0, sizeof(*s));
+	s->buf = malloc(bytes);
+	if (!s->buf) {
+		perror("capture: malloc");
+		return -1;
+	}
+	/* touch it now so recording never takes a page fault */
+	memset(s->buf, 0, bytes);
+	s->cap = bytes;
+	s->side = side;
+	s->id = id;
+	return 0;
+}
+
+void capture_close(struct capture_stream *s)
+{
+	free(s->buf);
+	s->buf = NULL;
+	s->len = s->cap = 0;
+}
+
+static int get_varint(const struct capture_stream *s, size_t *pos, uint64_t *v)
+{
+	uint64_t x = 0;
+	unsigned shift = 0;
+
+	while (*pos < s->len && shift < 64) {
+		uint8_t b = s->buf[(*pos)++];
+		x |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = x;
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+int capture_next(const struct capture_stream *s, size_t *pos, uint64_t *gap, uint32_t *count)
+{
+	uint64_t c;
+
+	if (!get_varint(s, pos, gap) || !get_varint(s, pos, &c))
+		return 0;
+	*count = (uint32_t)c;
+	return 1;
+}
+
+static inline uint64_t tsc_now()
+{
+	uint32_t msw, lsw;
+	__asm__ __volatile__("rdtsc" : "=d"(msw), "=a"(lsw));
+	return ((uint64_t)msw << 32) | lsw;
+}
+
+static uint64_t ns_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t capture_tsc_hz(void)
+{
+	uint64_t ns0 = ns_now(), t0 = tsc_now(), ns1, t1;
+
+	do {
+		ns1 = ns_now();
+		t1 = tsc_now();
+	} while (ns1 - ns0 < 20000000ULL);
+	return (uint64_t)((double)(t1 - t0) * 1e9 / (double)(ns1 - ns0));
+}
+
+/* File layout, native endianness:
+ *	uint64_t magic, uint32_t streams, uint32_t 0, uint64_t tsc_hz
+ *	per stream: uint32_t side, uint32_t id, uint64_t records, elements, dropped, first_tsc,
+ *	uint64_t bytes, the records */
+int capture_write(const char *path, struct capture_stream *const *streams, uint32_t n)
+{
+	FILE *f = fopen(path, "wb");
+	uint64_t magic = CAPTURE_MAGIC, hz = capture_tsc_hz(), len;
+	uint32_t zero = 0, i;
+
+	if (!f) {
+		perror("capture: fopen");
+		return -1;
+	}
+	fwrite(&magic, sizeof(magic), 1, f);
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(&zero, sizeof(zero), 1, f);
+	fwrite(&hz, sizeof(hz), 1, f);
+
+	for (i = 0; i < n; i++) {
+		const struct capture_stream *s = streams[i];
+
+		len = s->len;
+		fwrite(&s->side, sizeof(s->side), 1, f);
+		fwrite(&s->id, sizeof(s->id), 1, f);
+		fwrite(&s->records, sizeof(s->records), 1, f);
+		fwrite(&s->elements, sizeof(s->elements), 1, f);
+		fwrite(&s->dropped, sizeof(s->dropped), 1, f);
+		fwrite(&s->first_tsc, sizeof(s->first_tsc), 1, f);
+		fwrite(&len, sizeof(len), 1, f);
+		fwrite(s->buf, 1, s->len, f);
+	}
+
+	if (fclose(f)) {
+		perror("capture: fclose");
+		return -1;
+	}
+	return 0;
+}
+
+int capture_read(const char *path, struct capture_stream *streams, uint32_t max, uint64_t *tsc_hz)
+{
+	FILE *f = fopen(path, "rb");
+	uint64_t magic, len, gap;
+	uint32_t n, zero, i, count;
+	size_t pos;
+
+	if (!f) {
+		perror("capture: fopen");
+		return -1;
+	}
+	if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != CAPTURE_MAGIC ||
+	    fread(&n, sizeof(n), 1, f) != 1 || fread(&zero, sizeof(zero), 1, f) != 1 ||
+	    fread(tsc_hz, sizeof(*tsc_hz), 1, f) != 1) {
+		fprintf(stderr, "capture: %s is not a capture file\n", path);
+		fclose(f);
+		return -1;
+	}
+	if (n > max)
+		n = max;
+
+	for (i = 0; i < n; i++) {
+		struct capture_stream *s = &streams[i];
+
+		memset(s, 0, sizeof(*s));
+		if (fread(&s->side, sizeof(s->side), 1, f) != 1 ||
+		    fread(&s->id, sizeof(s->id), 1, f) != 1 ||
+		    fread(&s->records, sizeof(s->records), 1, f) != 1 ||
+		    fread(&s->elements, sizeof(s->elements), 1, f) != 1 ||
+		    fread(&s->dropped, sizeof(s->dropped), 1, f) != 1 ||
+		    fread(&s->first_tsc, sizeof(s->first_tsc), 1, f) != 1 ||
+		    fread(&len, sizeof(len), 1, f) != 1 ||
+		    !(s->buf = malloc(len ? len : 1)) ||
+		    fread(s->buf, 1, len, f) != len) {
+			fprintf(stderr, "capture: %s is truncated\n", path);
+			while (i-- > 0)
+				capture_close(&streams[i]);
+			free(s->buf);
+			fclose(f);
+			return -1;
+		}
+		s->len = s->cap = len;
+		s->last_tsc = s->first_tsc;
+		for (pos = 0; capture_next(s, &pos, &gap, &count); )
+			s->last_tsc += gap;
+	}
+
+	fclose(f);
+	return (int)n;
+}
@@ -0,0 +1,118 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CAPTURE_B_QUQUQ_H_
+#define _CAPTURE_B_QUQUQ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Traffic capture for offline replay, built into fifo with -DFIFO_CAPTURE.
+ *
+ * A stream records one side of a live queue: for every enqueue (or dequeue) the TSC and the
+ * number of elements moved. Records are delta coded, the gap since the previous record and
+ * the count as LEB128 varints, so a busy stream costs 2-4 bytes per operation. The buffer is
+ * allocated and touched in capture_open(), capture_record() is a handful of stores. A full
+ * buffer ends the recording instead of wrapping, replay needs the gaps in one piece; what
+ * comes after is only counted in `dropped`.
+ *
+ * capture_write() stores the streams together with the TSC rate of the capturing machine, so
+ * test_replay can rescale the gaps to the box it runs on and replay them against any queue. */
+
+#ifndef CAPTURE_BYTES
+#define CAPTURE_BYTES (1024 * 1024 * 64)	/* buffer per stream */
+#endif
+#define CAPTURE_MAX_STREAMS 64
+#define CAPTURE_MAX_RECORD 15			/* varint gap + varint count */
+#define CAPTURE_MAGIC 0x3130544150435142ULL	/* "BQCAPT01" */
+
+enum capture_side {
+	CAPTURE_ENQUEUE = 0,
+	CAPTURE_DEQUEUE
+};
+
+struct capture_stream {
+	uint8_t		*buf;
+	size_t		len;
+	size_t		cap;
+	uint64_t	first_tsc;	/* of the first record */
+	uint64_t	last_tsc;	/* of the last record */
+	uint64_t	records;
+	uint64_t	elements;
+	uint64_t	dropped;	/* elements after the buffer filled up */
+	uint32_t	side;
+	uint32_t	id;		/* thread or queue number, free for the caller */
+};
+
+static inline uint8_t *capture_put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static inline void capture_record(struct capture_stream *s, uint64_t tsc, uint32_t count)
+{
+	uint8_t *p;
+
+	if (s->cap - s->len < CAPTURE_MAX_RECORD) {
+		s->dropped += count;
+		return;
+	}
+	if (!s->records)
+		s->first_tsc = s->last_tsc = tsc;
+	p = capture_put_varint(s->buf + s->len, tsc - s->last_tsc);
+	p = capture_put_varint(p, count);
+	s->len = (size_t)(p - s->buf);
+	s->last_tsc = tsc;
+	s->records++;
+	s->elements += count;
+}
+
+/* Allocate and touch a buffer of `bytes`. Returns 0 or -1. */
+int capture_open(struct capture_stream *s, uint32_t side, uint32_t id, size_t bytes);
+void capture_close(struct capture_stream *s);
+
+/* Walk the records of a stream: *pos starts at 0. Returns 1 and the record, or 0 at the end. */
+int capture_next(const struct capture_stream *s, size_t *pos, uint64_t *gap, uint32_t *count);
+
+/* TSC ticks per second of this machine, measured against CLOCK_MONOTONIC (takes ~20 ms). */
+uint64_t capture_tsc_hz(void);
+
+/* Write n streams to path. Call once the captured threads have stopped. Returns 0 or -1. */
+int capture_write(const char *path, struct capture_stream *const *streams, uint32_t n);
+
+/* Read up to max streams from path into streams[] (buffers allocated, free with
+ * capture_close()). Returns the number of streams, or -1; *tsc_hz gets the capture's rate. */
+int capture_read(const char *path, struct capture_stream *streams, uint32_t max, uint64_t *tsc_hz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
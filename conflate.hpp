@@ -0,0 +1,175 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CONFLATE_B_QUQUQ_H_
+#define _CONFLATE_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// Latest-value-wins mailbox over KEYS keys, one producer and one consumer.
+//
+//   conflating_mailbox<1024> m;
+//   producer:  m.publish(key, value);                       never waits
+//   consumer:  while ( m.poll(&key, &value) == m.SUCCESS ) { ... }   or m.drain(keys, values, n)
+//
+// Every key has a slot holding its newest value under a seqlock version word, and a dirty flag.
+// publish() overwrites the slot in place; only when the key was clean does it also put the key
+// into a queue<> of dirty keys. A key is in that ring at most once, so the ring (RING_SIZE >=
+// KEYS) never fills and the producer never waits, however far behind the consumer is. The
+// consumer takes dirty keys in batches, clears the flag and then reads the slot, retrying while
+// the producer is in the middle of a write. So the consumer pays once per changed key, not once
+// per update.
+//
+// Flag and value must not cross: publish() writes the value before it sets the flag, poll()
+// clears the flag before it reads the value, and both flag updates are exchanges (full barriers
+// on x86). Either the producer finds the flag clear and queues the key again, or the consumer
+// reads the new value. The second case can queue a key whose value was already delivered; the
+// consumer remembers the version it delivered per key and skips such entries.
+//
+// T is copied with plain loads and stores, keep it small and trivially copyable.
+
+static inline constexpr size_t conflate_ring_size(size_t keys, size_t n = 64)
+{
+  return n >= keys ? n : conflate_ring_size(keys, n * 2);
+}
+
+template<size_t KEYS, typename T = uint64_t, size_t RING_SIZE = conflate_ring_size(KEYS)>
+class conflating_mailbox
+{
+  static_assert(RING_SIZE >= KEYS, "RING_SIZE must hold every key");
+
+public:
+  typedef queue<RING_SIZE, uint64_t, 0, true, false, true, true> ring_t;
+  typedef typename ring_t::ReturnCode ReturnCode;
+  static const ReturnCode SUCCESS = ring_t::SUCCESS;
+  static const ReturnCode BUFFER_EMPTY = ring_t::BUFFER_EMPTY;
+  typedef T value_type;
+
+  static size_t keys() { return KEYS; }
+
+  conflating_mailbox() : published_count(0), conflated_count(0), delivered_count(0)
+  {
+    for(size_t i = 0; i < KEYS; ++i) {
+      slots[i].version.store(0U, std::memory_order_relaxed);
+      slots[i].dirty.store(0U, std::memory_order_relaxed);
+      seen[i] = 0U;
+    }
+  }
+
+  /* Producer side. */
+
+  void publish(uint32_t key, T const &value)
+  {
+    slot &s = slots[key];
+    uint32_t const v = s.version.load(std::memory_order_relaxed);
+    s.version.store(v + 1U, std::memory_order_relaxed); // odd: write in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    s.value = value;
+    s.version.store(v + 2U, std::memory_order_release);
+
+    ++published_count;
+    if ( s.dirty.exchange(1U, std::memory_order_acq_rel) ) {
+      ++conflated_count; // the consumer has not taken the previous update yet
+      return;
+    }
+    ring.enqueue(key + 1U); // + 1: queue<> reserves 0 for empty slots
+  }
+
+  /* Consumer side. */
+
+  // The next changed key and its newest value.
+  ReturnCode poll(uint32_t *key, T *value)
+  {
+    uint64_t k;
+    for(;;) {
+      if ( !ring.can_dequeue() ) {
+        return BUFFER_EMPTY; // skip the backtracking probes while idle
+      }
+      if ( ring.dequeue(&k) != SUCCESS && ring.dequeue_unbatched(&k) != SUCCESS ) {
+        return BUFFER_EMPTY;
+      }
+      uint32_t const i = (uint32_t)(k - 1U);
+      slot &s = slots[i];
+      s.dirty.exchange(0U, std::memory_order_acq_rel);
+      uint32_t const v = read(s, value);
+      if ( v == seen[i] ) {
+        continue; // delivered through an earlier entry already
+      }
+      seen[i] = v;
+      *key = i;
+      ++delivered_count;
+      return SUCCESS;
+    }
+  }
+
+  // Up to max changed keys; returns how many.
+  size_t drain(uint32_t *keys, T *values, size_t max)
+  {
+    size_t n = 0;
+    while ( n < max && this->poll(&keys[n], &values[n]) == SUCCESS ) { ++n; }
+    return n;
+  }
+
+  uint64_t published() const { return published_count; }   // producer
+  uint64_t conflated() const { return conflated_count; }   // producer: overwrote a pending update
+  uint64_t delivered() const { return delivered_count; }   // consumer
+
+private:
+  struct slot {
+    std::atomic<uint32_t> version;
+    std::atomic<uint32_t> dirty;
+    T value;
+  };
+
+  static uint32_t read(slot const &s, T *value)
+  {
+    for(;;) {
+      uint32_t const v = s.version.load(std::memory_order_acquire);
+      if ( v & 1U ) {
+        cpu::relax();
+        continue;
+      }
+      *value = s.value;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ( s.version.load(std::memory_order_relaxed) == v ) { return v; }
+    }
+  }
+
+  /* Dirty keys, producer to consumer. */
+  ring_t ring;
+
+  /* Producer only. */
+  uint64_t published_count __attribute__ ((aligned(64)));
+  uint64_t conflated_count;
+
+  /* Consumer only. */
+  uint64_t delivered_count __attribute__ ((aligned(64)));
+  uint32_t seen[KEYS];
+
+  /* Written by the producer, read by the consumer. */
+  slot slots[KEYS] __attribute__ ((aligned(64)));
+} __attribute__ ((aligned(64)));
+
+#endif
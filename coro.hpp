@@ -0,0 +1,315 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CORO_B_QUQUQ_H_
+#define _CORO_B_QUQUQ_H_
+
+// Requires C++20 (-std=c++20).
+
+#include <stdint.h>
+#include <sched.h>
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <vector>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// C++20 coroutine awaitables on queue<>, plus the per-thread scheduler that runs them.
+//
+//   async_queue<> q;                                 // a queue<> with pop()/push()
+//
+//   scheduler::task consumer(async_queue<> &q) {     // on thread B
+//     for (;;) { uint64_t v = co_await q.pop(); ... }
+//   }
+//   scheduler::task producer(async_queue<> &q) {     // on thread A
+//     for (uint64_t i = 1; ; ++i) { co_await q.push(i); }
+//   }
+//
+//   scheduler s; s.spawn(consumer(q)); s.run();     // one scheduler per thread
+//
+// pop()/push() complete synchronously when the queue can serve them. Otherwise the coroutine
+// is parked on the scheduler of the thread it runs on, together with a readiness probe
+// (can_dequeue()/can_enqueue(): one read of the slot the peer writes), and the channel
+// remembers that scheduler in its hook for that direction. The peer's next successful push()
+// or pop() finds the hook set (one relaxed load per operation of a line written only on
+// park and wake-up), clears it and signals the scheduler. A scheduler pass looks at its
+// parked coroutines only when it has been signalled, so an idle pass costs one load however
+// many coroutines are parked, and one thread multiplexes any number of channels.
+//
+// The peer reads the hook without a fence, so it can miss a coroutine that parks at the same
+// moment. Such a signal is only delayed: every IDLE_PASSES_BEFORE_YIELD idle passes, before it
+// yields the CPU, the scheduler probes all parked coroutines anyway.
+
+class scheduler
+{
+public:
+  class task
+  {
+  public:
+    struct promise_type {
+      task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+      std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+      void return_void() { }
+      void unhandled_exception() { std::terminate(); }
+    };
+
+    task(task &&other) : h(other.h) { other.h = NULL; }
+    ~task() { if ( h ) { h.destroy(); } }
+
+  private:
+    friend class scheduler;
+    explicit task(std::coroutine_handle<promise_type> h_) : h(h_) { }
+    task(task const &) = delete;
+    task & operator=(task const &) = delete;
+
+    std::coroutine_handle<promise_type> h;
+  };
+
+  typedef bool (*probe_t)(void const *);
+
+  enum { IDLE_PASSES_BEFORE_YIELD = 1024 };
+
+  scheduler() : signalled(0), live(0), parks(0), resumes(0), sweeps(0) { }
+
+  ~scheduler()
+  {
+    for(size_t i = 0U; i < ready.size(); ++i) { ready[i].destroy(); }
+    for(size_t i = 0U; i < parked.size(); ++i) { parked[i].h.destroy(); }
+  }
+
+  // The scheduler running on the calling thread (NULL outside run()).
+  static scheduler *& current()
+  {
+    static thread_local scheduler *s = NULL;
+    return s;
+  }
+
+  // Takes ownership; the task starts on the next pass.
+  void spawn(task t)
+  {
+    ready.push_back(t.h);
+    t.h = NULL;
+    ++live;
+  }
+
+  // Run until every spawned task has finished.
+  void run()
+  {
+    scheduler *outer = current();
+    current() = this;
+    for(unsigned idle = 1; live; ) {
+      if ( this->run_once() ) { idle = 1; continue; }
+      if ( idle++ % IDLE_PASSES_BEFORE_YIELD == 0 ) {
+        // a peer may have missed the hook of a coroutine parking at that moment
+        ++sweeps;
+        if ( this->wake_parked() ) { idle = 1; continue; }
+        sched_yield();
+      }
+      else {
+        cpu::relax();
+      }
+    }
+    current() = outer;
+  }
+
+  // Resume the ready tasks, then, if a peer has signalled, every parked task whose probe
+  // succeeds. Returns false if nothing could run.
+  bool run_once()
+  {
+    bool progress = false;
+
+    while ( !ready.empty() ) {
+      std::coroutine_handle<> h = ready.front();
+      ready.pop_front();
+      this->resume(h);
+      progress = true;
+    }
+
+    if ( signalled.load(std::memory_order_relaxed) && signalled.exchange(0, std::memory_order_acquire) ) {
+      progress |= this->wake_parked();
+    }
+
+    return progress;
+  }
+
+  // Awaiter hook: resume h once probe(obj) returns true, after a signal() or a sweep.
+  void park(std::coroutine_handle<> h, probe_t probe, void const *obj)
+  {
+    waiter const w = { h, probe, obj };
+    parked.push_back(w);
+    ++parks;
+  }
+
+  // Called by a peer, from any thread: something this scheduler waits for may be ready.
+  void signal() { signalled.store(1, std::memory_order_release); }
+
+  size_t tasks() const { return live; }
+  // Awaits that had to suspend, and coroutine resumptions (first starts included).
+  uint64_t parked_count() const { return parks; }
+  uint64_t resumed_count() const { return resumes; }
+  // Probes of all parked coroutines without a signal.
+  uint64_t sweep_count() const { return sweeps; }
+
+private:
+  struct waiter {
+    std::coroutine_handle<> h;
+    probe_t probe;
+    void const *obj;
+  };
+
+  bool wake_parked()
+  {
+    bool progress = false;
+    for(size_t i = 0U; i < parked.size(); ) {
+      if ( !parked[i].probe(parked[i].obj) ) { ++i; continue; }
+      std::coroutine_handle<> h = parked[i].h;
+      parked[i] = parked.back();
+      parked.pop_back();
+      this->resume(h);
+      progress = true;
+    }
+    return progress;
+  }
+
+  void resume(std::coroutine_handle<> h)
+  {
+    ++resumes;
+    h.resume();
+    if ( h.done() ) {
+      h.destroy();
+      --live;
+    }
+  }
+
+  /* Written by peers. */
+  std::atomic<uint32_t> signalled __attribute__ ((aligned(64)));
+
+  /* Owner thread only. */
+  std::deque< std::coroutine_handle<> > ready __attribute__ ((aligned(64)));
+  std::vector<waiter> parked;
+  size_t live;
+  uint64_t parks;
+  uint64_t resumes;
+  uint64_t sweeps;
+};
+
+// queue<> with co_await-able pop() (consumer) and push() (producer).
+// The default ring has no congestion penalty: a failed batch claim should hand the thread
+// back to the scheduler, not spin on it.
+template<typename Q = queue<(1024 * 8), uint64_t, 0> >
+class async_queue : public Q
+{
+public:
+  typedef typename Q::element_type element_type;
+
+  class pop_awaiter
+  {
+  public:
+    bool await_ready() { got = q->try_pop(&value); return got; }
+    void await_suspend(std::coroutine_handle<> h) { q->wait(q->pop_hook, h, &async_queue::readable); }
+    element_type await_resume()
+    {
+      // resumed only once the slot at tail is filled, and nobody else consumes
+      if ( !got ) { while ( !q->try_pop(&value) ) { cpu::relax(); } }
+      q->wake(q->push_hook);
+      return value;
+    }
+
+  private:
+    friend class async_queue;
+    explicit pop_awaiter(async_queue *q_) : q(q_), got(false) { }
+
+    async_queue *q;
+    element_type value;
+    bool got;
+  };
+
+  class push_awaiter
+  {
+  public:
+    bool await_ready()
+    {
+      done = q->Q::enqueue(value) == Q::SUCCESS;
+      if ( done ) { q->wake(q->pop_hook); }
+      return done;
+    }
+    void await_suspend(std::coroutine_handle<> h) { q->wait(q->push_hook, h, &async_queue::writable); }
+    void await_resume()
+    {
+      // resumed only once the slot at head is free, and nobody else produces
+      if ( done ) { return; }
+      while ( q->Q::enqueue(value) != Q::SUCCESS ) { cpu::relax(); }
+      q->wake(q->pop_hook);
+    }
+
+  private:
+    friend class async_queue;
+    push_awaiter(async_queue *q_, element_type v) : q(q_), value(v), done(false) { }
+
+    async_queue *q;
+    element_type value;
+    bool done;
+  };
+
+  async_queue() : pop_hook(NULL), push_hook(NULL) { }
+
+  pop_awaiter pop() { return pop_awaiter(this); }
+  push_awaiter push(element_type value) { return push_awaiter(this, value); }
+
+private:
+  typedef std::atomic<scheduler *> hook_t;
+
+  // Park the current coroutine and leave its scheduler in the hook for the peer. The probe
+  // right after covers a peer that completed between the failed attempt and the hook store.
+  void wait(hook_t &hook, std::coroutine_handle<> h, scheduler::probe_t probe)
+  {
+    scheduler *const s = scheduler::current();
+    s->park(h, probe, this);
+    hook.store(s, std::memory_order_seq_cst);
+    if ( probe(this) ) { s->signal(); }
+  }
+
+  // After a successful operation: signal the scheduler parked on the other direction.
+  void wake(hook_t &hook)
+  {
+    if ( hook.load(std::memory_order_relaxed) == NULL ) { return; }
+    scheduler *const s = hook.exchange(NULL, std::memory_order_acq_rel);
+    if ( s ) { s->signal(); }
+  }
+
+  bool try_pop(element_type *value)
+  {
+    if ( !this->can_dequeue() ) { return false; }
+    return this->Q::dequeue(value) == Q::SUCCESS || this->Q::dequeue_unbatched(value) == Q::SUCCESS;
+  }
+
+  static bool readable(void const *q) { return static_cast<async_queue const *>(q)->can_dequeue(); }
+  static bool writable(void const *q) { return static_cast<async_queue const *>(q)->can_enqueue(); }
+
+  /* Set by the side that parks, cleared by the peer that signals. */
+  hook_t pop_hook __attribute__ ((aligned(64)));
+  hook_t push_hook;
+};
+
+#endif
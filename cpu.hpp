@@ -0,0 +1,75 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CPU_B_QUQUQ_H_
+#define _CPU_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sched.h>
+
+// Small helpers shared by the runtimes built on top of queue<> (see fifo2.hpp).
+// queue<> keeps its own private copies so that fifo2.hpp stays self-contained.
+
+namespace cpu
+{
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+
+  static inline uint64_t read_tsc()
+  {
+    uint32_t msw, lsw;
+    asm volatile("rdtsc; movl %%edx, %0; movl %%eax, %1" : "=r" (msw), "=r"(lsw) :: "%edx", "%eax");
+    uint64_t const time = ((uint64_t) msw << 32) | lsw;
+    return time;
+  }
+
+  static inline void relax() { asm volatile("rep; nop" ::: "memory"); }
+
+#else
+
+  static inline uint64_t read_tsc() { return 0; }
+  static inline void relax() { asm volatile("" ::: "memory"); }
+
+#endif
+
+  // Compiler-only barrier; x86 keeps stores (and loads) in program order.
+  static inline void barrier() { asm volatile("" ::: "memory"); }
+
+  // Pin the calling thread to cpu_id; a negative cpu_id leaves the thread unpinned.
+  // Returns false (and reports) if the kernel refuses, the caller decides whether that is fatal.
+  static inline bool pin(int cpu_id)
+  {
+    if ( cpu_id < 0 ) { return true; }
+
+    cpu_set_t cur_mask;
+    CPU_ZERO(&cur_mask);
+    CPU_SET(cpu_id, &cur_mask);
+    if (sched_setaffinity(0, sizeof(cur_mask), &cur_mask) < 0) {
+      perror("Error: sched_setaffinity");
+      return false;
+    }
+    return true;
+  }
+
+} // namespace cpu
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _DUPLEX_B_QUQUQ_H_
+#define _DUPLEX_B_QUQUQ_H_
+
+#include <stdint.h>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// Request/response channel between one client thread and one server thread.
+//
+//   duplex_channel<> ch;
+//   client:  uint64_t r = ch.call(x);            or send() ... receive() for several in flight
+//   server:  while ( ch.next_request(&id, &x) != ch.SUCCESS ) { } ch.reply(id, f(x));
+//
+// The two directions are queue<>s with the same configuration. Every message carries a 16-bit
+// correlation id next to a 48-bit payload; send() hands out the id and reply() echoes it, so a
+// client with several requests outstanding can match responses (the server may answer them in
+// any order). Ids start at 1 and skip 0, which keeps every message non-zero for queue<>.
+//
+// BATCHED=false turns consumer batching off in both rings: a message is visible to the other
+// side as soon as it is written, which is what a lone round trip needs. BATCHED=true keeps
+// consumer batching (with no congestion penalty) for throughput when many requests are in flight,
+// and flushes per round trip: when no batch can be claimed the receiver takes single elements
+// with dequeue_unbatched(), so the last request of a burst is never held back waiting for more.
+
+template<size_t QUEUE_SIZE = 1024, bool BATCHED = false>
+class duplex_channel
+{
+public:
+  typedef queue<QUEUE_SIZE, uint64_t, 0, BATCHED, false, BATCHED, BATCHED> ring_t;
+  typedef typename ring_t::ReturnCode ReturnCode;
+  static const ReturnCode SUCCESS = ring_t::SUCCESS;
+  static const ReturnCode BUFFER_FULL = ring_t::BUFFER_FULL;
+  static const ReturnCode BUFFER_EMPTY = ring_t::BUFFER_EMPTY;
+
+  static const uint64_t PAYLOAD_BITS = 48;
+  static const uint64_t PAYLOAD_MASK = (1ULL << PAYLOAD_BITS) - 1;
+
+  static bool is_batched() { return BATCHED; }
+
+  duplex_channel() : next_id(0U) { }
+
+  /* Client side. */
+
+  // Queue a request; *id is what the matching response will carry.
+  ReturnCode send(uint64_t payload, uint16_t *id)
+  {
+    uint16_t const i = this->next_id == 0xffff ? 1 : this->next_id + 1;
+    ReturnCode const r = this->requests.enqueue(pack(i, payload));
+    if ( r == SUCCESS ) {
+      this->next_id = i;
+      *id = i;
+    }
+    return r;
+  }
+
+  ReturnCode receive(uint16_t *id, uint64_t *payload)
+  {
+    return take(this->responses, id, payload);
+  }
+
+  // One blocking round trip. Only for a client with nothing else in flight.
+  uint64_t call(uint64_t payload)
+  {
+    uint16_t id, rid;
+    uint64_t result;
+    while ( this->send(payload, &id) != SUCCESS ) { cpu::relax(); }
+    while ( this->receive(&rid, &result) != SUCCESS ) { cpu::relax(); }
+    return result;
+  }
+
+  /* Server side. */
+
+  ReturnCode next_request(uint16_t *id, uint64_t *payload)
+  {
+    return take(this->requests, id, payload);
+  }
+
+  ReturnCode reply(uint16_t id, uint64_t payload)
+  {
+    return this->responses.enqueue(pack(id, payload));
+  }
+
+private:
+  static uint64_t pack(uint16_t id, uint64_t payload)
+  {
+    return ((uint64_t)id << PAYLOAD_BITS) | (payload & PAYLOAD_MASK);
+  }
+
+  static ReturnCode take(ring_t &ring, uint16_t *id, uint64_t *payload)
+  {
+    uint64_t v;
+    if ( BATCHED && !ring.can_dequeue() ) {
+      return BUFFER_EMPTY; // skip the backtracking probes while idle
+    }
+    ReturnCode r = ring.dequeue(&v);
+    if ( BATCHED && r != SUCCESS ) {
+      r = ring.dequeue_unbatched(&v); // flush: do not hold the round trip for a batch
+    }
+    if ( r == SUCCESS ) {
+      *id = (uint16_t)(v >> PAYLOAD_BITS);
+      *payload = v & PAYLOAD_MASK;
+    }
+    return r;
+  }
+
+  /* Client to server. */
+  ring_t requests;
+  /* Client only. */
+  uint16_t next_id __attribute__ ((aligned(64)));
+  /* Server to client. */
+  ring_t responses;
+} __attribute__ ((aligned(64)));
+
+#endif
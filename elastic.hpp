@@ -0,0 +1,376 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ELASTIC_B_QUQUQ_H_
+#define _ELASTIC_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// Consumer threads for a group of queue<>s, as many as the backlog needs.
+//
+//   elastic_config cfg;  cfg.max_workers = 4;  cfg.cpus = {2, 3, 4, 5};
+//   elastic_pool<queue<>, handler> pool(cfg);   // void handler::operator()(size_t queue, uint64_t v)
+//   pool.attach(&q0); pool.attach(&q1); ...      // before start()
+//   pool.start();  ... producers run ...  pool.stop();
+//
+// Every worker thread exists from start() on, pinned to its cpu, but only the first
+// `active` ones run; the others are parked on a condition variable and burn nothing. Each queue is
+// assigned to one running worker, which is its only consumer.
+//
+// A controller thread wakes every period_us and reads every queue's depth() and the workers'
+// claim statistics (rounds that found work against rounds that found none). It adds a worker
+// when the backlog per running worker stays above high_depth, and parks one when it stays below
+// low_depth while the workers are mostly idle. "Stays" means hysteresis_ticks ticks in a row, so
+// a single burst does not make the pool flap. Every change redistributes the queues over the
+// running workers, deepest queue first to the least loaded worker.
+//
+// A queue changes hands without ever having two consumers. The controller only writes the
+// queue's `assigned` worker; the worker holding it (`holder`) lets go between two batches when
+// it sees it is no longer the assignee, and the new worker takes it only once it is free. The
+// consumer state lives in the queue<> itself, so the next worker carries on where the last one
+// stopped. A worker parks only once it holds no queue.
+//
+// Running workers with nothing to do sleep idle_sleep_us between rounds after a few empty ones
+// (0: spin), so even the minimum pool does not spin a core flat out off-peak.
+
+struct elastic_config {
+  size_t min_workers;
+  size_t max_workers;
+  size_t high_depth;          // elements per running worker to add a worker
+  size_t low_depth;           // ... to park one
+  unsigned hysteresis_ticks;
+  unsigned period_us;         // controller tick
+  unsigned idle_sleep_us;
+  size_t batch;               // elements per queue per round
+  std::vector<int> cpus;      // worker i runs on cpus[i % size]; empty: unpinned
+
+  elastic_config()
+    : min_workers(1), max_workers(4), high_depth(1024), low_depth(64), hysteresis_ticks(3)
+    , period_us(1000), idle_sleep_us(50), batch(64)
+  { }
+};
+
+template<typename Q, typename HANDLER, size_t MAX_QUEUES = 64, size_t MAX_WORKERS = 64>
+class elastic_pool
+{
+public:
+  typedef typename Q::element_type element_type;
+
+  explicit elastic_pool(elastic_config const &cfg_, HANDLER handler_ = HANDLER())
+    : cfg(cfg_), handler(handler_), num_queues(0), active(0), stopping(false)
+    , up_ticks(0), down_ticks(0), scale_up_count(0), scale_down_count(0), reassign_count(0)
+  {
+    if ( cfg.max_workers > MAX_WORKERS ) { cfg.max_workers = MAX_WORKERS; }
+    if ( cfg.max_workers == 0 ) { cfg.max_workers = 1; }
+    if ( cfg.min_workers == 0 ) { cfg.min_workers = 1; }
+    if ( cfg.min_workers > cfg.max_workers ) { cfg.min_workers = cfg.max_workers; }
+    pthread_mutex_init(&park_lock, NULL);
+    pthread_cond_init(&park_cond, NULL);
+  }
+
+  ~elastic_pool()
+  {
+    pthread_cond_destroy(&park_cond);
+    pthread_mutex_destroy(&park_lock);
+  }
+
+  static const size_t ATTACH_FULL = ~(size_t)0;
+
+  // Before start(). Returns the queue's index, as passed to the handler, or ATTACH_FULL when
+  // MAX_QUEUES queues are attached already.
+  size_t attach(Q *q)
+  {
+    if ( num_queues >= MAX_QUEUES ) { return ATTACH_FULL; }
+    slot &s = slots[num_queues];
+    s.q = q;
+    s.assigned.store(0, std::memory_order_relaxed);
+    s.holder.store(NONE, std::memory_order_relaxed);
+    return num_queues++;
+  }
+
+  void start()
+  {
+    active.store(cfg.min_workers, std::memory_order_relaxed);
+    this->rebalance(cfg.min_workers);
+    reassign_count = 0;
+    for(size_t w = 0; w < cfg.max_workers; ++w) {
+      workers[w].pool = this;
+      workers[w].id = w;
+      workers[w].rounds.store(0, std::memory_order_relaxed);
+      workers[w].empty_rounds.store(0, std::memory_order_relaxed);
+      workers[w].seen_rounds = workers[w].seen_empty = 0;
+      pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]);
+    }
+    pthread_create(&controller, NULL, controller_main, this);
+  }
+
+  // Once the producers are done: drains every queue, then joins all threads.
+  void stop()
+  {
+    stopping.store(true, std::memory_order_release);
+    pthread_join(controller, NULL); // assignments are final from here on
+    pthread_mutex_lock(&park_lock);
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+    for(size_t w = 0; w < cfg.max_workers; ++w) { pthread_join(workers[w].thread, NULL); }
+  }
+
+  size_t active_workers() const { return active.load(std::memory_order_relaxed); }
+  uint64_t scale_ups() const { return scale_up_count; }
+  uint64_t scale_downs() const { return scale_down_count; }
+  uint64_t reassignments() const { return reassign_count; }
+
+  // One controller step; the controller thread calls it every period_us.
+  void tick()
+  {
+    size_t const n = active.load(std::memory_order_relaxed);
+    size_t total = 0;
+    for(size_t i = 0; i < num_queues; ++i) { total += slots[i].q->depth(); }
+
+    uint64_t rounds = 0, empty = 0;
+    for(size_t w = 0; w < n; ++w) {
+      uint64_t const r = workers[w].rounds.load(std::memory_order_relaxed);
+      uint64_t const e = workers[w].empty_rounds.load(std::memory_order_relaxed);
+      rounds += r - workers[w].seen_rounds;
+      empty += e - workers[w].seen_empty;
+      workers[w].seen_rounds = r;
+      workers[w].seen_empty = e;
+    }
+    bool const mostly_idle = rounds == 0 || empty * 2 > rounds;
+
+    size_t const per_worker = total / n;
+    if ( per_worker > cfg.high_depth && n < cfg.max_workers ) {
+      down_ticks = 0;
+      if ( ++up_ticks >= cfg.hysteresis_ticks ) {
+        up_ticks = 0;
+        ++scale_up_count;
+        this->resize(n + 1);
+      }
+    }
+    else if ( per_worker < cfg.low_depth && mostly_idle && n > cfg.min_workers ) {
+      up_ticks = 0;
+      if ( ++down_ticks >= cfg.hysteresis_ticks ) {
+        down_ticks = 0;
+        ++scale_down_count;
+        this->resize(n - 1);
+      }
+    }
+    else {
+      up_ticks = down_ticks = 0;
+    }
+  }
+
+private:
+  enum { NONE = -1 };
+
+  struct slot {
+    Q *q;
+    std::atomic<int> assigned;  // written by the controller
+    std::atomic<int> holder;    // the worker consuming it now, or NONE
+  } __attribute__ ((aligned(64)));
+
+  struct worker {
+    elastic_pool *pool;
+    size_t id;
+    pthread_t thread;
+    std::atomic<uint64_t> rounds;
+    std::atomic<uint64_t> empty_rounds;
+    uint64_t seen_rounds;       // controller's copies from the last tick
+    uint64_t seen_empty;
+  } __attribute__ ((aligned(64)));
+
+  static void * worker_main(void *arg)
+  {
+    worker *w = static_cast<worker *>(arg);
+    w->pool->run_worker(w->id);
+    return NULL;
+  }
+
+  static void * controller_main(void *arg)
+  {
+    elastic_pool *p = static_cast<elastic_pool *>(arg);
+    while ( !p->stopping.load(std::memory_order_acquire) ) {
+      usleep(p->cfg.period_us);
+      if ( p->stopping.load(std::memory_order_acquire) ) { break; } // stop() came in the sleep
+      p->tick();
+    }
+    return NULL;
+  }
+
+  void run_worker(size_t me)
+  {
+    int const self = (int)me;
+    uint64_t idle = 0;
+
+    if ( !cfg.cpus.empty() ) { cpu::pin(cfg.cpus[me % cfg.cpus.size()]); }
+
+    for(;;) {
+      bool const finishing = stopping.load(std::memory_order_acquire);
+      size_t work = 0, waiting = 0, held = 0;
+
+      for(size_t i = 0; i < num_queues; ++i) {
+        slot &s = slots[i];
+        if ( s.holder.load(std::memory_order_acquire) == self ) {
+          if ( s.assigned.load(std::memory_order_acquire) != self ) {
+            s.holder.store(NONE, std::memory_order_release); // hand over between batches
+            continue;
+          }
+        }
+        else {
+          if ( s.assigned.load(std::memory_order_acquire) != self ) { continue; }
+          int expected = NONE;
+          if ( !s.holder.compare_exchange_strong(expected, self, std::memory_order_acq_rel) ) {
+            ++waiting; // the previous worker has not let go yet
+            continue;
+          }
+        }
+        ++held;
+        work += this->drain(s.q, i);
+      }
+
+      workers[me].rounds.fetch_add(1, std::memory_order_relaxed);
+      if ( work ) {
+        idle = 0;
+        continue;
+      }
+      workers[me].empty_rounds.fetch_add(1, std::memory_order_relaxed);
+
+      if ( finishing && waiting == 0 ) {
+        // all of its queues were empty after the producers stopped; let go of them in case
+        // a last tick has handed one to a worker that is still running
+        for(size_t i = 0; i < num_queues; ++i) {
+          if ( slots[i].holder.load(std::memory_order_relaxed) == self ) {
+            slots[i].holder.store(NONE, std::memory_order_release);
+          }
+        }
+        break;
+      }
+      if ( held == 0 && waiting == 0 && me >= active.load(std::memory_order_acquire) ) {
+        this->park(me);
+        continue;
+      }
+      if ( ++idle > 64 && cfg.idle_sleep_us ) {
+        usleep(cfg.idle_sleep_us);
+      }
+      else {
+        cpu::relax();
+        if ( (idle & 0xf) == 0 ) { sched_yield(); }
+      }
+    }
+  }
+
+  size_t drain(Q *q, size_t i)
+  {
+    element_type v;
+    size_t n = 0;
+    while ( n < cfg.batch && q->can_dequeue() ) {
+      // a burst's last elements must not wait for a consumer batch to fill behind them
+      if ( q->dequeue(&v) != Q::SUCCESS && q->dequeue_unbatched(&v) != Q::SUCCESS ) { break; }
+      handler(i, v);
+      ++n;
+    }
+    return n;
+  }
+
+  void park(size_t me)
+  {
+    pthread_mutex_lock(&park_lock);
+    while ( me >= active.load(std::memory_order_acquire) && !stopping.load(std::memory_order_acquire) ) {
+      pthread_cond_wait(&park_cond, &park_lock);
+    }
+    pthread_mutex_unlock(&park_lock);
+  }
+
+  void resize(size_t n)
+  {
+    if ( n > active.load(std::memory_order_relaxed) ) {
+      pthread_mutex_lock(&park_lock);
+      active.store(n, std::memory_order_release);
+      pthread_cond_broadcast(&park_cond);
+      pthread_mutex_unlock(&park_lock);
+      this->rebalance(n);
+    }
+    else {
+      // queues first: the parked worker must have nothing assigned when it looks
+      this->rebalance(n);
+      pthread_mutex_lock(&park_lock);
+      active.store(n, std::memory_order_release);
+      pthread_mutex_unlock(&park_lock);
+    }
+  }
+
+  // Deepest queue first, each to the running worker with the least backlog so far.
+  void rebalance(size_t n)
+  {
+    size_t order[MAX_QUEUES], depth[MAX_QUEUES], load[MAX_WORKERS];
+    for(size_t i = 0; i < num_queues; ++i) {
+      order[i] = i;
+      depth[i] = slots[i].q->depth();
+    }
+    for(size_t i = 1; i < num_queues; ++i) {
+      for(size_t j = i; j > 0 && depth[order[j]] > depth[order[j - 1]]; --j) {
+        size_t const t = order[j]; order[j] = order[j - 1]; order[j - 1] = t;
+      }
+    }
+    for(size_t w = 0; w < n; ++w) { load[w] = 0; }
+
+    for(size_t k = 0; k < num_queues; ++k) {
+      size_t const i = order[k];
+      size_t best = 0;
+      for(size_t w = 1; w < n; ++w) {
+        if ( load[w] < load[best] ) { best = w; }
+      }
+      load[best] += depth[i] + 1; // + 1: spread empty queues too
+      if ( slots[i].assigned.load(std::memory_order_relaxed) != (int)best ) {
+        slots[i].assigned.store((int)best, std::memory_order_release);
+        ++reassign_count;
+      }
+    }
+  }
+
+  elastic_config cfg;
+  HANDLER handler;
+  size_t num_queues;
+  std::atomic<size_t> active;
+  std::atomic<bool> stopping;
+  pthread_t controller;
+  pthread_mutex_t park_lock;
+  pthread_cond_t park_cond;
+
+  /* Controller only. */
+  unsigned up_ticks;
+  unsigned down_ticks;
+  uint64_t scale_up_count;
+  uint64_t scale_down_count;
+  uint64_t reassign_count;
+
+  slot slots[MAX_QUEUES];
+  worker workers[MAX_WORKERS];
+};
+
+#endif
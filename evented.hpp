@@ -0,0 +1,184 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _EVENTED_B_QUQUQ_H_
+#define _EVENTED_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include <atomic>
+#include "fifo2.hpp"
+
+// queue<> with an eventfd the consumer can put in its epoll set.
+//
+// consumer:
+//   epoll_ctl(ep, EPOLL_CTL_ADD, q.fd(), EPOLLIN);
+//   for (;;) {
+//     while ( q.dequeue(&v) == SUCCESS ) { ... }   // drain
+//     if ( q.arm() ) { epoll_wait(ep, ...); }       // false: elements arrived meanwhile, drain again
+//   }
+//
+// producer:
+//   q.enqueue(v); ...                               // publish() is optional
+//
+// The consumer arms the queue only when it has drained it, so the queue is empty at that point
+// and the first element to arrive is the empty -> non-empty transition. The producer looks at
+// the armed flag on exactly those enqueues (queue<>::enqueued_into_empty(): the consumer has
+// taken the previous element) and on the first enqueue of every NOTIFY_BATCH, never per
+// element of a backlog, and disarms it when it signals: at most one eventfd write per consumer
+// sleep. NOTIFY_BATCH = 0 follows the queue: Q::consumer_batch_size(), or queue_size() / 16.
+//
+// The wake-up cannot be lost: arm() sets the flag and then re-probes the queue (can_dequeue()),
+// the producer stores the element and then reads the previous slot and the flag. The producer's
+// store and its read of the previous slot must not be reordered either, and a fence there would
+// be paid per element, so arm() issues membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED) instead: a
+// full barrier on every running thread of the process, a few microseconds once per consumer
+// sleep. Either the producer's read comes after it and sees the slot taken, or its store was
+// drained by it and arm() sees the element. Where the kernel lacks membarrier (before Linux
+// 4.14), the producer fences on every enqueue. No call from the producer is needed after its
+// last element; publish() only forces the check for callers that want it.
+//
+// With EVENTFD = false there is no descriptor, no flag and no fence: enqueue() and dequeue()
+// are queue<>'s, arm() returns true and fd() returns -1.
+
+template<typename Q = queue<>, bool EVENTFD = true, size_t NOTIFY_BATCH = 0>
+class evented_queue : public Q
+{
+public:
+  typedef typename Q::element_type element_type;
+  typedef typename Q::ReturnCode ReturnCode;
+
+  evented_queue() : efd(-1), expedited(false), armed(0), unpublished(0), signals(0)
+  {
+    if ( EVENTFD ) {
+      efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if ( efd < 0 ) { perror("Error: eventfd"); }
+      expedited = register_membarrier();
+    }
+  }
+
+  ~evented_queue() { if ( efd >= 0 ) { close(efd); } }
+
+  int fd() const { return efd; }
+
+  static size_t notify_batch()
+  {
+    if ( NOTIFY_BATCH ) { return NOTIFY_BATCH; }
+    return Q::consumer_batch_size() ? Q::consumer_batch_size() : Q::queue_size() / 16;
+  }
+
+  /* Producer side. */
+
+  ReturnCode enqueue(element_type value)
+  {
+    ReturnCode const r = Q::enqueue(value);
+    if ( EVENTFD && r == Q::SUCCESS ) {
+      if ( expedited ) {
+        std::atomic_signal_fence(std::memory_order_seq_cst); // arm() fences for us
+      }
+      else {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+      if ( unpublished++ == 0 || Q::enqueued_into_empty() ) { this->notify(); }
+      if ( unpublished >= notify_batch() ) { unpublished = 0; }
+    }
+    return r;
+  }
+
+  // Wake the consumer if it sleeps on elements enqueued since the last check.
+  void publish()
+  {
+    if ( !EVENTFD || unpublished == 0 ) { return; }
+    unpublished = 0;
+    this->notify();
+  }
+
+  // eventfd writes so far.
+  uint64_t signalled() const { return signals; }
+
+private:
+  // Once per process; false if the kernel cannot do expedited private barriers.
+  static bool register_membarrier()
+  {
+    static bool const registered =
+      (syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0) & MEMBARRIER_CMD_PRIVATE_EXPEDITED) != 0
+      && syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+    return registered;
+  }
+
+  void notify()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ( armed.load(std::memory_order_relaxed) && armed.exchange(0, std::memory_order_acq_rel) ) {
+      uint64_t const one = 1;
+      if ( write(efd, &one, sizeof(one)) != sizeof(one) ) { perror("Error: eventfd write"); }
+      signals ++;
+    }
+  }
+
+public:
+  /* Consumer side. */
+
+  // Includes the elements consumer batching would hold back: a consumer about to sleep
+  // must not leave any behind.
+  ReturnCode dequeue(element_type *value)
+  {
+    if ( Q::dequeue(value) == Q::SUCCESS ) { return Q::SUCCESS; }
+    return Q::dequeue_unbatched(value);
+  }
+
+  // Call once dequeue() returned BUFFER_EMPTY. Returns true when the consumer may wait for
+  // fd() to become readable, false when elements arrived meanwhile.
+  bool arm()
+  {
+    if ( !EVENTFD ) { return true; }
+
+    uint64_t count;
+    if ( read(efd, &count, sizeof(count)) < 0 ) { } // clear a stale signal, EAGAIN if none
+
+    armed.store(1, std::memory_order_seq_cst);
+    if ( expedited && syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) != 0 ) {
+      perror("Error: membarrier");
+    }
+    if ( this->can_dequeue() ) {
+      armed.exchange(0, std::memory_order_acq_rel); // the producer may have signalled already
+      return false;
+    }
+    return true;
+  }
+
+private:
+  int efd;
+  bool expedited;
+
+  /* Written by consumer, read (and cleared) by producer. */
+  std::atomic<uint32_t> armed __attribute__ ((aligned(64)));
+
+  /* Accessed by producer only. */
+  size_t unpublished __attribute__ ((aligned(64)));
+  uint64_t signals;
+} __attribute__ ((aligned(64)));
+
+#endif
@@ -21,6 +21,7 @@
 
 
 #include "fifo.h"
+#include "trace.h"
 #include <sched.h>
 
 #include <stdio.h>
@@ -51,7 +52,7 @@ inline void wait_ticks(uint64_t ticks)
         do {
                 current_time = read_tsc();
         } while (current_time < time);
-        printf("wait_ticks\n");
+        TRACE(TRACE_STALL, (uint32_t)(current_time - time + ticks), 0);
 }
 
 static ELEMENT_TYPE ELEMENT_ZERO = 0x0UL;
@@ -86,12 +87,13 @@ int enqueue(struct queue_t * q, ELEMENT_TYPE value)
 			tmp_head = 0;
 
 		if ( q->data[tmp_head] ) {
-      printf("tmp_head=%d\n", tmp_head);
+			TRACE(TRACE_PROD_FULL, tmp_head, 0);
 			wait_ticks(CONGESTION_PENALTY);
 			return BUFFER_FULL;
 		}
 
 		q->batch_head = tmp_head;
+		TRACE(TRACE_PROD_CLAIM, tmp_head, 0);
 	}
 	q->data[q->head] = value;
 	q->head ++;
@@ -138,7 +140,7 @@ static inline int backtracking(struct queue_t * q)
 	unsigned long batch_size = q->batch_history;
 	while (!(q->data[tmp_tail])) {
 
-    printf("tmp_tail=%d\n", tmp_tail);
+		TRACE(TRACE_BACKTRACK, tmp_tail, batch_size);
 		wait_ticks(CONGESTION_PENALTY);
 
 		batch_size = batch_size >> 1;
@@ -147,8 +149,10 @@ static inline int backtracking(struct queue_t * q)
 			if (tmp_tail >= QUEUE_SIZE)
 				tmp_tail = 0;
 		}
-		else
+		else {
+			TRACE(TRACE_CONS_EMPTY, q->tail, 0);
 			return -1;
+		}
 	}
 #if defined(ADAPTIVE)
 	q->batch_history = batch_size;
@@ -156,7 +160,7 @@ static inline int backtracking(struct queue_t * q)
 
 #else
 	if ( !q->data[tmp_tail] ) {
-    printf(".2 tmp_tail=%d\n", tmp_tail);
+		TRACE(TRACE_CONS_EMPTY, q->tail, 0);
 		wait_ticks(CONGESTION_PENALTY); 
 		return -1;
 	}
@@ -167,6 +171,8 @@ static inline int backtracking(struct queue_t * q)
 			0 : tmp_tail + 1;
 	}
 	q->batch_tail = tmp_tail;
+	TRACE(TRACE_CONS_CLAIM, tmp_tail,
+		(tmp_tail + QUEUE_SIZE - q->tail) % QUEUE_SIZE);
 
 	return 0;
 }
@@ -88,7 +88,7 @@ void queue_init(struct queue_t *q);
 int enqueue(struct queue_t *q, ELEMENT_TYPE value);
 int dequeue(struct queue_t *q, ELEMENT_TYPE *value);
 
-inline uint64_t read_tsc();
-inline void wait_ticks(uint64_t);
+uint64_t read_tsc();
+void wait_ticks(uint64_t);
 
 #endif
@@ -28,6 +28,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdint.h>
+#include <assert.h>
 
 // The queue claims internal buffer in batches (if CONS_BATCH/PROD_BATCH == false,
 // then the batch size is 1).
@@ -46,6 +47,7 @@ class queue
 {
 public:
   enum ReturnCode { SUCCESS=0, BUFFER_FULL=1, BUFFER_EMPTY=2 };
+  typedef ELEMENT_TYPE element_type;
 
   static size_t queue_size() { return QUEUE_SIZE; }
   static size_t congesion_penalty() { return CONGESTION_PENALTY_CYCLES; }
@@ -56,8 +58,8 @@ public:
   static size_t consumer_batch_size() { return CONS_BATCH ? CONS_BATCH_SIZE : 0U; }
   static size_t producer_batch_size() { return PROD_BATCH ? PROD_BATCH_SIZE : 0U; }
 
-  queue() : head(0U), batch_head (0U)
-    , tail(0U), batch_tail(0U), batch_history(CONS_BATCH_SIZE)
+  queue() : head(0U), batch_head (0U), producer_taken(0U)
+    , tail(0U), batch_tail(0U), consumer_taken(0U), batch_history(CONS_BATCH_SIZE)
     //, data() // calls default constructor for array elements
   {
     for(size_t i = 0U; i < QUEUE_SIZE; ++i) {
@@ -65,107 +67,397 @@ public:
     }
   }
 
+  // The direct calls use the queue's own indices: not while a producer_end (enqueue,
+  // can_enqueue, enqueued_into_empty) or a consumer_end (dequeue, dequeue_unbatched,
+  // can_dequeue) of that side is out, see below.
+
   enum ReturnCode enqueue(ELEMENT_TYPE value)
+  {
+#if defined(FIFO_DEBUG)
+    assert(!this->producer_taken);
+#endif
+    return do_enqueue(this->data, this->head, this->batch_head, value);
+  }
+
+  enum ReturnCode dequeue(ELEMENT_TYPE *value)
+  {
+#if defined(FIFO_DEBUG)
+    assert(!this->consumer_taken);
+#endif
+    return do_dequeue(this->data, this->tail, this->batch_tail, this->batch_history, value);
+  }
+
+  // Producer side: would enqueue() succeed right now? Same probe as enqueue(), without
+  // the congestion penalty.
+  bool can_enqueue() const
+  {
+#if defined(FIFO_DEBUG)
+    assert(!this->producer_taken);
+#endif
+    return do_can_enqueue(this->data, this->head, this->batch_head);
+  }
+
+  // Consumer side: would dequeue() or dequeue_unbatched() find an element right now?
+  // Costs one read of the slot at tail (no congestion penalty, no batch claim).
+  bool can_dequeue() const
+  {
+#if defined(FIFO_DEBUG)
+    assert(!this->consumer_taken);
+#endif
+    return do_can_dequeue(this->data, this->tail, this->batch_tail);
+  }
+
+  // Take the element at tail even if no consumer batch can be claimed.
+  // Consumer batching holds back the last elements of a burst until more arrive behind them;
+  // callers that know the producer has stopped writing (or cannot afford to wait) release them here.
+  enum ReturnCode dequeue_unbatched(ELEMENT_TYPE *value)
+  {
+#if defined(FIFO_DEBUG)
+    assert(!this->consumer_taken);
+#endif
+    return do_dequeue_unbatched(this->data, this->tail, this->batch_tail, this->batch_history, value);
+  }
+
+  // Producer side, right after a successful enqueue(): had the consumer already taken the
+  // element before it? True on every empty -> non-empty transition. head has moved past the
+  // new element, so the previous one is at head - 2. One read of a slot that is still in the
+  // producer's cache unless the consumer is right behind it.
+  bool enqueued_into_empty() const
+  {
+#if defined(FIFO_DEBUG)
+    assert(!this->producer_taken);
+#endif
+    uint32_t const prev = (this->head + QUEUE_SIZE - 2U) % QUEUE_SIZE;
+    return ELEMENT_ZERO == static_cast<ELEMENT_TYPE const volatile *>(this->data)[prev];
+  }
+
+  // Elements between tail and head, callable from any thread (a monitor, a controller).
+  // A snapshot of two indices that move independently, so approximate; and blind to a side
+  // that works through a handle, whose index is private until the handle is released.
+  size_t depth() const
+  {
+    uint32_t const h = this->head, t = this->tail;
+    if ( h == t ) {
+      return ELEMENT_ZERO != this->data[t] ? QUEUE_SIZE : 0U;
+    }
+    return (h + QUEUE_SIZE - t) % QUEUE_SIZE;
+  }
+
+  // Rewind a drained queue to its initial state without touching the data array.
+  // Only valid when no producer or consumer is using it and every slot is ELEMENT_ZERO,
+  // which is what the consumer leaves behind.
+  void reset()
+  {
+    this->head = 0U;
+    this->batch_head = 0U;
+    this->tail = 0U;
+    this->batch_tail = 0U;
+    this->batch_history = CONS_BATCH_SIZE;
+  }
+
+  // Single-owner ends of the queue.
+  //
+  //   queue<>::producer_end p = q.producer();   // in the producer thread
+  //   queue<>::consumer_end c = q.consumer();   // in the consumer thread
+  //
+  // A handle copies its side's indices out of the queue and works on the copies, which the
+  // compiler keeps in registers or on the owner's stack instead of storing every increment to
+  // a volatile member. Nothing has to be published to the other side: producer and consumer
+  // only meet in the data slots. The indices go back into the queue when the handle is
+  // destroyed or release()d, so the queue (or the next handle) carries on from there.
+  //
+  // Handles are move-only and each side hands out one at a time: a second producer() or
+  // consumer() while the first is alive returns an empty handle (operator bool is false), so
+  // two enqueuing threads show up at the call site instead of as corrupted data. While a handle
+  // is out, the same side of the queue must not be used directly: its indices are stale, and
+  // release() would overwrite whatever the direct calls did. The direct calls assert this
+  // when built with FIFO_DEBUG.
+  // Using an empty handle asserts as well.
+
+  class producer_end
+  {
+  public:
+    producer_end() : q(NULL), head(0U), batch_head(0U) { }
+    producer_end(producer_end &&o) noexcept : q(o.q), head(o.head), batch_head(o.batch_head) { o.q = NULL; }
+    producer_end & operator=(producer_end &&o) noexcept
+    {
+      if ( this != &o ) {
+        this->release();
+        this->q = o.q;
+        this->head = o.head;
+        this->batch_head = o.batch_head;
+        o.q = NULL;
+      }
+      return *this;
+    }
+    producer_end(producer_end const &) = delete;
+    producer_end & operator=(producer_end const &) = delete;
+    ~producer_end() { this->release(); }
+
+    explicit operator bool() const { return this->q != NULL; }
+
+    enum ReturnCode enqueue(ELEMENT_TYPE value)
+    {
+      assert(this->q);
+      return do_enqueue(this->q->slots(), this->head, this->batch_head, value);
+    }
+
+    bool can_enqueue() const
+    {
+      assert(this->q);
+      return do_can_enqueue(this->q->slots(), this->head, this->batch_head);
+    }
+
+    void release()
+    {
+      if ( this->q ) {
+        this->q->head = this->head;
+        this->q->batch_head = this->batch_head;
+        __sync_lock_release(&this->q->producer_taken);
+        this->q = NULL;
+      }
+    }
+
+  private:
+    friend class queue;
+    explicit producer_end(queue *q_) : q(q_), head(q_->head), batch_head(q_->batch_head) { }
+
+    queue *q;
+    uint32_t head;
+    uint32_t batch_head;
+  };
+
+  class consumer_end
+  {
+  public:
+    consumer_end() : q(NULL), tail(0U), batch_tail(0U), batch_history(0U) { }
+    consumer_end(consumer_end &&o) noexcept
+      : q(o.q), tail(o.tail), batch_tail(o.batch_tail), batch_history(o.batch_history) { o.q = NULL; }
+    consumer_end & operator=(consumer_end &&o) noexcept
+    {
+      if ( this != &o ) {
+        this->release();
+        this->q = o.q;
+        this->tail = o.tail;
+        this->batch_tail = o.batch_tail;
+        this->batch_history = o.batch_history;
+        o.q = NULL;
+      }
+      return *this;
+    }
+    consumer_end(consumer_end const &) = delete;
+    consumer_end & operator=(consumer_end const &) = delete;
+    ~consumer_end() { this->release(); }
+
+    explicit operator bool() const { return this->q != NULL; }
+
+    enum ReturnCode dequeue(ELEMENT_TYPE *value)
+    {
+      assert(this->q);
+      return do_dequeue(this->q->slots(), this->tail, this->batch_tail, this->batch_history, value);
+    }
+
+    enum ReturnCode dequeue_unbatched(ELEMENT_TYPE *value)
+    {
+      assert(this->q);
+      return do_dequeue_unbatched(this->q->slots(), this->tail, this->batch_tail, this->batch_history, value);
+    }
+
+    bool can_dequeue() const
+    {
+      assert(this->q);
+      return do_can_dequeue(this->q->slots(), this->tail, this->batch_tail);
+    }
+
+    void release()
+    {
+      if ( this->q ) {
+        this->q->tail = this->tail;
+        this->q->batch_tail = this->batch_tail;
+        this->q->batch_history = this->batch_history;
+        __sync_lock_release(&this->q->consumer_taken);
+        this->q = NULL;
+      }
+    }
+
+  private:
+    friend class queue;
+    explicit consumer_end(queue *q_)
+      : q(q_), tail(q_->tail), batch_tail(q_->batch_tail), batch_history(q_->batch_history) { }
+
+    queue *q;
+    uint32_t tail;
+    uint32_t batch_tail;
+    size_t batch_history;
+  };
+
+  // Empty if the other handle of that side is still alive.
+  producer_end producer()
+  {
+    if ( __sync_lock_test_and_set(&this->producer_taken, 1U) ) { return producer_end(); }
+    return producer_end(this);
+  }
+
+  consumer_end consumer()
+  {
+    if ( __sync_lock_test_and_set(&this->consumer_taken, 1U) ) { return consumer_end(); }
+    return consumer_end(this);
+  }
+
+private:
+  enum { CONS_BATCH_SIZE   = (QUEUE_SIZE/16) , BATCH_INCREAMENT  = (QUEUE_SIZE/32) }; // used iff CONS_BATCH
+  enum { PROD_BATCH_SIZE   = (QUEUE_SIZE/16) }; // used iff PROD_BATCH
+
+
+  /* Mostly accessed by producer. */
+  volatile	uint32_t	head;
+  volatile	uint32_t	batch_head; // used iff PROD_BATCH
+  volatile	uint32_t	producer_taken; // a producer_end is alive
+
+  /* Mostly accessed by consumer. */
+  volatile	uint32_t	tail __attribute__ ((aligned(64)));
+  volatile	uint32_t	batch_tail; // used iff CONS_BATCH
+  volatile	uint32_t	consumer_taken; // a consumer_end is alive
+  size_t batch_history; // used iff CONS_BATCH
+
+  /* Accessed by both producer and comsumer */
+  ELEMENT_TYPE	data[QUEUE_SIZE] __attribute__ ((aligned(64)));
+
+  static const ELEMENT_TYPE ELEMENT_ZERO = 0x0UL;
+
+  ELEMENT_TYPE volatile * slots() { return this->data; }
+
+  // The queue operations proper, on whichever copy of the indices the caller owns:
+  // the queue's own volatile members, or a handle's plain ones. A handle's index can live in a
+  // register, so it reads the slots through a volatile pointer (SLOT = ELEMENT_TYPE volatile),
+  // or a caller's spin loop could keep testing one stale load of the same slot.
+
+  template<typename SLOT, typename INDEX>
+  static enum ReturnCode do_enqueue(SLOT *data, INDEX &head, INDEX &batch_head, ELEMENT_TYPE value)
   {
     if ( PROD_BATCH ) {
 
-      if( this->head == this->batch_head ) {
+      if( head == batch_head ) {
         // try to allocate another batch
-        uint32_t tmp_head = this->head + PROD_BATCH_SIZE;
+        uint32_t tmp_head = head + PROD_BATCH_SIZE;
         if ( tmp_head >= QUEUE_SIZE ) { tmp_head = 0; }
 
-        if ( ELEMENT_ZERO != this->data[tmp_head] ) {
+        if ( ELEMENT_ZERO != data[tmp_head] ) {
           wait_ticks<true, true>(CONGESTION_PENALTY_CYCLES);
           // fail if the whole batch cannot be allocated
           return BUFFER_FULL;
         }
 
-        this->batch_head = tmp_head;
+        batch_head = tmp_head;
       }
 
     }
     else {
 
-      if ( ELEMENT_ZERO != this->data[this->head] ) {
-        // fail because this->head points at occupied element
+      if ( ELEMENT_ZERO != data[head] ) {
+        // fail because head points at occupied element
         return BUFFER_FULL;
       }
 
     }
 
-    this->data[this->head] = value;
-    this->head ++;
-    if ( this->head >= QUEUE_SIZE ) { this->head = 0; }
+    data[head] = value;
+    head ++;
+    if ( head >= QUEUE_SIZE ) { head = 0; }
 
     return SUCCESS;
   }
 
-  enum ReturnCode dequeue(ELEMENT_TYPE *value)
+  template<typename SLOT, typename INDEX>
+  static enum ReturnCode do_dequeue(SLOT *data, INDEX &tail, INDEX &batch_tail, size_t &batch_history,
+    ELEMENT_TYPE *value)
   {
     if ( CONS_BATCH ) {
 
-      if( this->tail == this->batch_tail ) {
-        bool const b = this->backtracking< BACKTRACKING, ADAPTIVE >();
+      if( tail == batch_tail ) {
+        bool const b = backtracking< BACKTRACKING, ADAPTIVE >(data, tail, batch_tail, batch_history);
         if ( !b )
           return BUFFER_EMPTY;
       }
 
-      *value = this->data[this->tail];
-      this->data[this->tail] = ELEMENT_ZERO;
-      this->tail ++;
-      if ( this->tail >= QUEUE_SIZE )
-        this->tail = 0;
+      *value = data[tail];
+      data[tail] = ELEMENT_ZERO;
+      tail ++;
+      if ( tail >= QUEUE_SIZE )
+        tail = 0;
 
       return SUCCESS;
 
     }
     else {
 
-      if ( ELEMENT_ZERO == this->data[this->tail] )
+      if ( ELEMENT_ZERO == data[tail] )
         return BUFFER_EMPTY;
 
-      *value = this->data[this->tail];
-      this->data[this->tail] = ELEMENT_ZERO;
-      this->tail ++;
-      if ( this->tail >= QUEUE_SIZE )
-        this->tail = 0;
+      *value = data[tail];
+      data[tail] = ELEMENT_ZERO;
+      tail ++;
+      if ( tail >= QUEUE_SIZE )
+        tail = 0;
 
       return SUCCESS;
 
     }
   }
 
-private:
-  enum { CONS_BATCH_SIZE   = (QUEUE_SIZE/16) , BATCH_INCREAMENT  = (QUEUE_SIZE/32) }; // used iff CONS_BATCH
-  enum { PROD_BATCH_SIZE   = (QUEUE_SIZE/16) }; // used iff PROD_BATCH
+  template<typename SLOT, typename INDEX>
+  static bool do_can_enqueue(SLOT *data, INDEX const &head, INDEX const &batch_head)
+  {
+    if ( PROD_BATCH ) {
+      if ( head != batch_head ) { return true; }
+      uint32_t tmp_head = head + PROD_BATCH_SIZE;
+      if ( tmp_head >= QUEUE_SIZE ) { tmp_head = 0; }
+      return ELEMENT_ZERO == data[tmp_head];
+    }
+    return ELEMENT_ZERO == data[head];
+  }
 
+  template<typename SLOT, typename INDEX>
+  static bool do_can_dequeue(SLOT *data, INDEX const &tail, INDEX const &batch_tail)
+  {
+    if ( CONS_BATCH && tail != batch_tail ) { return true; }
+    return ELEMENT_ZERO != data[tail];
+  }
 
-  /* Mostly accessed by producer. */
-  volatile	uint32_t	head;
-  volatile	uint32_t	batch_head; // used iff PROD_BATCH
+  template<typename SLOT, typename INDEX>
+  static enum ReturnCode do_dequeue_unbatched(SLOT *data, INDEX &tail, INDEX &batch_tail,
+    size_t &batch_history, ELEMENT_TYPE *value)
+  {
+    if ( CONS_BATCH && tail != batch_tail ) {
+      return do_dequeue(data, tail, batch_tail, batch_history, value);
+    }
 
-  /* Mostly accessed by consumer. */
-  volatile	uint32_t	tail __attribute__ ((aligned(64)));
-  volatile	uint32_t	batch_tail; // used iff CONS_BATCH
-  size_t batch_history; // used iff CONS_BATCH
+    if ( ELEMENT_ZERO == data[tail] )
+      return BUFFER_EMPTY;
 
-  /* Accessed by both producer and comsumer */
-  ELEMENT_TYPE	data[QUEUE_SIZE] __attribute__ ((aligned(64)));
+    *value = data[tail];
+    data[tail] = ELEMENT_ZERO;
+    tail ++;
+    if ( tail >= QUEUE_SIZE )
+      tail = 0;
+    batch_tail = tail; // no batch claimed
 
-  static const ELEMENT_TYPE ELEMENT_ZERO = 0x0UL;
+    return SUCCESS;
+  }
 
-  template<bool BACKTRACKING_, bool ADAPTIVE_> bool backtracking()
+  template<bool BACKTRACKING_, bool ADAPTIVE_, typename SLOT, typename INDEX>
+  static bool backtracking(SLOT *data, INDEX &tail, INDEX &batch_tail, size_t &batch_history)
   {
     uint32_t tmp_tail;
-    tmp_tail = this->tail + CONS_BATCH_SIZE;
+    tmp_tail = tail + CONS_BATCH_SIZE;
     if ( tmp_tail >= QUEUE_SIZE ) {
       tmp_tail = 0;
 
       if ( ADAPTIVE_ ) {
-        if (this->batch_history < CONS_BATCH_SIZE) {
-          this->batch_history =
-            (CONS_BATCH_SIZE < (this->batch_history + BATCH_INCREAMENT)) ?
-            CONS_BATCH_SIZE : (this->batch_history + BATCH_INCREAMENT);
+        if (batch_history < CONS_BATCH_SIZE) {
+          batch_history =
+            (CONS_BATCH_SIZE < (batch_history + BATCH_INCREAMENT)) ?
+            CONS_BATCH_SIZE : (batch_history + BATCH_INCREAMENT);
         }
       }
 
@@ -173,14 +465,14 @@ private:
 
     if ( BACKTRACKING_ ) {
 
-      size_t batch_size = this->batch_history;
-      while ( ELEMENT_ZERO == this->data[tmp_tail] ) {
+      size_t batch_size = batch_history;
+      while ( ELEMENT_ZERO == data[tmp_tail] ) {
 
         wait_ticks<true, true>(CONGESTION_PENALTY_CYCLES); // give a chance for producer to extend the buffer
 
         batch_size = batch_size >> 1;
         if( batch_size > 0 ) {
-          tmp_tail = this->tail + batch_size;
+          tmp_tail = tail + batch_size;
           if (tmp_tail >= QUEUE_SIZE)
             tmp_tail = 0;
         }
@@ -190,22 +482,22 @@ private:
       }
 
       if ( ADAPTIVE_ ) {
-        this->batch_history = batch_size;
+        batch_history = batch_size;
       }
 
     }
     else {
-      if ( ELEMENT_ZERO == this->data[tmp_tail] ) {
+      if ( ELEMENT_ZERO == data[tmp_tail] ) {
         wait_ticks<true, true>(CONGESTION_PENALTY_CYCLES);
         return false;
       }
     }
 
-    if ( tmp_tail == this->tail ) {
+    if ( tmp_tail == tail ) {
       tmp_tail = (tmp_tail + 1) >= QUEUE_SIZE ?
         0 : tmp_tail + 1;
     }
-    this->batch_tail = tmp_tail;
+    batch_tail = tmp_tail;
 
     return true;
   }
@@ -0,0 +1,125 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LANES_B_QUQUQ_H_
+#define _LANES_B_QUQUQ_H_
+
+#include <stdint.h>
+#include "fifo2.hpp"
+
+// SPSC channel made of K priority lanes, each an independent queue<>; lane 0 is the highest.
+//
+// Every dequeue() scans the lanes from the top, so a consumer working through a batch of a low
+// lane switches to a higher lane as soon as that one has an element: the low lane keeps its
+// claimed batch (tail/batch_tail) and resumes it later.
+//
+// Starvation protection is a per-round credit: a lane may deliver at most share(k) elements
+// per round. A round ends when no lane that has elements has credit left, then all credits
+// are refilled. So under full load every lane gets its share, and with the high lanes idle a
+// low lane gets the whole consumer.
+//
+// The default lane type has no congestion penalty: when a lane cannot claim a batch the
+// consumer should look at the other lanes rather than wait for this one. Elements that
+// consumer batching would hold back are released with dequeue_unbatched(), so a lone control
+// message is delivered at once.
+
+template<size_t K = 2, typename LANE = queue<(1024 * 8), uint64_t, 0> >
+class priority_channel
+{
+public:
+  typedef typename LANE::element_type element_type;
+  typedef typename LANE::ReturnCode ReturnCode;
+  static const ReturnCode SUCCESS = LANE::SUCCESS;
+  static const ReturnCode BUFFER_FULL = LANE::BUFFER_FULL;
+  static const ReturnCode BUFFER_EMPTY = LANE::BUFFER_EMPTY;
+
+  enum { DEFAULT_TOP_SHARE = 1024, MIN_SHARE = 16 };
+
+  static size_t lanes() { return K; }
+
+  // Lane k gets DEFAULT_TOP_SHARE >> k elements per round, at least MIN_SHARE.
+  priority_channel() : last_lane(K)
+  {
+    for(size_t k = 0U; k < K; ++k) {
+      size_t const s = DEFAULT_TOP_SHARE >> k;
+      shares[k] = credits[k] = (s < MIN_SHARE) ? MIN_SHARE : s;
+      delivered[k] = 0;
+    }
+    preempted = 0;
+  }
+
+  // Consumer side; takes effect from the next round.
+  void set_share(size_t lane, size_t share) { shares[lane] = share ? share : 1; }
+  size_t share(size_t lane) const { return shares[lane]; }
+
+  ReturnCode enqueue(size_t lane, element_type value)
+  {
+    return lanes_[lane].enqueue(value);
+  }
+
+  ReturnCode dequeue(element_type *value, size_t *lane = NULL)
+  {
+    for(int pass = 0; pass < 2; ++pass) {
+      bool ready = false;
+
+      for(size_t k = 0U; k < K; ++k) {
+        if ( !lanes_[k].can_dequeue() ) { continue; }
+        ready = true;
+        if ( credits[k] == 0 ) { continue; }
+
+        if ( lanes_[k].dequeue(value) != LANE::SUCCESS &&
+             lanes_[k].dequeue_unbatched(value) != LANE::SUCCESS ) {
+          continue;
+        }
+
+        credits[k] --;
+        delivered[k] ++;
+        if ( k < last_lane && last_lane < K ) { preempted ++; }
+        last_lane = k;
+        if ( lane ) { *lane = k; }
+        return SUCCESS;
+      }
+
+      if ( !ready ) { break; }
+      // every lane with elements used up its share: next round
+      for(size_t k = 0U; k < K; ++k) { credits[k] = shares[k]; }
+    }
+
+    return BUFFER_EMPTY;
+  }
+
+  // Consumer-side statistics.
+  uint64_t delivered_from(size_t lane) const { return delivered[lane]; }
+  // How many times a lower lane was left for a higher one.
+  uint64_t preemptions() const { return preempted; }
+
+private:
+  LANE lanes_[K];
+
+  /* Accessed by consumer only. */
+  size_t shares[K] __attribute__ ((aligned(64)));
+  size_t credits[K];
+  uint64_t delivered[K];
+  uint64_t preempted;
+  size_t last_lane;
+} __attribute__ ((aligned(64)));
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LAP_B_QUQUQ_H_
+#define _LAP_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// SPSC queue in which the consumer never stores to the data array.
+//
+// queue<> marks a slot empty by writing ELEMENT_ZERO back into it, so every line the consumer
+// reads is dirtied and travels back to the producer in modified state. Here the producer
+// writes the lap number (position / QUEUE_SIZE + 1) next to the payload instead; a slot is
+// full for the consumer when it carries the lap the consumer is on. The consumer's data lines
+// stay shared and are simply invalidated by the producer's next write to them.
+//
+// The producer still has to know which slots are free. The consumer publishes its position in
+// a separate index every PUBLISH_BATCH elements (and whenever it finds the queue empty); the
+// producer keeps a private copy and rereads the shared one only when the copy says the ring is
+// full, so the index line moves about once per batch, not per element.
+//
+// Since emptiness is not encoded in the payload, every value is valid, 0 included. The price is
+// the tag: a slot of uint64_t payload takes 16 bytes instead of 8.
+
+template<size_t QUEUE_SIZE = (1024 * 8), typename ELEMENT_TYPE = uint64_t,
+  size_t PUBLISH_BATCH = (QUEUE_SIZE / 16)>
+class lap_queue
+{
+  static_assert((QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0, "QUEUE_SIZE must be a power of two");
+  static_assert(PUBLISH_BATCH > 0 && PUBLISH_BATCH <= QUEUE_SIZE, "PUBLISH_BATCH must be in [1, QUEUE_SIZE]");
+
+public:
+  enum ReturnCode { SUCCESS=0, BUFFER_FULL=1, BUFFER_EMPTY=2 };
+  typedef ELEMENT_TYPE element_type;
+
+  static size_t queue_size() { return QUEUE_SIZE; }
+  static size_t publish_batch_size() { return PUBLISH_BATCH; }
+
+  lap_queue() : head(0U), tail_cache(0U), tail(0U), unpublished(0U), tail_published(0U)
+  {
+    for(size_t i = 0U; i < QUEUE_SIZE; ++i) {
+      this->data[i].lap.store(0U, std::memory_order_relaxed);
+    }
+  }
+
+  /* Producer side. */
+
+  enum ReturnCode enqueue(ELEMENT_TYPE value)
+  {
+    if ( this->head - this->tail_cache >= QUEUE_SIZE ) {
+      this->tail_cache = this->tail_published.load(std::memory_order_acquire);
+      if ( this->head - this->tail_cache >= QUEUE_SIZE ) {
+        return BUFFER_FULL;
+      }
+    }
+
+    slot &s = this->data[this->head & MASK];
+    s.value = value;
+    s.lap.store(lap_of(this->head), std::memory_order_release);
+    ++this->head;
+
+    return SUCCESS;
+  }
+
+  // Enqueue up to n values, as many as fit. Returns how many were taken.
+  size_t enqueue_bulk(ELEMENT_TYPE const *values, size_t n)
+  {
+    size_t room = QUEUE_SIZE - (size_t)(this->head - this->tail_cache);
+    if ( room < n ) {
+      this->tail_cache = this->tail_published.load(std::memory_order_acquire);
+      room = QUEUE_SIZE - (size_t)(this->head - this->tail_cache);
+    }
+    if ( n > room ) { n = room; }
+
+    for(size_t i = 0U; i < n; ++i) {
+      slot &s = this->data[(this->head + i) & MASK];
+      s.value = values[i];
+      s.lap.store(lap_of(this->head + i), std::memory_order_release);
+    }
+    this->head += n;
+
+    return n;
+  }
+
+  // Enqueue all n values or none of them, for records several elements long.
+  bool enqueue_all(ELEMENT_TYPE const *values, size_t n)
+  {
+    if ( QUEUE_SIZE - (size_t)(this->head - this->tail_cache) < n ) {
+      this->tail_cache = this->tail_published.load(std::memory_order_acquire);
+      if ( QUEUE_SIZE - (size_t)(this->head - this->tail_cache) < n ) {
+        return false;
+      }
+    }
+    this->enqueue_bulk(values, n);
+    return true;
+  }
+
+  /* Consumer side. */
+
+  enum ReturnCode dequeue(ELEMENT_TYPE *value)
+  {
+    slot const &s = this->data[this->tail & MASK];
+    if ( s.lap.load(std::memory_order_acquire) != lap_of(this->tail) ) {
+      // let a producer waiting on a full ring see what was consumed so far
+      this->publish();
+      return BUFFER_EMPTY;
+    }
+
+    *value = s.value;
+    ++this->tail;
+    if ( ++this->unpublished >= PUBLISH_BATCH ) {
+      this->publish();
+    }
+
+    return SUCCESS;
+  }
+
+  bool can_dequeue() const
+  {
+    return this->data[this->tail & MASK].lap.load(std::memory_order_acquire) == lap_of(this->tail);
+  }
+
+private:
+  enum { MASK = QUEUE_SIZE - 1 };
+
+  struct slot {
+    std::atomic<uint32_t> lap;
+    ELEMENT_TYPE value;
+  };
+
+  static uint32_t lap_of(uint64_t pos) { return (uint32_t)(pos / QUEUE_SIZE) + 1U; }
+
+  void publish()
+  {
+    if ( this->unpublished ) {
+      this->tail_published.store(this->tail, std::memory_order_release);
+      this->unpublished = 0U;
+    }
+  }
+
+  /* Producer only. */
+  uint64_t head;
+  uint64_t tail_cache;
+
+  /* Consumer only. */
+  uint64_t tail __attribute__ ((aligned(64)));
+  size_t unpublished;
+
+  /* Written by consumer once per batch, read by producer when it runs out of room. */
+  std::atomic<uint64_t> tail_published __attribute__ ((aligned(64)));
+
+  /* Written by producer only. */
+  slot data[QUEUE_SIZE] __attribute__ ((aligned(64)));
+} __attribute__ ((aligned(64)));
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LEAN_B_QUQUQ_H_
+#define _LEAN_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+
+// SPSC channel for very many mostly idle connections.
+//
+//   segment_slab<> slab;                   // shared by all channels
+//   lean_channel<> ch(slab);               // 128 bytes, no ring yet
+//
+// A channel is two cache lines of metadata (one per side) and no ring until the first element
+// arrives. It then takes one small segment (SEGMENT_SIZE slots, 512 bytes by default) from the
+// shared slab and uses it as a ring with queue<>'s protocol: ELEMENT_ZERO marks an empty slot,
+// the consumer claims batches by probing ahead.
+//
+// When the ring is full the producer links a further segment from the slab and carries on in
+// it, as unbounded_queue<> does; the consumer follows the link once it has drained the old one
+// and gives the old one straight back to the slab. So a channel holds more than one segment only
+// while it has a backlog, and shrinks back to one when it catches up.
+//
+// The slab is a free list behind a mutex; it is touched only when a channel grows or shrinks,
+// never per element. Segments come back with every slot zeroed (the consumer clears what it
+// reads), so recycling needs no memset. With a segment limit the slab turns into back-pressure:
+// enqueue() returns BUFFER_FULL when a channel would need a segment the slab cannot give.
+
+template<typename ELEMENT_TYPE = uint64_t, size_t SEGMENT_SIZE = 64>
+class segment_slab
+{
+public:
+  struct segment {
+    std::atomic<segment *> next;
+    ELEMENT_TYPE data[SEGMENT_SIZE];
+  };
+
+  // 0 = no limit on the number of segments
+  explicit segment_slab(size_t max_segments_ = 0)
+    : free_list(NULL), allocated(0), in_use(0), peak(0), max_segments(max_segments_)
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  ~segment_slab()
+  {
+    while ( free_list ) {
+      segment *s = free_list->next.load(std::memory_order_relaxed);
+      free(free_list);
+      free_list = s;
+    }
+    pthread_mutex_destroy(&lock);
+  }
+
+  // A segment with every slot ELEMENT_ZERO and no next, NULL at the limit.
+  segment * get()
+  {
+    pthread_mutex_lock(&lock);
+    segment *s = free_list;
+    if ( s ) {
+      free_list = s->next.load(std::memory_order_relaxed);
+    }
+    else if ( max_segments == 0 || allocated < max_segments ) {
+      void *m = NULL;
+      if ( posix_memalign(&m, 64, sizeof(segment)) == 0 ) {
+        memset(m, 0, sizeof(segment));
+        s = static_cast<segment *>(m);
+        ++allocated;
+      }
+    }
+    if ( s ) {
+      s->next.store(NULL, std::memory_order_relaxed);
+      if ( ++in_use > peak ) { peak = in_use; }
+    }
+    pthread_mutex_unlock(&lock);
+    return s;
+  }
+
+  void put(segment *s)
+  {
+    pthread_mutex_lock(&lock);
+    s->next.store(free_list, std::memory_order_relaxed);
+    free_list = s;
+    --in_use;
+    pthread_mutex_unlock(&lock);
+  }
+
+  size_t segments_allocated() const { return allocated; }
+  size_t segments_in_use() const { return in_use; }
+  size_t segments_peak() const { return peak; }
+  static size_t segment_bytes() { return sizeof(segment); }
+
+private:
+  pthread_mutex_t lock;
+  segment *free_list;
+  size_t allocated;
+  size_t in_use;
+  size_t peak;
+  size_t max_segments;
+};
+
+template<typename ELEMENT_TYPE = uint64_t, size_t SEGMENT_SIZE = 64, size_t CONS_BATCH = SEGMENT_SIZE / 4>
+class lean_channel
+{
+public:
+  enum ReturnCode { SUCCESS=0, BUFFER_FULL=1, BUFFER_EMPTY=2 };
+  typedef ELEMENT_TYPE element_type;
+  typedef segment_slab<ELEMENT_TYPE, SEGMENT_SIZE> slab_t;
+  typedef typename slab_t::segment segment;
+
+  explicit lean_channel(slab_t &slab_)
+    : slab(&slab_), prod(NULL), head(0U)
+    , first(NULL), cons_slab(&slab_), cons(NULL), tail(0U), batch_tail(0U), draining(false)
+  { }
+
+  ~lean_channel()
+  {
+    // both sides stopped: whatever is still chained goes back
+    segment *s = cons ? cons : first.load(std::memory_order_acquire);
+    while ( s ) {
+      segment *n = s->next.load(std::memory_order_relaxed);
+      memset(s->data, 0, sizeof(s->data));
+      slab->put(s);
+      s = n;
+    }
+  }
+
+  /* Producer side. */
+
+  enum ReturnCode enqueue(ELEMENT_TYPE value)
+  {
+    if ( !this->prod ) {
+      // first element ever: take a ring
+      segment *s = this->slab->get();
+      if ( !s ) { return BUFFER_FULL; }
+      this->prod = s;
+      this->first.store(s, std::memory_order_release);
+    }
+    else if ( ELEMENT_ZERO != *static_cast<ELEMENT_TYPE volatile *>(&this->prod->data[this->head]) ) {
+      // ring full: continue in a new segment, the consumer follows the link
+      segment *s = this->slab->get();
+      if ( !s ) { return BUFFER_FULL; }
+      s->data[0] = value;
+      this->prod->next.store(s, std::memory_order_release);
+      this->prod = s;
+      this->head = 1U;
+      return SUCCESS;
+    }
+
+    // plain store, ordered after the element stores before it as in queue<>
+    *static_cast<ELEMENT_TYPE volatile *>(&this->prod->data[this->head]) = value;
+    if ( ++this->head >= SEGMENT_SIZE ) { this->head = 0U; }
+
+    return SUCCESS;
+  }
+
+  /* Consumer side. */
+
+  enum ReturnCode dequeue(ELEMENT_TYPE *value)
+  {
+    if ( !this->cons ) {
+      this->cons = this->first.load(std::memory_order_acquire);
+      if ( !this->cons ) { return BUFFER_EMPTY; }
+    }
+
+    if ( this->tail == this->batch_tail && !this->claim() ) {
+      if ( !this->draining ) {
+        if ( !this->cons->next.load(std::memory_order_acquire) ) { return BUFFER_EMPTY; }
+        // the producer has moved on: what is left here is final
+        this->draining = true;
+        return this->dequeue(value);
+      }
+      // drained: return the segment and continue in the next one
+      segment *n = this->cons->next.load(std::memory_order_relaxed);
+      this->cons_slab->put(this->cons);
+      this->cons = n;
+      this->tail = this->batch_tail = 0U;
+      this->draining = false;
+      return this->dequeue(value);
+    }
+
+    ELEMENT_TYPE volatile *slot = &this->cons->data[this->tail];
+    *value = *slot;
+    *slot = ELEMENT_ZERO;
+    if ( ++this->tail >= SEGMENT_SIZE ) { this->tail = 0U; }
+
+    return SUCCESS;
+  }
+
+  static size_t segment_size() { return SEGMENT_SIZE; }
+
+private:
+  static const ELEMENT_TYPE ELEMENT_ZERO = 0x0UL;
+
+  // Claim a batch ending at the furthest filled slot among tail + CONS_BATCH, + CONS_BATCH/2, ...
+  // (without wrapping). A draining segment is final, so any filled slot is claimed singly.
+  bool claim()
+  {
+    ELEMENT_TYPE volatile *d = this->cons->data;
+    size_t n = this->draining ? 1U : CONS_BATCH;
+    if ( this->tail + n > SEGMENT_SIZE ) { n = SEGMENT_SIZE - this->tail; }
+    for(; n > 0; n >>= 1) {
+      if ( ELEMENT_ZERO != d[this->tail + n - 1] ) {
+        size_t const b = this->tail + n;
+        this->batch_tail = (b >= SEGMENT_SIZE) ? 0U : (uint32_t)b;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Producer. */
+  slab_t *slab;
+  segment *prod;
+  uint32_t head;
+
+  /* Consumer. */
+  std::atomic<segment *> first __attribute__ ((aligned(64))); // set once by the producer
+  slab_t *cons_slab;
+  segment *cons;
+  uint32_t tail;
+  uint32_t batch_tail;
+  bool draining;
+} __attribute__ ((aligned(64)));
+
+#endif
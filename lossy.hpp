@@ -0,0 +1,173 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LOSSY_B_QUQUQ_H_
+#define _LOSSY_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "fifo2.hpp"
+
+// Lossy SPSC channels for telemetry and sampling, where a producer must never wait for its
+// consumer. Both enqueue()s are wait-free: a bounded number of steps whatever the consumer does.
+//
+//   drop_newest_queue<> q;        q.enqueue(v);  // full: v is discarded, q.dropped() counts it
+//   overwrite_queue<> q;          q.enqueue(v);  // full: the oldest unread element is lost,
+//                                                 // q.skipped() counts what the consumer missed
+//
+// drop_newest_queue<> is queue<> whose enqueue() gives up at once when the ring is full. It
+// asks can_enqueue() first, so a producer-batching queue<> does not pay its congestion penalty
+// either. The consumer side is queue<>'s, and everything delivered is in order with no gaps
+// except where the producer dropped.
+//
+// overwrite_queue<> keeps the newest QUEUE_SIZE elements. The producer never looks at the
+// consumer: it writes position p into slot p % QUEUE_SIZE under a seqlock stamp (2p + 1 while
+// writing, 2p + 2 when done) and moves on. The consumer at position t expects stamp 2t + 2. A
+// smaller stamp means the slot is not written yet (or is being written). A larger one means the
+// producer has lapped it: the slot already holds some p > t, so everything before
+// p - QUEUE_SIZE + 1 is gone. The consumer jumps there and adds the distance to skipped(). A
+// value torn by an overwrite during the read is detected by rereading the stamp and treated
+// the same way.
+//
+// overwrite_queue<> copies T with plain loads and stores, keep it small and trivially copyable.
+// Every value is valid, 0 included.
+
+template<typename Q = queue<> >
+class drop_newest_queue : public Q
+{
+public:
+  typedef typename Q::element_type element_type;
+  typedef typename Q::ReturnCode ReturnCode;
+
+  drop_newest_queue() : dropped_count(0U) { }
+
+  /* Producer side. */
+
+  // BUFFER_FULL means value was dropped; do not retry.
+  ReturnCode enqueue(element_type value)
+  {
+    if ( !Q::can_enqueue() ) {
+      ++this->dropped_count;
+      return Q::BUFFER_FULL;
+    }
+    return Q::enqueue(value);
+  }
+
+  uint64_t dropped() const { return this->dropped_count; }   // producer
+
+private:
+  /* Producer only. */
+  uint64_t dropped_count __attribute__ ((aligned(64)));
+};
+
+template<size_t QUEUE_SIZE = (1024 * 8), typename ELEMENT_TYPE = uint64_t>
+class overwrite_queue
+{
+  static_assert((QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0, "QUEUE_SIZE must be a power of two");
+
+public:
+  enum ReturnCode { SUCCESS=0, BUFFER_FULL=1, BUFFER_EMPTY=2 };
+  typedef ELEMENT_TYPE element_type;
+
+  static size_t queue_size() { return QUEUE_SIZE; }
+
+  overwrite_queue() : head(0U), tail(0U), skipped_count(0U), laps_count(0U)
+  {
+    for(size_t i = 0U; i < QUEUE_SIZE; ++i) {
+      this->data[i].stamp.store(0U, std::memory_order_relaxed);
+    }
+  }
+
+  /* Producer side. */
+
+  // Never fails; returns SUCCESS for symmetry with queue<>.
+  enum ReturnCode enqueue(ELEMENT_TYPE value)
+  {
+    slot &s = this->data[this->head & MASK];
+    s.stamp.store(2U * this->head + 1U, std::memory_order_relaxed); // odd: write in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    s.value = value;
+    s.stamp.store(2U * this->head + 2U, std::memory_order_release);
+    ++this->head;
+
+    return SUCCESS;
+  }
+
+  /* Consumer side. */
+
+  enum ReturnCode dequeue(ELEMENT_TYPE *value)
+  {
+    for(;;) {
+      slot const &s = this->data[this->tail & MASK];
+      uint64_t const want = 2U * this->tail + 2U;
+      uint64_t stamp = s.stamp.load(std::memory_order_acquire);
+      if ( stamp < want ) {
+        return BUFFER_EMPTY;
+      }
+      if ( stamp == want ) {
+        *value = s.value;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        stamp = s.stamp.load(std::memory_order_relaxed);
+        if ( stamp == want ) {
+          ++this->tail;
+          return SUCCESS;
+        }
+      }
+
+      // lapped: the slot holds a newer position, skip to the oldest one that can still be there
+      uint64_t const newer = (stamp - 1U) / 2U;
+      uint64_t const oldest = newer - QUEUE_SIZE + 1U;
+      this->skipped_count += oldest - this->tail;
+      ++this->laps_count;
+      this->tail = oldest;
+    }
+  }
+
+  bool can_dequeue() const
+  {
+    return this->data[this->tail & MASK].stamp.load(std::memory_order_acquire) >= 2U * this->tail + 2U;
+  }
+
+  uint64_t skipped() const { return this->skipped_count; }   // consumer: elements overwritten unread
+  uint64_t laps() const { return this->laps_count; }         // consumer: times it was lapped
+
+private:
+  enum { MASK = QUEUE_SIZE - 1 };
+
+  struct slot {
+    std::atomic<uint64_t> stamp;
+    ELEMENT_TYPE value;
+  };
+
+  /* Producer only. */
+  uint64_t head;
+
+  /* Consumer only. */
+  uint64_t tail __attribute__ ((aligned(64)));
+  uint64_t skipped_count;
+  uint64_t laps_count;
+
+  /* Written by producer only. */
+  slot data[QUEUE_SIZE] __attribute__ ((aligned(64)));
+} __attribute__ ((aligned(64)));
+
+#endif
@@ -26,12 +26,32 @@
 #include <pthread.h>
 #include <sched.h>
 #include "fifo.h"
+#include "perf.h"
+
+#if defined(WORKLOAD_DEBUG)
+#include "workload.h"
+
+/* from BQ_WORKLOAD, see workload.h */
+static struct workload_config workload_cfg;
+/* set before the start barrier by a thread that could not set up its workload */
+static volatile int workload_failed;
+#endif
 
 #if defined(FIFO_DEBUG)
 #include <assert.h>
 #endif
 
+#if defined(FIFO_TRACE)
+#include "trace.h"
+#endif
+
+#if defined(FIFO_CAPTURE)
+#include "capture.h"
+#endif
+
+#ifndef TEST_SIZE
 #define TEST_SIZE 200000000
+#endif
 
 /****** Should be 2^N *****/
 #define MAX_CORE_NUM 32
@@ -42,6 +62,11 @@
 
 static struct queue_t queues[MAX_CORE_NUM];
 
+#if defined(FIFO_CAPTURE)
+/* [0] the producer's enqueues, [cpu_id] that consumer's dequeues; first run only */
+static struct capture_stream captures[MAX_CORE_NUM];
+#endif
+
 struct init_info {
 	uint32_t	cpu_id;
 	pthread_barrier_t * barrier;
@@ -74,8 +99,10 @@ void * consumer(void *arg)
 	ELEMENT_TYPE	value;
 	cpu_set_t	cur_mask;
 	uint64_t	i;
+	struct perf_group pg;
+	char		counters[256];
 #if defined(WORKLOAD_DEBUG)
-	unsigned long	seed;
+	struct workload	wl;
 #endif
 #if defined(FIFO_DEBUG)
 	ELEMENT_TYPE	old_value = 0; 
@@ -101,21 +128,50 @@ void * consumer(void *arg)
 		perror("Error: sched_setaffinity");
 		return NULL;
 	}
+#if defined(FIFO_TRACE)
+	trace_thread_init(cpu_id);
+#endif
 
 #if defined(WORKLOAD_DEBUG)
-	seed = read_tsc();
+	/* own buffers and random sequence; its cost on this core is subtracted below */
+	if (workload_init(&wl, &workload_cfg, read_tsc()))
+		workload_failed = 1;	/* still meet the others at the barriers */
+	else
+		printf("consumer %d: workload %" PRIu64 " cycles/op\n", cpu_id,
+			workload_calibrate(&wl, CALIBRATION_ROUNDS));
+#endif
+
+	/* counts this thread only, so open it after pinning */
+	perf_open(&pg);
+#if defined(FIFO_CAPTURE)
+	if (r == 0)
+		capture_open(&captures[cpu_id], CAPTURE_DEQUEUE, cpu_id, CAPTURE_BYTES);
 #endif
 
 	printf("Consumer created...\n");
 	pthread_barrier_wait(barrier);
+#if defined(WORKLOAD_DEBUG)
+	if (workload_failed) {
+		perf_close(&pg);
+		workload_destroy(&wl);
+		pthread_barrier_wait(barrier);
+		return NULL;
+	}
+#endif
+
+	perf_start(&pg);
 
 	queues[cpu_id].start_c = read_tsc();
 
 	for (i = 1; i <= TEST_SIZE; i++) {
 		while( dequeue(&queues[cpu_id], &value) != 0 );
+#if defined(FIFO_CAPTURE)
+		if (r == 0)
+			capture_record(&captures[cpu_id], read_tsc(), 1);
+#endif
 
 #if defined(WORKLOAD_DEBUG)
-		workload(&seed);
+		workload_run(&wl);
 #endif
 
 #if defined(FIFO_DEBUG)
@@ -124,18 +180,24 @@ void * consumer(void *arg)
 #endif
 	}
 	queues[cpu_id].stop_c = read_tsc();
+	perf_stop(&pg);
+	perf_report(&pg, counters, sizeof(counters), TEST_SIZE);
+	perf_close(&pg);
 
 #if defined(WORKLOAD_DEBUG)
 	printf("consumer: %" PRId64 " cycles/op\n", 
 		((queues[cpu_id].stop_c - queues[cpu_id].start_c) / (TEST_SIZE + 1)) \
-       		- AVG_WORKLOAD);
-  results[r].cons = ((queues[cpu_id].stop_c - queues[cpu_id].start_c) / (TEST_SIZE + 1)) - AVG_WORKLOAD;
+       		- wl.overhead);
+  results[r].cons = ((queues[cpu_id].stop_c - queues[cpu_id].start_c) / (TEST_SIZE + 1)) - wl.overhead;
+	workload_destroy(&wl);
 #else
 	printf("consumer: %" PRId64 " cycles/op\n", 
 		((queues[cpu_id].stop_c - queues[cpu_id].start_c) / (TEST_SIZE + 1)));
   results[r].cons = ((queues[cpu_id].stop_c - queues[cpu_id].start_c) / (TEST_SIZE + 1));
 #endif
 
+	printf("consumer %d per op: %s\n", cpu_id, counters);
+
 	pthread_barrier_wait(barrier);
 	return NULL;
 }
@@ -150,6 +212,15 @@ void producer(void *arg, uint32_t num, uint32_t r)
 	cpu_set_t	cur_mask;
 	INIT_INFO * init = (INIT_INFO *) arg;
 	pthread_barrier_t *barrier = init->barrier;
+	struct perf_group pg;
+	char		counters[256];
+#if defined(WORKLOAD_DEBUG)
+	struct workload	wl;
+	uint64_t	next_c;
+
+	if (workload_init(&wl, &workload_cfg, read_tsc()))
+		workload_failed = 1;	/* still meet the consumers at the barriers */
+#endif
 
 	/* user needs tune this according to their machine configurations. */
 	CPU_ZERO(&cur_mask);
@@ -159,12 +230,40 @@ void producer(void *arg, uint32_t num, uint32_t r)
 		perror("Error: sched_setaffinity");
 		return ;
 	}
+#if defined(FIFO_TRACE)
+	trace_thread_init(0);
+#endif
+#if defined(FIFO_CAPTURE)
+	/* one record per element, which every queue gets a copy of */
+	if (r == 0)
+		capture_open(&captures[0], CAPTURE_ENQUEUE, 0, CAPTURE_BYTES);
+#endif
+	perf_open(&pg);
 
 	pthread_barrier_wait(barrier);
+#if defined(WORKLOAD_DEBUG)
+	if (workload_failed) {
+		perf_close(&pg);
+		workload_destroy(&wl);
+		pthread_barrier_wait(barrier);
+		return;
+	}
+#endif
 
+	perf_start(&pg);
 	start_p = read_tsc();
+#if defined(WORKLOAD_DEBUG)
+	next_c = start_p;
+#endif
 
 	for (i = 1; i <= TEST_SIZE + CONS_BATCH_SIZE; i++) {
+#if defined(WORKLOAD_DEBUG)
+		/* arrival model: hold element i back until its arrival time */
+		if (workload_cfg.arrival != ARRIVAL_NONE) {
+			next_c += workload_next_gap(&wl);
+			while (read_tsc() < next_c);
+		}
+#endif
 		for (j=1; j<num; j++) {
 			while ( enqueue(&queues[j], (ELEMENT_TYPE)i) != 0);
 #if defined(INCURE_DEBUG)
@@ -174,12 +273,23 @@ void producer(void *arg, uint32_t num, uint32_t r)
 			}
 #endif
 		}
+#if defined(FIFO_CAPTURE)
+		if (r == 0 && i <= TEST_SIZE)
+			capture_record(&captures[0], read_tsc(), 1);
+#endif
 	}
 	stop_p = read_tsc();
+	perf_stop(&pg);
+	perf_report(&pg, counters, sizeof(counters), (TEST_SIZE + 1)*(num -1));
+	perf_close(&pg);
 
 	printf("producer %" PRId64 " cycles/op\n", (stop_p - start_p) / ((TEST_SIZE + 1)*(num -1)));
+	printf("producer per op: %s\n", counters);
 
   results[r].prod = (stop_p - start_p) / ((TEST_SIZE + 1)*(num -1));
+#if defined(WORKLOAD_DEBUG)
+	workload_destroy(&wl);
+#endif
 
 	pthread_barrier_wait(barrier);
 }
@@ -206,6 +316,11 @@ int main(int argc, char *argv[])
 
 	srand((unsigned int)read_tsc());
 
+#if defined(WORKLOAD_DEBUG)
+	if (workload_config_from_env(&workload_cfg) != 0)
+		return 1;
+#endif
+
 	for (i=0; i<MAX_CORE_NUM; i++) {
 		queue_init(&queues[i]);
 	}
@@ -239,6 +354,12 @@ int main(int argc, char *argv[])
     INIT_BAR(0) = &barrier;
     INIT_RES_NUM(0) = c;
     producer(INIT_PTR(0), max_th, c);
+#if defined(WORKLOAD_DEBUG)
+    if (workload_failed) {
+      printf("workload setup failed\n");
+      return 1;
+    }
+#endif
     printf(".\n");
   }
 	printf("Done!\n");
@@ -249,5 +370,26 @@ int main(int argc, char *argv[])
   for(c = 0; c < MAX_RESULTS; ++c ) { printf("%" PRId64 " ", results[c].cons); }
   printf("\n");
 
+#if defined(FIFO_TRACE)
+	/* every consumer has passed its last barrier, the rings are final */
+	if (trace_dump(getenv("BQ_TRACE") ? getenv("BQ_TRACE") : "fifo.trace") == 0)
+		printf("trace written, decode with trace_decode\n");
+#endif
+
+#if defined(FIFO_CAPTURE)
+	{
+		struct capture_stream *streams[MAX_CORE_NUM];
+		uint32_t n = 0;
+
+		for (i = 0; i < max_th; i++)
+			if (captures[i].buf)
+				streams[n++] = &captures[i];
+		if (capture_write(getenv("BQ_CAPTURE") ? getenv("BQ_CAPTURE") : "fifo.capture", streams, n) == 0)
+			printf("capture written, replay with test_replay\n");
+		for (i = 0; i < max_th; i++)
+			capture_close(&captures[i]);
+	}
+#endif
+
 	return 0;
 }
@@ -0,0 +1,307 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MERGE_B_QUQUQ_H_
+#define _MERGE_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <assert.h>
+#include <atomic>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// Consumer that merges K time-ordered queue<>s into one ordered stream.
+//
+//   kway_merge<4> m;                  // K = 4 inputs of queue<>, element is its own timestamp
+//   m.attach(i, &q[i]);               // before the first dequeue()
+//   producer i:  q[i].enqueue(v); ... m.advance(i, ts);   m.close(i) when done
+//   consumer:    while ( m.dequeue(&v) == m.SUCCESS ) { ... }
+//
+// Each input is pulled up to BATCH elements at a time into a private buffer, and a loser tree
+// over the K buffer heads picks the next element: log2(K) comparisons per element, against the
+// same path of the tree every time.
+//
+// An input whose buffer and queue are empty takes part in the tree with its lower bound, the
+// larger of the last key it delivered and its watermark, in place of a key. While such an
+// input is the tree's winner nothing can be emitted (it might still send an older element) and
+// dequeue() returns BUFFER_EMPTY. Producers move their watermark with advance(i, ts), a promise
+// that nothing older than ts follows; close(i) promises nothing follows at all.
+//
+// For inputs that cannot promise anything, set_idle_timeout(cycles): an input that has blocked
+// the merge for that long without sending or advancing is set aside as idle, and the merge
+// carries on without it. Idle inputs are polled every BATCH elements emitted and whenever the
+// merge blocks; one that sends again rejoins, and its elements older than what was already
+// emitted are then emitted straight away and counted in late().
+//
+// KEY_OF maps an element to its uint64_t timestamp. The merge runs on one consumer thread;
+// advance() and close() may be called by the producers.
+
+struct identity_key {
+  uint64_t operator()(uint64_t v) const { return v; }
+};
+
+// Leaves of the tournament tree: K rounded up to a power of two.
+static inline constexpr size_t kway_leaves(size_t k, size_t n = 1)
+{
+  return n >= k ? n : kway_leaves(k, n * 2);
+}
+
+template<size_t K, typename Q = queue<>, typename KEY_OF = identity_key, size_t BATCH = 64>
+class kway_merge
+{
+  static_assert(K >= 1, "kway_merge needs at least one input");
+
+public:
+  typedef typename Q::element_type element_type;
+  typedef typename Q::ReturnCode ReturnCode;
+  static const ReturnCode SUCCESS = Q::SUCCESS;
+  static const ReturnCode BUFFER_EMPTY = Q::BUFFER_EMPTY;
+  static const uint64_t CLOSED = ~0ULL;
+  static const uint64_t IDLE = CLOSED - 1; // sorts after every key, before closed inputs
+
+  explicit kway_merge(KEY_OF key_of_ = KEY_OF())
+    : key_of(key_of_), idle_timeout(0), last_key(0), late_count(0), idle_inputs(0)
+    , since_poll(0), built(false)
+  {
+    for(size_t i = 0; i < LEAVES; ++i) {
+      inputs[i].q = NULL;
+      inputs[i].head = inputs[i].count = 0;
+      inputs[i].bound = (i < K) ? 0 : CLOSED;
+      inputs[i].blocked_since = 0;
+      inputs[i].idle = false;
+    }
+    for(size_t i = 0; i < K; ++i) { watermarks[i].value.store(0, std::memory_order_relaxed); }
+  }
+
+  void attach(size_t i, Q *q) { assert(i < K); inputs[i].q = q; }
+
+  // 0 (the default) waits on an input for as long as it takes.
+  void set_idle_timeout(uint64_t cycles) { idle_timeout = cycles; }
+
+  /* Producer side: input i sends nothing older than ts from now on. */
+  void advance(size_t i, uint64_t ts) { watermarks[i].value.store(ts, std::memory_order_release); }
+  void close(size_t i) { this->advance(i, CLOSED); }
+
+  /* Consumer side. */
+
+  ReturnCode dequeue(element_type *value)
+  {
+    if ( !built ) { this->build(); }
+    if ( idle_inputs && ++since_poll >= BATCH ) {
+      since_poll = 0;
+      this->poll_idle(); // an idle input may be sending again while the others keep flowing
+    }
+
+    for(int attempt = 0; attempt < 2; ++attempt) {
+      size_t const w = tree[0];
+      input &in = inputs[w];
+
+      if ( in.count > 0 ) {
+        *value = in.buf[in.head];
+        in.head = (in.head + 1) % BATCH;
+        --in.count;
+        uint64_t const k = key_of(*value);
+        if ( k < last_key ) { ++late_count; } else { last_key = k; }
+        in.bound = k;
+        this->refresh(w);
+        return SUCCESS;
+      }
+
+      // the winner has nothing buffered: it blocks the merge unless it has data or a
+      // watermark past the other inputs by now
+      this->refresh(w);
+      if ( tree[0] == w && inputs[w].count == 0 ) {
+        if ( inputs[w].bound == CLOSED ) { return BUFFER_EMPTY; } // every input closed
+        if ( !this->check_idle(w) ) {
+          this->poll_idle();
+          return BUFFER_EMPTY;
+        }
+      }
+    }
+    return BUFFER_EMPTY;
+  }
+
+  // Elements emitted older than an element emitted before them (idle inputs coming back).
+  uint64_t late() const { return late_count; }
+  // All inputs closed and drained.
+  bool finished() const { return built && inputs[tree[0]].count == 0 && inputs[tree[0]].bound == CLOSED; }
+
+private:
+  enum { LEAVES = kway_leaves(K) };
+
+  struct input {
+    Q *q;
+    element_type buf[BATCH];
+    size_t head;
+    size_t count;
+    uint64_t bound;          // key of a buffered head, else lower bound of what can still come
+    uint64_t blocked_since;  // TSC, 0 while not blocking the merge
+    bool idle;
+  };
+
+  struct watermark {
+    std::atomic<uint64_t> value __attribute__ ((aligned(64)));
+  };
+
+  // Pull up to a batch from the queue, then recompute the leaf key and replay its path.
+  // Only for the current winner, replay() is not valid for other leaves.
+  void refresh(size_t i)
+  {
+    input &in = inputs[i];
+    if ( in.count == 0 ) {
+      // watermark first: what was enqueued before advance() must be pulled before the
+      // watermark is believed
+      uint64_t const wm = watermarks[i].value.load(std::memory_order_acquire);
+      element_type v;
+      while ( in.q && in.count < BATCH && this->pull(in.q, &v) ) {
+        in.buf[(in.head + in.count) % BATCH] = v;
+        ++in.count;
+      }
+      if ( in.count == 0 ) {
+        if ( wm == CLOSED ) {
+          in.bound = CLOSED;
+          in.idle = false;
+        }
+        else if ( wm > in.bound ) {
+          in.bound = wm;
+          in.blocked_since = 0;
+        }
+      }
+    }
+
+    if ( in.count > 0 ) {
+      in.bound = key_of(in.buf[in.head]);
+      in.blocked_since = 0;
+      in.idle = false;
+    }
+    this->replay(i);
+  }
+
+  static bool pull(Q *q, element_type *v)
+  {
+    // an idle input costs one probe instead of queue<>'s backtracking; a stream's last
+    // elements must not wait for a consumer batch to fill
+    if ( !q->can_dequeue() ) { return false; }
+    return q->dequeue(v) == Q::SUCCESS || q->dequeue_unbatched(v) == Q::SUCCESS;
+  }
+
+  // Input w blocks the merge. Returns true if it was just set aside as idle.
+  bool check_idle(size_t w)
+  {
+    input &in = inputs[w];
+    if ( idle_timeout == 0 || in.idle ) { return false; }
+    uint64_t const now = cpu::read_tsc();
+    if ( in.blocked_since == 0 ) {
+      in.blocked_since = now;
+      return false;
+    }
+    if ( now - in.blocked_since < idle_timeout ) { return false; }
+    in.idle = true;
+    in.bound = IDLE; // out of the way until it sends again
+    ++idle_inputs;
+    this->replay(w);
+    return true;
+  }
+
+  // Idle inputs are not winners, so nothing else looks at them. A rejoin is rare, so a full
+  // rebuild.
+  void poll_idle()
+  {
+    bool changed = false;
+    idle_inputs = 0;
+    for(size_t i = 0; i < K; ++i) {
+      input &in = inputs[i];
+      element_type v;
+      if ( !in.idle ) { continue; }
+      if ( in.count == 0 && in.q && this->pull(in.q, &v) ) {
+        in.buf[in.head] = v;
+        in.count = 1;
+        in.bound = key_of(v);
+        in.idle = false;
+        in.blocked_since = 0;
+        changed = true;
+        continue;
+      }
+      ++idle_inputs;
+    }
+    if ( changed ) { tree[0] = this->build_node(1); }
+  }
+
+  // Buffered heads win ties against lower bounds of empty inputs, then lower index wins.
+  bool less(size_t a, size_t b) const
+  {
+    if ( inputs[a].bound != inputs[b].bound ) { return inputs[a].bound < inputs[b].bound; }
+    bool const ea = inputs[a].count == 0, eb = inputs[b].count == 0;
+    if ( ea != eb ) { return !ea; }
+    return a < b;
+  }
+
+  size_t build_node(size_t node)
+  {
+    if ( node >= LEAVES ) { return node - LEAVES; }
+    size_t const a = this->build_node(2 * node), b = this->build_node(2 * node + 1);
+    if ( this->less(a, b) ) { tree[node] = b; return a; }
+    tree[node] = a;
+    return b;
+  }
+
+  void build()
+  {
+    for(size_t i = 0; i < K; ++i) {
+      input &in = inputs[i];
+      element_type v;
+      while ( in.q && in.count < BATCH && this->pull(in.q, &v) ) { in.buf[in.count++] = v; }
+      if ( in.count > 0 ) { in.bound = key_of(in.buf[0]); }
+    }
+    tree[0] = this->build_node(1);
+    built = true;
+  }
+
+  // Leaf i changed: walk up to the root, leaving the loser at every node.
+  void replay(size_t i)
+  {
+    size_t winner = i;
+    for(size_t node = (i + LEAVES) >> 1; node > 0; node >>= 1) {
+      if ( this->less(tree[node], winner) ) {
+        size_t const t = tree[node];
+        tree[node] = winner;
+        winner = t;
+      }
+    }
+    tree[0] = winner;
+  }
+
+  KEY_OF key_of;
+  uint64_t idle_timeout;
+  uint64_t last_key;
+  uint64_t late_count;
+  size_t idle_inputs;  // at least the inputs set aside, recounted by poll_idle()
+  size_t since_poll;   // elements emitted since poll_idle()
+  bool built;
+
+  size_t tree[LEAVES]; // tree[0] is the overall winner, tree[1..] the losers of each match
+  input inputs[LEAVES];
+
+  /* Written by producers. */
+  watermark watermarks[K];
+};
+
+#endif
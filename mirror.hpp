@@ -0,0 +1,259 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MIRROR_B_QUQUQ_H_
+#define _MIRROR_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+
+// SPSC byte ring whose storage is mapped twice, back to back, so that any span of up to
+// capacity() bytes starting anywhere in the ring is contiguous in memory.
+//
+//   mirror_ring q(1 << 20);                  // rounded up to a power of two, at least a page
+//   if ( !q.ok() ) ...                       // memfd or mmap failed
+//
+//   producer:  void *p = q.reserve(n);       // NULL while n bytes are not free
+//              memcpy(p, src, n);            // never split at the end of the ring
+//              q.commit(n);
+//
+//   consumer:  size_t n;
+//              void const *p = q.peek(&n);   // everything readable, in one span
+//              parse(p, n);
+//              q.release(n);
+//
+// queue<> and fifo.c wrap the index on every step and a bulk copy has to be cut in two at the
+// end of the array. Here the pages of one memfd are mapped at base and again at base + size:
+// a store to base + size + i lands in base + i, so reserve() and peek() just return
+// base + (position & mask) and the caller reads or writes straight across the wrap point.
+// Variable-size records (enqueue_record() / front_record()) and memcpy/SIMD code over a batch
+// need no wrap handling at all.
+//
+// Positions are monotonic 64-bit byte counters. The producer publishes its head on every
+// commit(), so a reserve()/commit() pair is the producer's batch. The consumer publishes its
+// tail once per capacity / 16 released bytes and whenever it finds the ring empty, and the
+// producer rereads it only when its private copy says the ring is full, like lap_queue<>.
+
+class mirror_ring
+{
+public:
+  mirror_ring(size_t capacity_bytes)
+    : base(NULL), size(0U), mask(0U), publish_bytes(0U)
+    , head(0U), tail_cache(0U), tail(0U), head_cache(0U), unpublished(0U)
+    , head_published(0U), tail_published(0U)
+  {
+    size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = page;
+    while ( len < capacity_bytes ) { len <<= 1; }
+
+    int const fd = memfd_create("mirror_ring", MFD_CLOEXEC);
+    if ( fd < 0 ) {
+      perror("Error: mirror memfd_create");
+      return;
+    }
+    if ( ftruncate(fd, len) != 0 ) {
+      perror("Error: mirror ftruncate");
+      close(fd);
+      return;
+    }
+
+    // reserve both halves first so nothing else can be mapped in between
+    void *const area = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( area == MAP_FAILED ) {
+      perror("Error: mirror mmap");
+      close(fd);
+      return;
+    }
+    uint8_t *const lo = static_cast<uint8_t *>(area);
+    if ( mmap(lo, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(lo + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ) {
+      perror("Error: mirror mmap");
+      munmap(area, 2 * len);
+      close(fd);
+      return;
+    }
+    close(fd);
+
+    this->base = lo;
+    this->size = len;
+    this->mask = len - 1;
+    this->publish_bytes = len / 16;
+  }
+
+  ~mirror_ring()
+  {
+    if ( this->base ) { munmap(this->base, 2 * this->size); }
+  }
+
+  bool ok() const { return this->base != NULL; }
+  size_t capacity() const { return this->size; }
+
+  /* Producer side. */
+
+  // Contiguous room for n bytes at the head, or NULL if fewer than n are free (or n exceeds
+  // capacity()). Nothing is visible to the consumer until commit().
+  void * reserve(size_t n)
+  {
+    if ( this->size - (size_t)(this->head - this->tail_cache) < n ) {
+      this->tail_cache = this->tail_published.load(std::memory_order_acquire);
+      if ( this->size - (size_t)(this->head - this->tail_cache) < n ) {
+        return NULL;
+      }
+    }
+    return this->base + (this->head & this->mask);
+  }
+
+  // Publish the first n bytes of the last reserve().
+  void commit(size_t n)
+  {
+    this->head += n;
+    this->head_published.store(this->head, std::memory_order_release);
+  }
+
+  // Copy n bytes in, all or nothing.
+  bool enqueue_bulk(void const *src, size_t n)
+  {
+    void *const p = this->reserve(n);
+    if ( p == NULL ) { return false; }
+    memcpy(p, src, n);
+    this->commit(n);
+    return true;
+  }
+
+  // One record of len payload bytes, all or nothing. Records are an 8-byte header followed by
+  // the payload padded to 8 bytes, so every record and payload is 8-byte aligned.
+  bool enqueue_record(void const *payload, uint32_t len)
+  {
+    size_t const n = record_bytes(len);
+    uint8_t *const p = static_cast<uint8_t *>(this->reserve(n));
+    if ( p == NULL ) { return false; }
+    *reinterpret_cast<uint64_t *>(p) = len;
+    memcpy(p + RECORD_HEADER, payload, len);
+    this->commit(n);
+    return true;
+  }
+
+  /* Consumer side. */
+
+  // Everything committed and not yet released, as one span; *n is its length. NULL and *n == 0
+  // when the ring is empty.
+  void const * peek(size_t *n)
+  {
+    if ( this->head_cache == this->tail ) {
+      this->head_cache = this->head_published.load(std::memory_order_acquire);
+      if ( this->head_cache == this->tail ) {
+        // let a producer waiting on a full ring see what was released so far
+        this->publish();
+        *n = 0U;
+        return NULL;
+      }
+    }
+    *n = (size_t)(this->head_cache - this->tail);
+    return this->base + (this->tail & this->mask);
+  }
+
+  // Drop the first n bytes of the last peek().
+  void release(size_t n)
+  {
+    this->tail += n;
+    this->unpublished += n;
+    if ( this->unpublished >= this->publish_bytes ) {
+      this->publish();
+    }
+  }
+
+  // Copy out up to n bytes. Returns how many were taken.
+  size_t dequeue_bulk(void *dst, size_t n)
+  {
+    size_t avail;
+    void const *const p = this->peek(&avail);
+    if ( n > avail ) { n = avail; }
+    if ( n ) {
+      memcpy(dst, p, n);
+      this->release(n);
+    }
+    return n;
+  }
+
+  // Payload of the oldest record, or NULL if the ring is empty. The pointer stays valid until
+  // pop_record().
+  void const * front_record(uint32_t *len)
+  {
+    size_t avail;
+    uint8_t const *const p = static_cast<uint8_t const *>(this->peek(&avail));
+    if ( p == NULL ) { return NULL; }
+    *len = (uint32_t)*reinterpret_cast<uint64_t const *>(p);
+    return p + RECORD_HEADER;
+  }
+
+  void pop_record(uint32_t len)
+  {
+    this->release(record_bytes(len));
+  }
+
+  // Ring bytes a record of len payload bytes takes.
+  static size_t record_bytes(uint32_t len)
+  {
+    return RECORD_HEADER + (((size_t)len + 7U) & ~(size_t)7U);
+  }
+
+private:
+  enum { RECORD_HEADER = 8 };
+
+  mirror_ring(mirror_ring const &);
+  mirror_ring & operator=(mirror_ring const &);
+
+  void publish()
+  {
+    if ( this->unpublished ) {
+      this->tail_published.store(this->tail, std::memory_order_release);
+      this->unpublished = 0U;
+    }
+  }
+
+  /* Set up once. */
+  uint8_t *base;
+  size_t size;
+  size_t mask;
+  size_t publish_bytes;
+
+  /* Producer only. */
+  uint64_t head __attribute__ ((aligned(64)));
+  uint64_t tail_cache;
+
+  /* Consumer only. */
+  uint64_t tail __attribute__ ((aligned(64)));
+  uint64_t head_cache;
+  size_t unpublished;
+
+  /* Written by producer on every commit. */
+  std::atomic<uint64_t> head_published __attribute__ ((aligned(64)));
+
+  /* Written by consumer once per publish_bytes. */
+  std::atomic<uint64_t> tail_published __attribute__ ((aligned(64)));
+} __attribute__ ((aligned(64)));
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MPMC_B_QUQUQ_H_
+#define _MPMC_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "cpu.hpp"
+
+// Multi-producer/multi-consumer queue where threads claim whole batches of slots.
+//
+//   mpmc_queue<> q;
+//   mpmc_queue<>::producer p(q);        mpmc_queue<>::consumer c(q);
+//   p.enqueue(v);                       c.dequeue(&v);
+//   p.flush(); // when going idle
+//
+// Each thread works through its own handle. A handle with no slots left claims up to BATCH
+// consecutive slots with one CAS on the shared enqueue (or dequeue) counter, then fills (drains)
+// them privately, so the shared counters see one atomic operation per batch instead of one per
+// element, and neighbouring threads rarely write to the same cache line.
+//
+// Several laps of the ring can be in flight at once (a producer may claim a slot whose previous
+// element another consumer has claimed but not read yet), so zero-marking slots the way queue<>
+// does is not enough: every slot carries a sequence number telling which position it currently
+// holds, as in Vyukov's bounded MPMC queue. As a consequence 0 is an ordinary element here.
+//
+// Claims are bounded by what the other side has claimed, so consumers only claim slots some
+// producer has claimed. Those slots may still be unwritten: dequeue() returns BUFFER_EMPTY until
+// the owning producer gets to them, which is why a producer must flush() (it also does in its
+// destructor) before going idle; flush() marks its unused slots as skipped. Likewise a consumer
+// must not be destroyed while pending() != 0, or the elements it claimed are lost.
+//
+// Every consumer sees the elements of every single producer in the order they were enqueued.
+
+template<size_t QUEUE_SIZE = (1024 * 8), typename ELEMENT_TYPE = uint64_t, size_t BATCH = 64>
+class mpmc_queue
+{
+  static_assert((QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0, "QUEUE_SIZE must be a power of two");
+  static_assert(BATCH > 0 && BATCH <= QUEUE_SIZE, "BATCH must be in [1, QUEUE_SIZE]");
+
+public:
+  enum ReturnCode { SUCCESS=0, BUFFER_FULL=1, BUFFER_EMPTY=2 };
+  typedef ELEMENT_TYPE element_type;
+
+  static size_t queue_size() { return QUEUE_SIZE; }
+  static size_t batch_size() { return BATCH; }
+
+  mpmc_queue() : enqueue_pos(0U), dequeue_pos(0U)
+  {
+    for(size_t i = 0U; i < QUEUE_SIZE; ++i) {
+      this->slots[i].seq.store(i, std::memory_order_relaxed);
+      this->slots[i].skip = false;
+    }
+  }
+
+  class producer
+  {
+  public:
+    explicit producer(mpmc_queue &q_) : q(q_), pos(0U), end(0U), claimed(0U) { }
+    ~producer() { this->flush(); }
+
+    enum ReturnCode enqueue(ELEMENT_TYPE value)
+    {
+      if ( this->pos == this->end ) {
+        if ( !this->q.claim_enqueue(this->pos, this->end) ) { return BUFFER_FULL; }
+        ++this->claimed;
+      }
+
+      slot &s = this->q.slots[this->pos & MASK];
+      if ( s.seq.load(std::memory_order_acquire) != this->pos ) {
+        // the consumer of the previous lap has not read this slot yet
+        return BUFFER_FULL;
+      }
+      s.value = value;
+      s.skip = false;
+      s.seq.store(this->pos + 1U, std::memory_order_release);
+      ++this->pos;
+
+      return SUCCESS;
+    }
+
+    // Give up the rest of the claimed batch. Spins while the previous lap of a slot is still
+    // being read, which only lasts as long as the consumer holding it takes to get there.
+    void flush()
+    {
+      for(; this->pos != this->end; ++this->pos) {
+        slot &s = this->q.slots[this->pos & MASK];
+        while ( s.seq.load(std::memory_order_acquire) != this->pos ) { cpu::relax(); }
+        s.skip = true;
+        s.seq.store(this->pos + 1U, std::memory_order_release);
+      }
+    }
+
+    // Slots claimed but not written yet.
+    size_t pending() const { return this->end - this->pos; }
+    // Atomic operations this handle made on the shared counter.
+    uint64_t claims() const { return this->claimed; }
+
+  private:
+    producer(producer const &);
+    producer & operator=(producer const &);
+
+    mpmc_queue &q;
+    uint64_t pos;
+    uint64_t end;
+    uint64_t claimed;
+  };
+
+  class consumer
+  {
+  public:
+    explicit consumer(mpmc_queue &q_) : q(q_), pos(0U), end(0U), claimed(0U) { }
+
+    enum ReturnCode dequeue(ELEMENT_TYPE *value)
+    {
+      for(;;) {
+        if ( this->pos == this->end ) {
+          if ( !this->q.claim_dequeue(this->pos, this->end) ) { return BUFFER_EMPTY; }
+          ++this->claimed;
+        }
+
+        slot &s = this->q.slots[this->pos & MASK];
+        if ( s.seq.load(std::memory_order_acquire) != this->pos + 1U ) {
+          // claimed by a producer that has not written it yet
+          return BUFFER_EMPTY;
+        }
+        bool const skip = s.skip;
+        ELEMENT_TYPE const v = s.value;
+        s.seq.store(this->pos + QUEUE_SIZE, std::memory_order_release);
+        ++this->pos;
+
+        if ( !skip ) {
+          *value = v;
+          return SUCCESS;
+        }
+      }
+    }
+
+    // Slots claimed but not read yet.
+    size_t pending() const { return this->end - this->pos; }
+    // Atomic operations this handle made on the shared counter.
+    uint64_t claims() const { return this->claimed; }
+
+  private:
+    consumer(consumer const &);
+    consumer & operator=(consumer const &);
+
+    mpmc_queue &q;
+    uint64_t pos;
+    uint64_t end;
+    uint64_t claimed;
+  };
+
+private:
+  enum { MASK = QUEUE_SIZE - 1 };
+
+  struct slot {
+    std::atomic<uint64_t> seq;
+    bool skip;
+    ELEMENT_TYPE value;
+  };
+
+  // Claim up to BATCH slots, no more than QUEUE_SIZE ahead of the consumers' claims.
+  bool claim_enqueue(uint64_t &from, uint64_t &to)
+  {
+    uint64_t e = this->enqueue_pos.load(std::memory_order_relaxed);
+    for(;;) {
+      int64_t const used = (int64_t)(e - this->dequeue_pos.load(std::memory_order_acquire));
+      if ( used < 0 ) { // e is stale, consumers already claimed past it
+        e = this->enqueue_pos.load(std::memory_order_relaxed);
+        continue;
+      }
+      if ( (uint64_t)used >= QUEUE_SIZE ) { return false; }
+      uint64_t n = QUEUE_SIZE - (uint64_t)used;
+      if ( n > BATCH ) { n = BATCH; }
+      if ( this->enqueue_pos.compare_exchange_weak(e, e + n, std::memory_order_acq_rel) ) {
+        from = e;
+        to = e + n;
+        return true;
+      }
+    }
+  }
+
+  // Claim up to BATCH slots the producers have claimed.
+  bool claim_dequeue(uint64_t &from, uint64_t &to)
+  {
+    uint64_t d = this->dequeue_pos.load(std::memory_order_relaxed);
+    uint64_t n;
+    do {
+      int64_t const avail = (int64_t)(this->enqueue_pos.load(std::memory_order_acquire) - d);
+      if ( avail <= 0 ) { return false; }
+      n = (uint64_t)avail < BATCH ? (uint64_t)avail : BATCH;
+    } while ( !this->dequeue_pos.compare_exchange_weak(d, d + n, std::memory_order_acq_rel) );
+
+    from = d;
+    to = d + n;
+    return true;
+  }
+
+  /* Claimed by producers. */
+  std::atomic<uint64_t> enqueue_pos __attribute__ ((aligned(64)));
+
+  /* Claimed by consumers. */
+  std::atomic<uint64_t> dequeue_pos __attribute__ ((aligned(64)));
+
+  /* Written by whichever thread owns the slot. */
+  slot slots[QUEUE_SIZE] __attribute__ ((aligned(64)));
+} __attribute__ ((aligned(64)));
+
+#endif
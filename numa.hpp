@@ -0,0 +1,190 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _NUMA_B_QUQUQ_H_
+#define _NUMA_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <new>
+#include "cpu.hpp"
+
+// NUMA placement for queue memory.
+//
+//   queue_t *q = numa_new<queue_t>(NUMA_CONSUMER, producer_cpu, consumer_cpu);
+//   ...
+//   numa_delete(q);
+//
+// The object gets its own page-aligned mapping. Before any page is touched the mapping is bound
+// with mbind(2): NUMA_PRODUCER / NUMA_CONSUMER bind it to the node of that side's cpu,
+// NUMA_INTERLEAVE spreads pages over all nodes. The constructor (which writes every slot of
+// queue<>'s data array) then runs on a thread pinned to the chosen cpu, so even where mbind is
+// not permitted (containers) first touch still puts the pages on the intended node.
+// NUMA_FIRST_TOUCH skips mbind and constructs on the calling thread, which is what a static
+// queues[] array in main.c / test4.cpp gets.
+//
+// The raw syscalls are used so there is no dependency on libnuma.
+
+enum numa_policy { NUMA_FIRST_TOUCH = 0, NUMA_PRODUCER, NUMA_CONSUMER, NUMA_INTERLEAVE };
+
+static inline char const * numa_policy_name(numa_policy policy)
+{
+  static char const * const names[] = { "first-touch", "producer", "consumer", "interleave" };
+  return names[policy];
+}
+
+// Node of cpu_id from sysfs, 0 on machines without NUMA information.
+static inline int numa_node_of_cpu(int cpu_id)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu_id);
+  DIR *dir = opendir(path);
+  if ( !dir ) { return 0; }
+
+  int node = 0;
+  for(struct dirent *e = readdir(dir); e; e = readdir(dir)) {
+    if ( sscanf(e->d_name, "node%d", &node) == 1 ) { break; }
+  }
+  closedir(dir);
+  return node;
+}
+
+// Highest online node + 1.
+static inline int numa_nodes()
+{
+  int first = 0, last = 0;
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  if ( !f ) { return 1; }
+  int const n = fscanf(f, "%d-%d", &first, &last);
+  fclose(f);
+  return (n == 2 ? last : first) + 1;
+}
+
+// Node that backs addr (after it was touched), -1 if the kernel does not say.
+static inline int numa_node_of_addr(void const *addr)
+{
+  int node = -1;
+  if ( syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) != 0 ) { return -1; }
+  return node;
+}
+
+namespace numa_detail
+{
+  struct mapping_header {
+    size_t length;
+  };
+
+  template<typename T>
+  struct construct_args {
+    void *mem;
+    T *obj;
+    int cpu_id;
+  };
+
+  template<typename T>
+  static void * construct_on_cpu(void *arg)
+  {
+    construct_args<T> *a = static_cast<construct_args<T> *>(arg);
+    cpu::pin(a->cpu_id);
+    a->obj = new (a->mem) T();
+    return NULL;
+  }
+
+  static inline size_t page_size() { return (size_t)sysconf(_SC_PAGESIZE); }
+
+  // The header lives in the page before the object, so the object starts page-aligned.
+  static inline size_t mapping_length(size_t size)
+  {
+    size_t const page = page_size();
+    return page + ((size + page - 1) / page) * page;
+  }
+
+  static inline void bind(void *addr, size_t len, numa_policy policy, int node)
+  {
+    unsigned long mask[16] = { 0 };
+    unsigned long const maxnode = sizeof(mask) * 8;
+    int mode;
+
+    if ( policy == NUMA_INTERLEAVE ) {
+      int const nodes = numa_nodes();
+      for(int n = 0; n < nodes && n < (int)maxnode; ++n) { mask[n / 64] |= 1UL << (n % 64); }
+      mode = MPOL_INTERLEAVE;
+    }
+    else {
+      mask[node / 64] |= 1UL << (node % 64);
+      mode = MPOL_BIND;
+    }
+
+    if ( syscall(SYS_mbind, addr, len, mode, mask, maxnode, 0) != 0 ) {
+      // EPERM in most containers, ENOSYS without CONFIG_NUMA; first touch still applies
+      perror("Warning: mbind");
+    }
+  }
+}
+
+// Allocate and construct a T placed according to policy. Returns NULL if the mapping fails.
+template<typename T>
+T * numa_new(numa_policy policy, int producer_cpu, int consumer_cpu)
+{
+  size_t const page = numa_detail::page_size();
+  size_t const len = numa_detail::mapping_length(sizeof(T));
+
+  void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( base == MAP_FAILED ) {
+    perror("Error: mmap");
+    return NULL;
+  }
+  static_cast<numa_detail::mapping_header *>(base)->length = len;
+  void *mem = static_cast<char *>(base) + page;
+
+  int const cpu_id = (policy == NUMA_PRODUCER) ? producer_cpu : consumer_cpu;
+  if ( policy != NUMA_FIRST_TOUCH ) {
+    numa_detail::bind(mem, len - page, policy, numa_node_of_cpu(cpu_id));
+  }
+
+  if ( policy == NUMA_PRODUCER || policy == NUMA_CONSUMER ) {
+    numa_detail::construct_args<T> args = { mem, NULL, cpu_id };
+    pthread_t t;
+    pthread_create(&t, NULL, numa_detail::construct_on_cpu<T>, &args);
+    pthread_join(t, NULL);
+    return args.obj;
+  }
+
+  return new (mem) T();
+}
+
+template<typename T>
+void numa_delete(T *obj)
+{
+  if ( !obj ) { return; }
+  obj->~T();
+  void *base = reinterpret_cast<char *>(obj) - numa_detail::page_size();
+  munmap(base, static_cast<numa_detail::mapping_header *>(base)->length);
+}
+
+#endif
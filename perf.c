@@ -0,0 +1,164 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+static const char *counter_names[PERF_NUM_COUNTERS] = {
+	"cycles", "instructions", "L1D-misses", "LLC-misses", "HITM"
+};
+
+const char *perf_counter_name(enum perf_counter c)
+{
+	return counter_names[c];
+}
+
+static int open_counter(uint32_t type, uint64_t config, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group_fd == -1;	/* the leader starts the whole group */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/* pid 0, cpu -1: the calling thread on whatever cpu it runs */
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+#define CACHE_READ_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+int perf_open(struct perf_group *g)
+{
+	const char *env = getenv("BQ_PERF");
+	const char *hitm = getenv("BQ_PERF_HITM");
+	int i;
+
+	memset(g, 0, sizeof(*g));
+	for (i = 0; i < PERF_NUM_COUNTERS; i++)
+		g->fd[i] = -1;
+
+	if (env && !strcmp(env, "0"))
+		return 0;
+
+	g->fd[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+	if (g->fd[PERF_CYCLES] < 0) {
+		fprintf(stderr, "perf: counters unavailable (%s), reporting TSC only\n",
+			strerror(errno));
+		return 0;
+	}
+	g->count = 1;
+
+	g->fd[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_INSTRUCTIONS, g->fd[PERF_CYCLES]);
+	g->fd[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+		CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D), g->fd[PERF_CYCLES]);
+	g->fd[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+		CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL), g->fd[PERF_CYCLES]);
+	if (hitm)
+		g->fd[PERF_HITM] = open_counter(PERF_TYPE_RAW,
+			strtoull(hitm, NULL, 0), g->fd[PERF_CYCLES]);
+
+	for (i = 1; i < PERF_NUM_COUNTERS; i++)
+		if (g->fd[i] >= 0)
+			g->count++;
+	return g->count;
+}
+
+void perf_start(struct perf_group *g)
+{
+	if (g->count == 0)
+		return;
+	ioctl(g->fd[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(g->fd[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void perf_stop(struct perf_group *g)
+{
+	/* nr, time_enabled, time_running, then one value per member in opening order */
+	uint64_t buf[3 + PERF_NUM_COUNTERS];
+	int i, k;
+
+	if (g->count == 0)
+		return;
+	ioctl(g->fd[PERF_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	if (read(g->fd[PERF_CYCLES], buf, sizeof(buf)) < (ssize_t)(3 * sizeof(uint64_t)) ||
+	    buf[2] == 0) {
+		/* never scheduled: more events than the PMU has counters */
+		fprintf(stderr, "perf: group was not scheduled\n");
+		return;
+	}
+
+	for (i = 0, k = 3; i < PERF_NUM_COUNTERS && k < 3 + (int)buf[0]; i++) {
+		if (g->fd[i] < 0)
+			continue;
+		/* scale up if the group shared the PMU with other events */
+		g->value[i] = (uint64_t)((double)buf[k++] * buf[1] / buf[2]);
+	}
+}
+
+void perf_close(struct perf_group *g)
+{
+	int i;
+
+	/* members first, the leader last */
+	for (i = PERF_NUM_COUNTERS - 1; i >= 0; i--) {
+		if (g->fd[i] >= 0)
+			close(g->fd[i]);
+		g->fd[i] = -1;
+	}
+	g->count = 0;
+}
+
+void perf_report(const struct perf_group *g, char *buf, size_t len, uint64_t ops)
+{
+	size_t n = 0;
+	int i;
+
+	buf[0] = '\0';
+	if (g->count == 0) {
+		snprintf(buf, len, "n/a");
+		return;
+	}
+	if (ops == 0)
+		ops = 1;
+
+	for (i = 0; i < PERF_NUM_COUNTERS && n < len; i++) {
+		if (g->fd[i] < 0)
+			continue;
+		n += snprintf(buf + n, len - n, "%s%s %.2f", n ? " " : "",
+			counter_names[i], (double)g->value[i] / ops);
+	}
+}
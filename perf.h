@@ -0,0 +1,82 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PERF_B_QUQUQ_H_
+#define _PERF_B_QUQUQ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Per-thread hardware counters around the measured loop of a benchmark thread:
+ *
+ *	struct perf_group pg;
+ *	perf_open(&pg);			after pinning, counts the calling thread only
+ *	perf_start(&pg);
+ *	... loop ...
+ *	perf_stop(&pg);
+ *	perf_report(&pg, buf, sizeof(buf), ops);
+ *	perf_close(&pg);
+ *
+ * The events form one group led by cycles so they are scheduled together. Events the CPU or
+ * the kernel does not offer are left out; if perf_event_open(2) is not permitted at all
+ * (perf_event_paranoid, containers) the group is empty and the report says so. Only user
+ * space is counted, which is what perf_event_paranoid=2 still allows.
+ *
+ * Cross-core snoops that hit a modified line (HITM) have no generic perf event; set
+ * BQ_PERF_HITM to the raw event code of the CPU, e.g. 0x04d2 (MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM)
+ * on Skylake, 0x20d2 on Ice Lake. Setting BQ_PERF=0 turns the counters off. */
+
+enum perf_counter {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_HITM,
+	PERF_NUM_COUNTERS
+};
+
+struct perf_group {
+	int		fd[PERF_NUM_COUNTERS];		/* -1 if not available */
+	uint64_t	value[PERF_NUM_COUNTERS];	/* after perf_stop(), scaled if multiplexed */
+	int		count;				/* counters opened */
+};
+
+const char *perf_counter_name(enum perf_counter c);
+
+/* Returns the number of counters opened, 0 when perf is unavailable. */
+int perf_open(struct perf_group *g);
+void perf_start(struct perf_group *g);
+void perf_stop(struct perf_group *g);
+void perf_close(struct perf_group *g);
+
+/* One line of "<name> <value per op>" for the opened counters, e.g.
+ * "cycles 21.4 instructions 30.0 L1D-misses 0.14 LLC-misses 0.00 HITM 0.13". */
+void perf_report(const struct perf_group *g, char *buf, size_t len, uint64_t ops);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PIPELINE_B_QUQUQ_H_
+#define _PIPELINE_B_QUQUQ_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <ostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// A linear pipeline of stages, one pinned thread per stage, connected by queue<> channels.
+//
+//   pipeline p;
+//   p.source<std::string>("read", 1, reader)          // bool reader(emitter<std::string> &)
+//    .then<record>("parse", 2, parser)                // void parser(std::string &, emitter<record> &)
+//    .sink("aggregate", 3, aggregator);               // void aggregator(record &)
+//   p.run();
+//   p.report(std::cout);
+//
+// Items travel between stages in batches: a channel slot carries a pointer to a batch of up to
+// batch_size() items, so one queue<> operation moves a whole batch. A stage flushes its partial
+// output batch whenever its input runs dry, so a slow trickle is not held back.
+//
+// End-of-stream is a marker sent after the last batch: the source sends it when its callable
+// returns false (or stop() is called), every other stage forwards it after flushing.
+// stop() is a graceful shutdown (the source ends the stream and everything in flight is drained),
+// abort() makes every stage leave at once and drops what is in flight.
+//
+// Channels use queue<> without consumer batching: the payload is already a batch, and consumer
+// batching never releases the last element of a stream, which here would be the end-of-stream.
+
+class pipeline
+{
+public:
+  enum { DEFAULT_BATCH_SIZE = 256 };
+
+  template<typename T> class emitter;
+  template<typename T> class link;
+
+  explicit pipeline(size_t batch_size = DEFAULT_BATCH_SIZE)
+    : batch_size_(batch_size ? batch_size : 1), stopping(false), aborting(false), started(false)
+  {
+  }
+
+  ~pipeline()
+  {
+    if ( started ) { this->abort(); this->join(); }
+    for(size_t i = 0U; i < stages.size(); ++i) { delete stages[i]; }
+    for(size_t i = 0U; i < channels.size(); ++i) { delete channels[i]; }
+  }
+
+  size_t batch_size() const { return batch_size_; }
+
+  // First stage: f(emitter<Out> &) is called until it returns false.
+  template<typename Out, typename F> link<Out> source(char const *name, int cpu_id, F f)
+  {
+    channel<Out> *out = this->add_channel<Out>();
+    this->stages.push_back(new source_stage<Out, F>(this, name, cpu_id, f, out));
+    return link<Out>(this, out);
+  }
+
+  // Start all stages and wait for the end-of-stream to reach the sink.
+  void run() { this->start(); this->join(); }
+
+  void start()
+  {
+    pthread_barrier_init(&barrier, NULL, stages.size() + 1);
+    for(size_t i = 0U; i < stages.size(); ++i) {
+      pthread_create(&stages[i]->thread, NULL, stage_base::trampoline, stages[i]);
+    }
+    started = true;
+    pthread_barrier_wait(&barrier);
+  }
+
+  void join()
+  {
+    if ( !started ) { return; }
+    for(size_t i = 0U; i < stages.size(); ++i) {
+      pthread_join(stages[i]->thread, NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    started = false;
+  }
+
+  void stop() { stopping.store(true, std::memory_order_release); }
+  void abort() { aborting.store(true, std::memory_order_release); this->stop(); }
+
+  // Per-stage throughput and stall report. Stalls are split into waiting for input (the channel
+  // in front of the stage was empty) and waiting for output (the channel behind it was full).
+  void report(std::ostream &os) const
+  {
+    os << std::left << std::setw(12) << "stage" << std::right
+      << std::setw(5) << "cpu" << std::setw(12) << "items in" << std::setw(12) << "items out"
+      << std::setw(12) << "cycles/item" << std::setw(10) << "in-stall" << std::setw(11) << "out-stall"
+      << std::endl;
+
+    for(size_t i = 0U; i < stages.size(); ++i) {
+      stage_stats const &s = stages[i]->stats;
+      uint64_t const total = s.stop_c - s.start_c;
+      uint64_t const items = s.items_in ? s.items_in : s.items_out;
+      os << std::left << std::setw(12) << stages[i]->name << std::right
+        << std::setw(5) << stages[i]->cpu_id
+        << std::setw(12) << s.items_in << std::setw(12) << s.items_out
+        << std::setw(12) << (items ? total / items : 0)
+        << std::setw(9) << std::fixed << std::setprecision(1) << percent(s.stall_in_c, total) << "%"
+        << std::setw(10) << percent(s.stall_out_c, total) << "%"
+        << std::endl;
+    }
+  }
+
+private:
+  typedef queue<1024, uint64_t, 1000, false, false, false, false> ring_t;
+
+  enum { SPINS_BEFORE_YIELD = 1024 };
+
+  struct stage_stats {
+    uint64_t items_in, items_out;
+    uint64_t batches_in, batches_out;
+    uint64_t start_c, stop_c;
+    uint64_t stall_in_c, stall_out_c; /* cycles spent waiting on an empty input / a full output */
+
+    stage_stats() : items_in(0), items_out(0), batches_in(0), batches_out(0)
+      , start_c(0), stop_c(0), stall_in_c(0), stall_out_c(0) { }
+  };
+
+  struct channel_base {
+    virtual ~channel_base() { }
+  };
+
+  template<typename T>
+  struct batch {
+    std::vector<T> items;
+  };
+
+  // Single producer, single consumer; slots hold batch<T> pointers or END_OF_STREAM.
+  template<typename T>
+  struct channel : public channel_base {
+    static const uint64_t END_OF_STREAM = 0x1UL;
+
+    ring_t ring;
+
+    ~channel()
+    {
+      uint64_t slot;
+      while ( ring.dequeue(&slot) == ring_t::SUCCESS ) {
+        if ( slot != END_OF_STREAM ) { delete reinterpret_cast<batch<T> *>(slot); }
+      }
+    }
+  };
+
+  struct stage_base {
+    pipeline *p;
+    std::string name;
+    int cpu_id;
+    pthread_t thread;
+    stage_stats stats;
+
+    stage_base(pipeline *p_, char const *name_, int cpu_id_) : p(p_), name(name_), cpu_id(cpu_id_) { }
+    virtual ~stage_base() { }
+    virtual void body() = 0;
+
+    static void * trampoline(void *arg)
+    {
+      stage_base *s = static_cast<stage_base *>(arg);
+      // keep going unpinned, a pipeline on an oversubscribed box is still a pipeline
+      cpu::pin(s->cpu_id);
+      pthread_barrier_wait(&s->p->barrier);
+
+      s->stats.start_c = cpu::read_tsc();
+      s->body();
+      s->stats.stop_c = cpu::read_tsc();
+      return NULL;
+    }
+
+    // Returns NULL on end-of-stream or abort.
+    template<typename T, typename E> batch<T> * receive(channel<T> *in, E *idle_flush)
+    {
+      uint64_t slot;
+      if ( in->ring.dequeue(&slot) != ring_t::SUCCESS ) {
+        if ( idle_flush ) { idle_flush->flush(); }
+
+        uint64_t const stall_start = cpu::read_tsc();
+        for(unsigned spins = 1; in->ring.dequeue(&slot) != ring_t::SUCCESS; ++spins) {
+          if ( p->aborting.load(std::memory_order_relaxed) ) { return NULL; }
+          if ( spins % SPINS_BEFORE_YIELD == 0 ) { sched_yield(); } else { cpu::relax(); }
+        }
+        stats.stall_in_c += cpu::read_tsc() - stall_start;
+      }
+
+      if ( slot == channel<T>::END_OF_STREAM ) { return NULL; }
+
+      batch<T> *b = reinterpret_cast<batch<T> *>(slot);
+      stats.batches_in ++;
+      stats.items_in += b->items.size();
+      return b;
+    }
+  };
+
+public:
+  template<typename T>
+  class emitter
+  {
+  public:
+    void push(T const &value)
+    {
+      if ( !cur ) { cur = new batch<T>(); cur->items.reserve(owner->p->batch_size_); }
+      cur->items.push_back(value);
+      if ( cur->items.size() >= owner->p->batch_size_ ) { this->flush(); }
+    }
+
+    // Hand the current partial batch to the next stage.
+    void flush()
+    {
+      if ( !cur ) { return; }
+      owner->stats.items_out += cur->items.size();
+      owner->stats.batches_out ++;
+      if ( !this->send(reinterpret_cast<uint64_t>(cur)) ) { delete cur; }
+      cur = NULL;
+    }
+
+  private:
+    friend class pipeline;
+    emitter(stage_base *owner_, channel<T> *out_) : owner(owner_), out(out_), cur(NULL) { }
+    ~emitter() { delete cur; }
+
+    void close()
+    {
+      this->flush();
+      this->send(channel<T>::END_OF_STREAM);
+    }
+
+    bool send(uint64_t slot)
+    {
+      if ( out->ring.enqueue(slot) == ring_t::SUCCESS ) { return true; }
+
+      uint64_t const stall_start = cpu::read_tsc();
+      for(unsigned spins = 1; out->ring.enqueue(slot) != ring_t::SUCCESS; ++spins) {
+        if ( owner->p->aborting.load(std::memory_order_relaxed) ) { return false; }
+        if ( spins % SPINS_BEFORE_YIELD == 0 ) { sched_yield(); } else { cpu::relax(); }
+      }
+      owner->stats.stall_out_c += cpu::read_tsc() - stall_start;
+      return true;
+    }
+
+    stage_base *owner;
+    channel<T> *out;
+    batch<T> *cur;
+  };
+
+private:
+  template<typename Out, typename F>
+  struct source_stage : public stage_base {
+    F f;
+    emitter<Out> out;
+
+    source_stage(pipeline *p_, char const *name_, int cpu_id_, F f_, channel<Out> *out_)
+      : stage_base(p_, name_, cpu_id_), f(f_), out(this, out_) { }
+
+    void body()
+    {
+      while ( !p->stopping.load(std::memory_order_relaxed) && f(out) ) { }
+      out.close();
+    }
+  };
+
+  template<typename In, typename Out, typename F>
+  struct map_stage : public stage_base {
+    F f;
+    channel<In> *in;
+    emitter<Out> out;
+
+    map_stage(pipeline *p_, char const *name_, int cpu_id_, F f_, channel<In> *in_, channel<Out> *out_)
+      : stage_base(p_, name_, cpu_id_), f(f_), in(in_), out(this, out_) { }
+
+    void body()
+    {
+      while ( batch<In> *b = this->receive(in, &out) ) {
+        for(size_t i = 0U; i < b->items.size(); ++i) { f(b->items[i], out); }
+        delete b;
+      }
+      out.close();
+    }
+  };
+
+  template<typename In, typename F>
+  struct sink_stage : public stage_base {
+    F f;
+    channel<In> *in;
+
+    sink_stage(pipeline *p_, char const *name_, int cpu_id_, F f_, channel<In> *in_)
+      : stage_base(p_, name_, cpu_id_), f(f_), in(in_) { }
+
+    void body()
+    {
+      while ( batch<In> *b = this->receive(in, static_cast<emitter<In> *>(NULL)) ) {
+        for(size_t i = 0U; i < b->items.size(); ++i) { f(b->items[i]); }
+        delete b;
+      }
+    }
+  };
+
+  template<typename T> channel<T> * add_channel()
+  {
+    channel<T> *ch = new channel<T>();
+    channels.push_back(ch);
+    return ch;
+  }
+
+  static double percent(uint64_t part, uint64_t total)
+  {
+    return total ? (100.0 * part) / total : 0.0;
+  }
+
+public:
+  template<typename T>
+  class link
+  {
+  public:
+    // Middle stage: f(In &, emitter<Out> &) is called for every input item.
+    template<typename Out, typename F> link<Out> then(char const *name, int cpu_id, F f)
+    {
+      channel<Out> *out = p->add_channel<Out>();
+      p->stages.push_back(new map_stage<T, Out, F>(p, name, cpu_id, f, in, out));
+      return link<Out>(p, out);
+    }
+
+    // Last stage: f(In &) is called for every input item.
+    template<typename F> void sink(char const *name, int cpu_id, F f)
+    {
+      p->stages.push_back(new sink_stage<T, F>(p, name, cpu_id, f, in));
+    }
+
+  private:
+    friend class pipeline;
+    link(pipeline *p_, channel<T> *in_) : p(p_), in(in_) { }
+
+    pipeline *p;
+    channel<T> *in;
+  };
+
+private:
+  size_t const batch_size_;
+  std::atomic<bool> stopping;
+  std::atomic<bool> aborting;
+  bool started;
+  pthread_barrier_t barrier;
+  std::vector<stage_base *> stages;
+  std::vector<channel_base *> channels;
+};
+
+#endif
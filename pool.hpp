@@ -0,0 +1,138 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _POOL_B_QUQUQ_H_
+#define _POOL_B_QUQUQ_H_
+
+#include <stdint.h>
+#include "fifo2.hpp"
+
+// SPSC message channel over a preallocated pool of T buffers.
+//
+// All POOL_SIZE buffers live in one arena allocated up front. The forward queue<> carries
+// buffer handles (index + 1, never ELEMENT_ZERO) from producer to consumer; a reverse queue<>
+// carries them back. The consumer collects released handles and returns them RETURN_BATCH at
+// a time; the producer refills its private free stack from the reverse queue only when the
+// stack runs dry. Neither side calls the allocator after construction.
+//
+//   producer:  T *m = pool.acquire(); ... pool.send(m);
+//   consumer:  T *m = pool.receive(); ... pool.release(m);
+//
+// acquire() returns NULL when every buffer is in flight; exhausted() counts those calls.
+// Both queues hold POOL_SIZE handles, so send() and the returns never find them full.
+
+template<typename T, size_t POOL_SIZE = (1024 * 8), size_t RETURN_BATCH = (POOL_SIZE / 16)>
+class message_pool
+{
+public:
+  typedef queue<POOL_SIZE> forward_t;
+  typedef queue<POOL_SIZE, uint64_t, 0> reverse_t;
+
+  message_pool() : free_count(POOL_SIZE), exhausted_count(0), pending_count(0)
+  {
+    arena = new T[POOL_SIZE];
+    for(size_t i = 0U; i < POOL_SIZE; ++i) {
+      free_stack[i] = POOL_SIZE - i; // hand out the start of the arena first
+    }
+  }
+
+  ~message_pool() { delete [] arena; }
+
+  static size_t pool_size() { return POOL_SIZE; }
+
+  /* Producer side. */
+
+  T * acquire()
+  {
+    if ( free_count == 0 && !this->refill() ) {
+      exhausted_count ++;
+      return NULL;
+    }
+    return this->buffer(free_stack[--free_count]);
+  }
+
+  void send(T *msg)
+  {
+    forward.enqueue(this->handle(msg));
+  }
+
+  // Times acquire() found the pool empty.
+  uint64_t exhausted() const { return exhausted_count; }
+
+  /* Consumer side. */
+
+  T * receive()
+  {
+    uint64_t h;
+    if ( forward.dequeue(&h) != forward_t::SUCCESS &&
+         forward.dequeue_unbatched(&h) != forward_t::SUCCESS ) {
+      return NULL;
+    }
+    return this->buffer(h);
+  }
+
+  void release(T *msg)
+  {
+    pending[pending_count++] = this->handle(msg);
+    if ( pending_count == RETURN_BATCH ) { this->flush(); }
+  }
+
+  // Return released buffers now rather than at the next full batch,
+  // e.g. before the consumer goes idle.
+  void flush()
+  {
+    for(size_t i = 0U; i < pending_count; ++i) {
+      reverse.enqueue(pending[i]);
+    }
+    pending_count = 0;
+  }
+
+private:
+  uint64_t handle(T *msg) const { return (uint64_t)(msg - arena) + 1; }
+  T * buffer(uint64_t h) const { return arena + (h - 1); }
+
+  bool refill()
+  {
+    uint64_t h;
+    while ( free_count < POOL_SIZE &&
+            ( reverse.dequeue(&h) == reverse_t::SUCCESS ||
+              reverse.dequeue_unbatched(&h) == reverse_t::SUCCESS ) ) {
+      free_stack[free_count++] = h;
+    }
+    return free_count > 0;
+  }
+
+  T *arena;
+
+  forward_t forward;
+  reverse_t reverse;
+
+  /* Accessed by producer only. */
+  size_t free_count __attribute__ ((aligned(64)));
+  uint64_t exhausted_count;
+  uint64_t free_stack[POOL_SIZE];
+
+  /* Accessed by consumer only. */
+  size_t pending_count __attribute__ ((aligned(64)));
+  uint64_t pending[RETURN_BATCH];
+} __attribute__ ((aligned(64)));
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SPILL_B_QUQUQ_H_
+#define _SPILL_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include "fifo2.hpp"
+
+// SPSC queue<> that overflows into a memory-mapped file instead of returning BUFFER_FULL.
+//
+//   spill_queue<> q("/var/tmp", 1ULL << 30);   // 1 GiB of overflow in an unnamed file there
+//
+// While the ring has room enqueue() and dequeue() are queue<>'s plus one test of a flag the
+// producer owns. When the ring is full the producer switches to spilling: this element and all
+// following ones are appended to the file (one sequential store each, the kernel writes the
+// pages back in the background), until the consumer has drained everything spilled. Only then
+// does the producer return to the ring, so the ring never holds an element newer than one in
+// the file and FIFO order holds end to end.
+//
+// The consumer empties the ring first (including the tail consumer batching would hold back;
+// nothing newer can be there while the spill is non-empty), then reads the file in order.
+//
+// The file is a ring of capacity_bytes addressed by two monotonic counters, so it never
+// has to be rewound; enqueue() returns BUFFER_FULL only when both the ring and the file are
+// full. The file is created in directory dir without a name (O_TMPFILE), or where the file
+// system cannot do that under a fresh mkstemp() name that is unlinked right after mapping, so
+// no existing file is ever opened and nothing is left behind. If it cannot be created the
+// queue works without spill, which is queue<>'s behaviour.
+
+template<typename Q = queue<> >
+class spill_queue : public Q
+{
+public:
+  typedef typename Q::element_type element_type;
+  typedef typename Q::ReturnCode ReturnCode;
+
+  spill_queue(char const *dir, size_t capacity_bytes)
+    : spill(NULL), capacity(0U), spilling(false), spilled(0U), spill_head_local(0U)
+    , spill_head(0U), spill_tail(0U)
+  {
+    int const fd = create_file(dir);
+    if ( fd < 0 ) {
+      perror("Error: spill open");
+      return;
+    }
+    size_t const n = capacity_bytes / sizeof(element_type);
+    size_t const len = n * sizeof(element_type);
+    if ( n > 0 && ftruncate(fd, len) == 0 ) {
+      void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if ( m != MAP_FAILED ) {
+        madvise(m, len, MADV_SEQUENTIAL);
+        spill = static_cast<element_type *>(m);
+        capacity = n;
+      }
+      else {
+        perror("Error: spill mmap");
+      }
+    }
+    else {
+      perror("Error: spill ftruncate");
+    }
+    close(fd);
+  }
+
+  ~spill_queue()
+  {
+    if ( spill ) { munmap(spill, capacity * sizeof(element_type)); }
+  }
+
+  /* Producer side. */
+
+  ReturnCode enqueue(element_type value)
+  {
+    if ( !this->spilling ) {
+      ReturnCode const r = Q::enqueue(value);
+      if ( r == Q::SUCCESS || this->capacity == 0 ) { return r; }
+      this->spilling = true;
+    }
+    else if ( this->spill_tail.load(std::memory_order_acquire) == this->spill_head_local ) {
+      // the consumer has caught up with the file, everything older is gone
+      this->spilling = false;
+      return this->enqueue(value);
+    }
+
+    uint64_t const h = this->spill_head_local;
+    if ( h - this->spill_tail.load(std::memory_order_acquire) >= this->capacity ) {
+      return Q::BUFFER_FULL;
+    }
+    this->spill[h % this->capacity] = value;
+    this->spill_head_local = h + 1;
+    this->spill_head.store(h + 1, std::memory_order_release);
+    ++this->spilled;
+
+    return Q::SUCCESS;
+  }
+
+  // Elements written to the file so far.
+  uint64_t spilled_count() const { return this->spilled; }
+  bool is_spilling() const { return this->spilling; }
+
+  /* Consumer side. */
+
+  ReturnCode dequeue(element_type *value)
+  {
+    ReturnCode const r = Q::dequeue(value);
+    if ( r == Q::SUCCESS ) { return r; }
+
+    uint64_t const t = this->spill_tail.load(std::memory_order_relaxed);
+    if ( this->spill_head.load(std::memory_order_acquire) == t ) { return r; }
+
+    // the ring holds only elements older than the spill, and no more will come until the
+    // spill is drained
+    if ( Q::dequeue_unbatched(value) == Q::SUCCESS ) { return Q::SUCCESS; }
+
+    *value = this->spill[t % this->capacity];
+    this->spill_tail.store(t + 1, std::memory_order_release);
+    return Q::SUCCESS;
+  }
+
+  // Elements in the file not read yet (consumer side, a snapshot).
+  uint64_t spill_backlog() const
+  {
+    return this->spill_head.load(std::memory_order_acquire) - this->spill_tail.load(std::memory_order_relaxed);
+  }
+
+private:
+  // A new file in dir that no other path refers to.
+  static int create_file(char const *dir)
+  {
+    int fd = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if ( fd >= 0 ) { return fd; }
+
+    char name[4096];
+    if ( snprintf(name, sizeof(name), "%s/spill.XXXXXX", dir) >= (int)sizeof(name) ) { return -1; }
+    fd = mkostemp(name, O_CLOEXEC);
+    if ( fd >= 0 ) { unlink(name); }
+    return fd;
+  }
+
+  element_type *spill;
+  size_t capacity; // elements
+
+  /* Producer only. */
+  bool spilling __attribute__ ((aligned(64)));
+  uint64_t spilled;
+  uint64_t spill_head_local;
+
+  /* Written by producer. */
+  std::atomic<uint64_t> spill_head __attribute__ ((aligned(64)));
+
+  /* Written by consumer. */
+  std::atomic<uint64_t> spill_tail __attribute__ ((aligned(64)));
+};
+
+#endif
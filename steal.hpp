@@ -0,0 +1,311 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _STEAL_B_QUQUQ_H_
+#define _STEAL_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <vector>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+// Task executor: one submitter thread, N workers, each with a queue<> inbox, and work stealing
+// between the workers.
+//
+//   stealing_executor<> ex(4, cpus);                        // cpus may be empty: unpinned
+//   uint8_t const f = ex.add_function(fn, ctx);             // void fn(void *ctx, uint64_t arg, size_t worker)
+//   ex.start();
+//   submitter:  ex.submit(stealing_executor<>::task(f, arg)); ... ex.stop();
+//
+// A task is one uint64_t, so it is exactly a queue<> element: the function id + 1 in the top
+// 8 bits (so a task is never ELEMENT_ZERO) and a 56-bit argument, typically an index into the
+// caller's own table. Up to 255 functions can be added, before start(); add_function() returns
+// FUNCTIONS_FULL past that.
+//
+// The submitter fills one worker's inbox with SUBMIT_BATCH tasks before it moves to the next
+// worker, so it keeps writing to the same lines and each worker receives a batch at a time. A
+// full inbox is skipped. Every inbox keeps exactly one producer (the submitter) and one
+// consumer (its worker).
+//
+// Stealing therefore never touches another worker's inbox. An idle worker picks the peer whose
+// inbox is deepest (queue<>::depth()) and posts its id in the peer's request word. The peer
+// checks that word between two tasks. It takes up to half its backlog (at most STEAL_BATCH)
+// out of its own inbox into the thief's steal buffer, and then answers with the count. The
+// thief keeps running its own inbox while it waits, then runs the stolen batch. The buffer has
+// one writer at a time, because a thief has at most one request outstanding. Workers also
+// answer requests while idle or waiting for an answer themselves, so two workers asking each
+// other cannot deadlock. A finishing worker answers the request it holds before it stops
+// taking new ones, so every request is answered.
+//
+// stop(), after the submitter's last submit(), lets every worker finish its inbox and joins
+// them. Tasks cannot submit further tasks: the submitter is the inboxes' only producer.
+
+template<size_t MAX_WORKERS = 64, size_t INBOX_SIZE = (1024 * 8), size_t SUBMIT_BATCH = 64,
+  size_t STEAL_BATCH = 256>
+class stealing_executor
+{
+public:
+  typedef queue<INBOX_SIZE> inbox_t;
+  typedef void (*task_fn)(void *ctx, uint64_t arg, size_t worker);
+
+  enum { ARG_BITS = 56, MAX_FUNCTIONS = 255 };
+  static const uint64_t ARG_MASK = (1ULL << ARG_BITS) - 1U;
+  static const uint8_t FUNCTIONS_FULL = MAX_FUNCTIONS; // never a function id
+
+  static uint64_t task(uint8_t function, uint64_t arg)
+  {
+    return ((uint64_t)function + 1U) << ARG_BITS | (arg & ARG_MASK);
+  }
+
+  stealing_executor(size_t workers, std::vector<int> const &cpus = std::vector<int>())
+    : num_workers(workers == 0 ? 1 : workers > MAX_WORKERS ? MAX_WORKERS : workers)
+    , cpus(cpus), num_functions(0), current(0), in_batch(0), stopping(false)
+  {
+    for(size_t w = 0; w < this->num_workers; ++w) {
+      this->workers[w] = new worker(this, w);
+    }
+  }
+
+  ~stealing_executor()
+  {
+    for(size_t w = 0; w < this->num_workers; ++w) { delete this->workers[w]; }
+  }
+
+  size_t worker_count() const { return this->num_workers; }
+
+  // Before start(). Returns the id for task(), or FUNCTIONS_FULL when MAX_FUNCTIONS have been
+  // added already.
+  uint8_t add_function(task_fn fn, void *ctx)
+  {
+    if ( this->num_functions >= MAX_FUNCTIONS ) { return FUNCTIONS_FULL; }
+    this->functions[this->num_functions].fn = fn;
+    this->functions[this->num_functions].ctx = ctx;
+    return (uint8_t)this->num_functions++;
+  }
+
+  void start()
+  {
+    for(size_t w = 0; w < this->num_workers; ++w) {
+      pthread_create(&this->workers[w]->thread, NULL, worker_main, this->workers[w]);
+    }
+  }
+
+  /* Submitter side. */
+
+  // false: every inbox is full.
+  bool try_submit(uint64_t t)
+  {
+    for(size_t tried = 0; tried < this->num_workers; ++tried) {
+      if ( this->workers[this->current]->inbox.enqueue(t) == inbox_t::SUCCESS ) {
+        if ( ++this->in_batch >= SUBMIT_BATCH ) { this->next(); }
+        return true;
+      }
+      this->next();
+    }
+    return false;
+  }
+
+  void submit(uint64_t t)
+  {
+    uint64_t spins = 0;
+    while ( !this->try_submit(t) ) {
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+  }
+
+  // After the last submit(): runs everything submitted, then joins the workers.
+  void stop()
+  {
+    this->stopping.store(true, std::memory_order_release);
+    for(size_t w = 0; w < this->num_workers; ++w) { pthread_join(this->workers[w]->thread, NULL); }
+  }
+
+  /* Statistics, after stop(). */
+
+  uint64_t executed(size_t w) const { return this->workers[w]->executed; }
+  uint64_t stolen(size_t w) const { return this->workers[w]->stolen; }       // tasks w got from peers
+  uint64_t steals(size_t w) const { return this->workers[w]->steals; }       // requests w answered
+  uint64_t empty_steals(size_t w) const { return this->workers[w]->empty_steals; }
+
+private:
+  enum { NO_REQUEST = 0, CLOSED = 0xffffffffU, NO_ANSWER = -1 };
+
+  struct function_entry {
+    task_fn fn;
+    void *ctx;
+  };
+
+  struct worker {
+    worker(stealing_executor *ex, size_t id)
+      : ex(ex), id(id), executed(0), stolen(0), steals(0), empty_steals(0)
+      , request(NO_REQUEST), answer(NO_ANSWER)
+    { }
+
+    stealing_executor *ex;
+    size_t id;
+    pthread_t thread;
+
+    /* Worker only. */
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t steals;
+    uint64_t empty_steals;
+
+    /* Thieves post id + 1 here, the worker clears it when it answers. */
+    std::atomic<uint32_t> request __attribute__ ((aligned(64)));
+
+    /* The victim writes loot and then answer; the worker reads them. */
+    std::atomic<int32_t> answer __attribute__ ((aligned(64)));
+    uint64_t loot[STEAL_BATCH];
+
+    /* Submitter to worker. */
+    inbox_t inbox;
+  };
+
+  static void * worker_main(void *arg)
+  {
+    worker *const me = static_cast<worker *>(arg);
+    stealing_executor *const ex = me->ex;
+    if ( !ex->cpus.empty() ) { cpu::pin(ex->cpus[me->id % ex->cpus.size()]); }
+    ex->work(me);
+    return NULL;
+  }
+
+  void work(worker *me)
+  {
+    uint64_t t, spins = 0;
+    bool asked = false;
+    for(;;) {
+      bool const last = this->stopping.load(std::memory_order_acquire);
+      if ( take(me->inbox, &t) ) {
+        this->run(me, t);
+        this->serve(me);
+        continue;
+      }
+      this->serve(me);
+      if ( asked ) {
+        int32_t const n = me->answer.load(std::memory_order_acquire);
+        if ( n != NO_ANSWER ) {
+          for(int32_t i = 0; i < n; ++i) { this->run(me, me->loot[i]); }
+          me->stolen += n;
+          if ( n == 0 ) { ++me->empty_steals; }
+          asked = false;
+          continue;
+        }
+      }
+      else if ( last ) {
+        break;
+      }
+      else {
+        asked = this->ask(me);
+        if ( asked ) { continue; }
+      }
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+    this->close(me);
+  }
+
+  void run(worker *me, uint64_t t)
+  {
+    function_entry const &f = this->functions[(t >> ARG_BITS) - 1U];
+    f.fn(f.ctx, t & ARG_MASK, me->id);
+    ++me->executed;
+  }
+
+  // Post a request to the peer with the deepest inbox, if any has more than one task.
+  bool ask(worker *me)
+  {
+    size_t best = me->id, best_depth = 1;
+    for(size_t w = 0; w < this->num_workers; ++w) {
+      if ( w == me->id ) { continue; }
+      size_t const d = this->workers[w]->inbox.depth();
+      if ( d > best_depth ) { best = w; best_depth = d; }
+    }
+    if ( best == me->id ) { return false; }
+
+    me->answer.store(NO_ANSWER, std::memory_order_relaxed);
+    uint32_t expected = NO_REQUEST;
+    if ( !this->workers[best]->request.compare_exchange_strong(expected, (uint32_t)me->id + 1U,
+        std::memory_order_release, std::memory_order_relaxed) ) {
+      return false; // someone else is being served, or the peer has finished
+    }
+    return true;
+  }
+
+  // Answer a pending request with up to half of our backlog.
+  void serve(worker *me)
+  {
+    uint32_t const r = me->request.load(std::memory_order_acquire);
+    if ( r == NO_REQUEST ) { return; }
+    worker *const thief = this->workers[r - 1U];
+    size_t n = me->inbox.depth() / 2;
+    if ( n > STEAL_BATCH ) { n = STEAL_BATCH; }
+    size_t i = 0;
+    while ( i < n && take(me->inbox, &thief->loot[i]) ) { ++i; }
+    ++me->steals;
+    me->request.store(NO_REQUEST, std::memory_order_relaxed);
+    thief->answer.store((int32_t)i, std::memory_order_release);
+  }
+
+  // Refuse further requests; answer any that is pending.
+  void close(worker *me)
+  {
+    for(;;) {
+      uint32_t expected = NO_REQUEST;
+      if ( me->request.compare_exchange_strong(expected, CLOSED, std::memory_order_relaxed,
+          std::memory_order_relaxed) ) {
+        return;
+      }
+      this->serve(me);
+    }
+  }
+
+  static bool take(inbox_t &q, uint64_t *t)
+  {
+    if ( !q.can_dequeue() ) { return false; } // skip the backtracking probes while idle
+    return q.dequeue(t) == inbox_t::SUCCESS || q.dequeue_unbatched(t) == inbox_t::SUCCESS;
+  }
+
+  void next()
+  {
+    if ( ++this->current == this->num_workers ) { this->current = 0; }
+    this->in_batch = 0;
+  }
+
+  size_t const num_workers;
+  std::vector<int> const cpus;
+  function_entry functions[MAX_FUNCTIONS];
+  size_t num_functions;
+  worker *workers[MAX_WORKERS];
+
+  /* Submitter only. */
+  size_t current __attribute__ ((aligned(64)));
+  size_t in_batch;
+
+  std::atomic<bool> stopping __attribute__ ((aligned(64)));
+};
+
+#endif
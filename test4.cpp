@@ -27,12 +27,24 @@
 #include <pthread.h>
 #include <sched.h>
 #include "fifo2.hpp"
+#include "perf.h"
+
+#if defined(WORKLOAD_DEBUG)
+#include "workload.h"
+
+/* from BQ_WORKLOAD, see workload.h */
+static struct workload_config workload_cfg;
+/* set before the start barrier by a thread that could not set up its workload */
+static volatile int workload_failed;
+#endif
 
 #if defined(FIFO_DEBUG)
 #include <assert.h>
 #endif
 
+#ifndef TEST_SIZE
 #define TEST_SIZE 200000000
+#endif
 
 #ifndef CPU_ID
 #define CPU_ID cpu_id
@@ -41,7 +53,15 @@
 /****** Should be 2^N *****/
 #define MAX_CORE_NUM 8
 
-typedef queue<> queue_t;
+/* batching mode under test, e.g. CFLAGS="-DCONS_BATCH_MODE=false -DPROD_BATCH_MODE=true" */
+#ifndef CONS_BATCH_MODE
+#define CONS_BATCH_MODE true
+#endif
+#ifndef PROD_BATCH_MODE
+#define PROD_BATCH_MODE false
+#endif
+
+typedef queue<1024 * 8, uint64_t, 1000, CONS_BATCH_MODE, PROD_BATCH_MODE> queue_t;
 typedef uint64_t ELEMENT_TYPE;
 
 static queue_t queues[MAX_CORE_NUM];
@@ -100,8 +120,10 @@ void * consumer(void *arg)
 	ELEMENT_TYPE	value;
 	cpu_set_t	cur_mask;
 	uint64_t	i;
+	struct perf_group pg;
+	char		counters[256];
 #if defined(WORKLOAD_DEBUG)
-	unsigned long	seed;
+	struct workload	wl;
 #endif
 #if defined(FIFO_DEBUG)
 	ELEMENT_TYPE	old_value = 0; 
@@ -128,11 +150,29 @@ void * consumer(void *arg)
 	}
 
 #if defined(WORKLOAD_DEBUG)
-	seed = read_tsc();
+	/* own buffers and random sequence; its cost on this core is subtracted below */
+	if (workload_init(&wl, &workload_cfg, read_tsc()))
+		workload_failed = 1;	/* still meet the others at the barriers */
+	else
+		printf("consumer %d: workload %" PRIu64 " cycles/op\n", cpu_id,
+			workload_calibrate(&wl, CALIBRATION_ROUNDS));
 #endif
 
+	/* counts this thread only, so open it after pinning */
+	perf_open(&pg);
+
 	printf("Consumer created...\n");
 	pthread_barrier_wait(barrier);
+#if defined(WORKLOAD_DEBUG)
+	if (workload_failed) {
+		perf_close(&pg);
+		workload_destroy(&wl);
+		pthread_barrier_wait(barrier);
+		return NULL;
+	}
+#endif
+
+	perf_start(&pg);
 
 	queues_times[cpu_id].start_c = read_tsc();
 
@@ -140,7 +180,7 @@ void * consumer(void *arg)
 		while( queues[cpu_id].dequeue(&value) != 0 );
 
 #if defined(WORKLOAD_DEBUG)
-		workload(&seed);
+		workload_run(&wl);
 #endif
 
 #if defined(FIFO_DEBUG)
@@ -149,19 +189,26 @@ void * consumer(void *arg)
 #endif
 	}
 	queues_times[cpu_id].stop_c = read_tsc();
+	perf_stop(&pg);
+	perf_report(&pg, counters, sizeof(counters), TEST_SIZE);
+	perf_close(&pg);
 
   std::ostringstream os;
 #if defined(WORKLOAD_DEBUG)
   os << "consumer: "
-    << (((queues_times[cpu_id].stop_c - queues_times[cpu_id].start_c) / (TEST_SIZE + 1)) - AVG_WORKLOAD)
+    << (((queues_times[cpu_id].stop_c - queues_times[cpu_id].start_c) / (TEST_SIZE + 1)) - wl.overhead)
     <<  " cycles/op"  << std::endl;
 #else
   os << "consumer: "
     << ((queues_times[cpu_id].stop_c - queues_times[cpu_id].start_c) / (TEST_SIZE + 1))
     <<  " cycles/op"  << std::endl;
 #endif
+  os << "consumer " << cpu_id << " per op: " << counters << std::endl;
 
   std::cout << os.str();
+#if defined(WORKLOAD_DEBUG)
+	workload_destroy(&wl);
+#endif
 
 	pthread_barrier_wait(barrier);
 	return NULL;
@@ -177,6 +224,15 @@ void producer(void *arg, uint32_t num)
 	cpu_set_t	cur_mask;
 	INIT_INFO * init = (INIT_INFO *) arg;
 	pthread_barrier_t *barrier = init->barrier;
+	struct perf_group pg;
+	char		counters[256];
+#if defined(WORKLOAD_DEBUG)
+	struct workload	wl;
+	uint64_t	next_c;
+
+	if (workload_init(&wl, &workload_cfg, read_tsc()))
+		workload_failed = 1;	/* still meet the consumers at the barriers */
+#endif
 
 	/* user needs tune this according to their machine configurations. */
 	CPU_ZERO(&cur_mask);
@@ -186,12 +242,32 @@ void producer(void *arg, uint32_t num)
 		perror("Error: sched_setaffinity");
 		return ;
 	}
+	perf_open(&pg);
 
 	pthread_barrier_wait(barrier);
+#if defined(WORKLOAD_DEBUG)
+	if (workload_failed) {
+		perf_close(&pg);
+		workload_destroy(&wl);
+		pthread_barrier_wait(barrier);
+		return;
+	}
+#endif
 
+	perf_start(&pg);
 	start_p = read_tsc();
+#if defined(WORKLOAD_DEBUG)
+	next_c = start_p;
+#endif
 
 	for (i = 1; i <= TEST_SIZE + queue_t::consumer_batch_size(); i++) {
+#if defined(WORKLOAD_DEBUG)
+		/* arrival model: hold element i back until its arrival time */
+		if (workload_cfg.arrival != ARRIVAL_NONE) {
+			next_c += workload_next_gap(&wl);
+			while (read_tsc() < next_c);
+		}
+#endif
 		for (j=1; j<num; j++) {
 			while ( queues[j].enqueue((ELEMENT_TYPE)i) != 0);
 #if defined(INCURE_DEBUG)
@@ -203,10 +279,17 @@ void producer(void *arg, uint32_t num)
 		}
 	}
 	stop_p = read_tsc();
+	perf_stop(&pg);
+	perf_report(&pg, counters, sizeof(counters), (TEST_SIZE + 1)*(num -1));
+	perf_close(&pg);
 
   std::ostringstream os;
   os << "producer " << ((stop_p - start_p) / ((TEST_SIZE + 1)*(num -1))) << " cycles/op" << std::endl;
+  os << "producer per op: " << counters << std::endl;
   std::cout << os.str();
+#if defined(WORKLOAD_DEBUG)
+	workload_destroy(&wl);
+#endif
 
 	pthread_barrier_wait(barrier);
 }
@@ -233,6 +316,15 @@ int main(int argc, char *argv[])
 
 	srand((unsigned int)read_tsc());
 
+	printf("consumer batching %s, producer batching %s\n",
+		queue_t::is_consumer_batching() ? "on" : "off",
+		queue_t::is_producer_batching() ? "on" : "off");
+
+#if defined(WORKLOAD_DEBUG)
+	if (workload_config_from_env(&workload_cfg) != 0)
+		return 1;
+#endif
+
   /*
 	for (i=0; i<MAX_CORE_NUM; i++) {
 		queue_init(&queues[i]);
@@ -265,6 +357,12 @@ int main(int argc, char *argv[])
 	INIT_ID(0) = 0;
 	INIT_BAR(0) = &barrier;
 	producer(INIT_PTR(0), max_th);
+#if defined(WORKLOAD_DEBUG)
+	if (workload_failed) {
+		printf("workload setup failed\n");
+		return 1;
+	}
+#endif
 	printf("Done!\n");
 
 	return 0;
@@ -0,0 +1,200 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// NUM_THREADS threads log numbered lines, first with fprintf() to a FILE shared under a mutex,
+// then through async_logger<> with LOG_BLOCK and with LOG_DROP. Prints the cost of a log call
+// as seen by the logging thread, and checks the async log file: every thread's lines complete
+// (LOG_BLOCK) or in order with the drops accounted for (LOG_DROP). Finally one thread logs
+// from a single call site to two live loggers, and to a logger created after another was
+// destroyed: each record must reach the logger it was meant for.
+//
+//   test_asynclog [lines_per_thread]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include "asynclog.hpp"
+#include "cpu.hpp"
+
+#define NUM_THREADS 4
+#define LOG_FILE "test_asynclog.log"
+
+typedef async_logger<> logger_t;
+
+static uint64_t lines = 200000;
+static logger_t *logger;
+static FILE *sync_file;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<uint64_t> costs[NUM_THREADS];
+
+struct thread_info {
+  int id;
+  bool async;
+};
+
+void * logging_thread(void *arg)
+{
+  thread_info *t = (thread_info *)arg;
+  std::vector<uint64_t> &c = costs[t->id];
+
+  cpu::pin(t->id % sysconf(_SC_NPROCESSORS_ONLN));
+  c.clear();
+  c.reserve(lines);
+  for (uint64_t i = 1; i <= lines; i++) {
+    uint64_t const start = cpu::read_tsc();
+    if ( t->async ) {
+      ASYNC_LOG(*logger, "thread %lu line %lu value %lx", (uint64_t)t->id, i, i * 2654435761ULL);
+    }
+    else {
+      pthread_mutex_lock(&sync_lock);
+      fprintf(sync_file, "%lu [T%d] thread %lu line %lu value %lx\n", (unsigned long)start, t->id,
+        (unsigned long)t->id, (unsigned long)i, (unsigned long)(i * 2654435761ULL));
+      pthread_mutex_unlock(&sync_lock);
+    }
+    c.push_back(cpu::read_tsc() - start);
+  }
+  return NULL;
+}
+
+static void run(char const *name, bool async)
+{
+  pthread_t threads[NUM_THREADS];
+  thread_info info[NUM_THREADS];
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    info[i].id = i;
+    info[i].async = async;
+    pthread_create(&threads[i], NULL, logging_thread, &info[i]);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) { pthread_join(threads[i], NULL); }
+
+  std::vector<uint64_t> all;
+  for (int i = 0; i < NUM_THREADS; i++) { all.insert(all.end(), costs[i].begin(), costs[i].end()); }
+  std::sort(all.begin(), all.end());
+  size_t const n = all.size();
+  std::cout << std::setw(14) << name << "  cycles per call: p50 " << std::setw(6) << all[n / 2]
+    << "  p99 " << std::setw(7) << all[n * 99 / 100] << "  p99.9 " << std::setw(8) << all[n * 999 / 1000]
+    << "  max " << std::setw(9) << all[n - 1] << std::endl;
+}
+
+// Lines per thread in order, drop notices add up. Returns the number of problems.
+static uint64_t check(bool complete)
+{
+  FILE *f = fopen(LOG_FILE, "r");
+  char line[512];
+  uint64_t last[NUM_THREADS] = { 0 }, dropped[NUM_THREADS] = { 0 }, errors = 0, total = 0;
+
+  if ( !f ) { perror(LOG_FILE); return 1; }
+  while ( fgets(line, sizeof(line), f) ) {
+    unsigned long tsc, thread, i, value, d;
+    unsigned w;
+    if ( sscanf(line, "%lu [T%u] thread %lu line %lu value %lx", &tsc, &w, &thread, &i, &value) == 5 ) {
+      if ( thread >= NUM_THREADS || i <= last[thread] || value != (unsigned long)(i * 2654435761ULL) ) { ++errors; }
+      if ( thread < NUM_THREADS ) { last[thread] = i; }
+      ++total;
+    }
+    else if ( sscanf(line, "[T%u] %lu records dropped", &w, &d) == 2 ) {
+      dropped[w % NUM_THREADS] += d;
+    }
+    else {
+      ++errors;
+    }
+  }
+  fclose(f);
+
+  uint64_t lost = 0;
+  for (int t = 0; t < NUM_THREADS; t++) { lost += dropped[t]; }
+  if ( complete && total != NUM_THREADS * lines ) { ++errors; }
+  if ( total + lost != NUM_THREADS * lines ) { ++errors; }
+  std::cout << "                " << total << " lines, " << lost << " dropped, " << logger->writev_calls()
+    << " writev calls, " << logger->bytes_written() / 1024 << " KiB, " << errors << " errors" << std::endl;
+  return errors;
+}
+
+static void log_value(logger_t &l, uint64_t v)
+{
+  ASYNC_LOG(l, "value %lu", v);
+}
+
+static uint64_t check_logger_switch()
+{
+  uint64_t errors = 0;
+
+  logger_t *a = new logger_t(LOG_FILE, LOG_BLOCK);
+  logger_t *b = new logger_t(LOG_FILE, LOG_BLOCK);
+  a->start();
+  b->start();
+  log_value(*a, 1);
+  log_value(*b, 2);
+  log_value(*a, 3);
+  a->stop();
+  b->stop();
+  if ( a->records_written() != 2 || b->records_written() != 1 ) { ++errors; }
+  delete a;
+  delete b;
+
+  for (int round = 0; round < 2; round++) { // the second logger may reuse the first one's memory
+    logger_t *l = new logger_t(LOG_FILE, LOG_BLOCK);
+    l->start();
+    log_value(*l, round);
+    l->stop();
+    if ( l->records_written() != 1 ) { ++errors; }
+    delete l;
+  }
+
+  std::cout << "  logger switch: " << errors << " errors" << std::endl;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t errors = 0;
+
+  if (argc > 1) { lines = strtoull(argv[1], NULL, 10); }
+
+  sync_file = fopen(LOG_FILE, "w");
+  if ( !sync_file ) { perror(LOG_FILE); return 1; }
+  run("fprintf", false);
+  fclose(sync_file);
+
+  logger = new logger_t(LOG_FILE, LOG_BLOCK);
+  logger->start();
+  run("async block", true);
+  logger->stop();
+  errors += check(true);
+  delete logger;
+
+  logger = new logger_t(LOG_FILE, LOG_DROP);
+  logger->start();
+  run("async drop", true);
+  logger->stop();
+  errors += check(false);
+  delete logger;
+
+  errors += check_logger_switch();
+  unlink(LOG_FILE);
+  return errors ? 1 : 0;
+}
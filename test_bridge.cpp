@@ -0,0 +1,159 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// producer -> queue<> -> bridge_sender -> socket -> bridge_receiver -> queue<> -> consumer, all
+// in one process, over a Unix-domain socket and over TCP on 127.0.0.1. Each transport runs
+// batched (frames as large as the backlog) and per-element (max_batch 1, one send() per
+// element, with a tenth of the elements). The consumer checks 1, 2, ..., N in order; the
+// report shows cycles per element end to end, frames and receiver reads.
+//
+//   test_bridge [elements [unix|tcp]]
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include "bridge.hpp"
+#include "cpu.hpp"
+
+#define SOCKET_PATH "test_bridge.sock"
+
+typedef queue<> queue_t;
+typedef bridge_sender<queue_t> sender_t;
+typedef bridge_receiver<queue_t> receiver_t;
+
+static uint64_t test_size = 2000000;
+
+struct consumer_info {
+  queue_t *q;
+  receiver_t *r;
+  uint64_t count;
+  uint64_t received;
+  uint64_t errors;
+};
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+void * consumer(void *arg)
+{
+  consumer_info *c = static_cast<consumer_info *>(arg);
+  uint64_t value, spins = 0;
+
+  while ( c->received < c->count ) {
+    if ( c->q->dequeue(&value) != queue_t::SUCCESS ) {
+      if ( !c->r->ended() ) {
+        wait(spins);
+        continue;
+      }
+      // the receiver has delivered everything, take what batching holds back
+      if ( c->q->dequeue_unbatched(&value) != queue_t::SUCCESS ) { break; }
+    }
+    if ( value != c->received + 1 ) { ++c->errors; }
+    ++c->received;
+  }
+  return NULL;
+}
+
+// Connected pair: *out is the sender's end, *in the receiver's.
+static bool connect_pair(bool tcp, int *out, int *in)
+{
+  int const l = tcp ? bridge_socket::listen_tcp("127.0.0.1", 0) : bridge_socket::listen_unix(SOCKET_PATH);
+  if ( l < 0 ) { return false; }
+  *out = tcp ? bridge_socket::connect_tcp("127.0.0.1", bridge_socket::bound_port(l))
+    : bridge_socket::connect_unix(SOCKET_PATH);
+  *in = *out >= 0 ? bridge_socket::accept_one(l) : -1;
+  close(l);
+  if ( !tcp ) { unlink(SOCKET_PATH); }
+  if ( *in < 0 ) {
+    if ( *out >= 0 ) { close(*out); }
+    return false;
+  }
+  return true;
+}
+
+static uint64_t run(bool tcp, size_t max_batch, uint64_t count)
+{
+  int out, in;
+  if ( !connect_pair(tcp, &out, &in) ) { return 1; }
+
+  queue_t *local_in = new queue_t();
+  queue_t *local_out = new queue_t();
+  sender_t *s = new sender_t(*local_in, out, max_batch);
+  receiver_t *r = new receiver_t(*local_out, in);
+  consumer_info c = { local_out, r, count, 0, 0 };
+  pthread_t t;
+  uint64_t spins = 0;
+
+  uint64_t const start = cpu::read_tsc();
+  r->start();
+  s->start();
+  pthread_create(&t, NULL, consumer, &c);
+  for (uint64_t i = 1; i <= count; i++) {
+    while ( local_in->enqueue(i) != queue_t::SUCCESS ) { wait(spins); }
+  }
+  s->finish();
+  s->join();
+  r->join();
+  pthread_join(t, NULL);
+  uint64_t const cycles = cpu::read_tsc() - start;
+
+  uint64_t errors = c.errors;
+  if ( c.received != count || s->failed() || r->failed() || r->elements() != count ) { ++errors; }
+  std::cout << (tcp ? "tcp " : "unix") << (max_batch == 1 ? " per-element" : " batched    ")
+    << ": " << cycles / count << " cycles/element, " << s->frames() << " frames ("
+    << s->elements() / (s->frames() > 1 ? s->frames() - 1 : 1) << " elements/frame), "
+    << r->reads() << " reads, " << r->full() << " full enqueues, " << errors << " errors"
+    << std::endl;
+
+  close(out);
+  close(in);
+  delete s;
+  delete r;
+  delete local_in;
+  delete local_out;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t errors = 0;
+  bool unix_sockets = true, tcp = true;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 2) {
+    unix_sockets = strcmp(argv[2], "tcp") != 0;
+    tcp = strcmp(argv[2], "unix") != 0;
+  }
+
+  if ( unix_sockets ) {
+    errors += run(false, 0, test_size);
+    errors += run(false, 1, test_size / 10);
+  }
+  if ( tcp ) {
+    errors += run(true, 0, test_size);
+    errors += run(true, 1, test_size / 10);
+  }
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A producer publishes per-key sequence numbers to random keys (a few hot keys get most of the
+// updates) through a conflating_mailbox<>; a consumer that spends some cycles per delivery
+// drains it. Checks that no key ever goes back in time and that every key ends with its last
+// published value, and prints how many consumer operations the conflation saved.
+//
+//   test_conflate [updates [consumer_cycles_per_key]]
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <unistd.h>
+#include "conflate.hpp"
+#include "cpu.hpp"
+
+#define KEYS 1024
+#define HOT_KEYS 16
+#define DRAIN_BATCH 64
+
+typedef conflating_mailbox<KEYS> mailbox_t;
+
+static mailbox_t mailbox;
+static std::atomic<bool> done(false);
+static uint64_t test_size = 20000000;
+static uint64_t work_cycles = 200;
+static uint64_t last[KEYS];
+
+void * consumer(void *arg)
+{
+  uint32_t keys[DRAIN_BATCH];
+  uint64_t values[DRAIN_BATCH];
+  uint64_t errors = 0, spins = 0;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  for(;;) {
+    bool const finished = done.load(std::memory_order_acquire);
+    size_t const n = mailbox.drain(keys, values, DRAIN_BATCH);
+    for (size_t i = 0; i < n; i++) {
+      if ( values[i] <= last[keys[i]] ) { ++errors; }
+      last[keys[i]] = values[i];
+      uint64_t const until = cpu::read_tsc() + work_cycles; // handling the update
+      while ( cpu::read_tsc() < until ) { }
+    }
+    if ( n == 0 ) {
+      if ( finished ) { break; }
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+  }
+  return (void *)errors;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<uint64_t> seq(KEYS, 0);
+  pthread_t consumer_thread;
+  void *errors;
+  unsigned long seed = 1;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 2) { work_cycles = strtoull(argv[2], NULL, 10); }
+
+  cpu::pin(0);
+  pthread_create(&consumer_thread, NULL, consumer, NULL);
+
+  uint64_t const start_p = cpu::read_tsc();
+  for (uint64_t i = 0; i < test_size; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t const key = ((seed >> 8) & 3) ? (seed >> 16) % HOT_KEYS : (seed >> 16) % KEYS;
+    mailbox.publish(key, ++seq[key]);
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  done.store(true, std::memory_order_release);
+  pthread_join(consumer_thread, &errors);
+
+  uint64_t stale = 0;
+  for (size_t k = 0; k < KEYS; k++) { stale += last[k] != seq[k]; }
+
+  std::cout << "producer: " << (stop_p - start_p) / test_size << " cycles/update" << std::endl;
+  std::cout << mailbox.published() << " updates, " << mailbox.conflated() << " conflated, "
+    << mailbox.delivered() << " delivered (" << (double)mailbox.delivered() / mailbox.published()
+    << " consumer ops per update), " << (uint64_t)errors << " out of order, " << stale
+    << " keys not at their last value" << std::endl;
+  return (errors || stale) ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Many coroutine channels multiplexed on two threads: every producer task runs on core 0,
+// every consumer task on core 1, one async_queue<> per pair.
+//
+//   test_coro [channels [elements per channel]]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include "coro.hpp"
+
+typedef async_queue< queue<256, uint64_t, 0> > channel_t;
+
+static std::vector<channel_t *> channels;
+static uint64_t per_channel = 100000;
+static uint64_t errors;
+
+scheduler::task produce(channel_t *q)
+{
+  for (uint64_t i = 1; i <= per_channel; i++) {
+    co_await q->push(i);
+  }
+}
+
+scheduler::task consume(channel_t *q)
+{
+  for (uint64_t i = 1; i <= per_channel; i++) {
+    uint64_t const value = co_await q->pop();
+    if ( value != i ) { ++errors; }
+  }
+}
+
+static void report(char const *name, scheduler const &s, uint64_t cycles)
+{
+  uint64_t const ops = channels.size() * per_channel;
+  std::cout << name << ": " << cycles / ops << " cycles/op, "
+    << s.parked_count() << " of " << ops << " awaits parked, " << s.sweep_count() << " sweeps"
+    << std::endl;
+}
+
+void * consumer(void *arg)
+{
+  scheduler s;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  for (size_t c = 0; c < channels.size(); c++) { s.spawn(consume(channels[c])); }
+
+  uint64_t const start_c = cpu::read_tsc();
+  s.run();
+  report("consumer", s, cpu::read_tsc() - start_c);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  size_t nchannels = 1000;
+  scheduler s;
+
+  if (argc > 1) { nchannels = strtoul(argv[1], NULL, 10); }
+  if (argc > 2) { per_channel = strtoull(argv[2], NULL, 10); }
+
+  for (size_t c = 0; c < nchannels; c++) { channels.push_back(new channel_t()); }
+
+  cpu::pin(0);
+  pthread_create(&consumer_thread, NULL, consumer, NULL);
+
+  for (size_t c = 0; c < channels.size(); c++) { s.spawn(produce(channels[c])); }
+  uint64_t const start_p = cpu::read_tsc();
+  s.run();
+  report("producer", s, cpu::read_tsc() - start_p);
+
+  pthread_join(consumer_thread, NULL);
+  std::cout << errors << " out of order" << std::endl;
+
+  for (size_t c = 0; c < channels.size(); c++) { delete channels[c]; }
+  return errors ? 1 : 0;
+}
@@ -44,8 +44,14 @@ inline uint64_t read_tsc()
 int main()
 {
 	uint64_t i, start_c, stop_c;
-	unsigned long seed;
-	seed = read_tsc();
+	struct workload_config cfg;
+	struct workload wl;
+	volatile unsigned long sink = 0;
+
+	if (workload_config_from_env(&cfg))
+		return -1;
+	if (workload_init(&wl, &cfg, read_tsc()))
+		return -1;
 
 #if defined(RT_SCHEDULE)
         struct sched_param param;
@@ -57,12 +63,15 @@ int main()
         printf("Success: Real time schedule.\n");
 #endif /* RT_SCHEDULE */
 
+	printf("calibrated: %" PRIu64 " cycles/op\n", workload_calibrate(&wl, CALIBRATION_ROUNDS));
+
 	start_c = read_tsc();
 	for(i=0; i<TEST_SIZE; i++) {
-		workload(&seed);
+		sink += workload_run(&wl);
 	}
 	stop_c = read_tsc();
-	printf("average: %" PRId64 " cycles/op\n", ((stop_c - start_c) / TEST_SIZE));
+	printf("average: %" PRIu64 " cycles/op\n", ((stop_c - start_c) / TEST_SIZE));
+	workload_destroy(&wl);
 	return 0;
 }
 
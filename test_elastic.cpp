@@ -0,0 +1,120 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// One producer feeds NUM_QUEUES queue<>s drained by an elastic_pool<>: a quiet phase, a flood
+// the minimum pool cannot keep up with, and a quiet phase again. The handler checks every
+// queue's order and spends some cycles per element. Prints the running workers at the end of
+// every phase; the pool should grow during the flood and shrink back after it.
+//
+//   test_elastic [flood_elements [max_workers]]
+
+#include <iostream>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "elastic.hpp"
+#include "cpu.hpp"
+
+#define NUM_QUEUES 8
+#define WORK_CYCLES 300
+
+typedef queue<> queue_t;
+
+static queue_t queues[NUM_QUEUES];
+static uint64_t expected[NUM_QUEUES];
+static uint64_t received[NUM_QUEUES] __attribute__ ((aligned(64)));
+static uint64_t errors[NUM_QUEUES];
+
+struct checker {
+  void operator()(size_t i, uint64_t v) const
+  {
+    if ( v != expected[i] + 1 ) { ++errors[i]; }
+    expected[i] = v;
+    ++received[i];
+    uint64_t const until = cpu::read_tsc() + WORK_CYCLES;
+    while ( cpu::read_tsc() < until ) { }
+  }
+};
+
+typedef elastic_pool<queue_t, checker> pool_t;
+
+static uint64_t seq[NUM_QUEUES];
+
+static void send(size_t i)
+{
+  uint64_t spins = 0;
+  while ( queues[i].enqueue(seq[i] + 1) != queue_t::SUCCESS ) {
+    cpu::relax();
+    if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+  }
+  ++seq[i];
+}
+
+// Roughly `rate` elements per millisecond for `ms` milliseconds.
+static void trickle(unsigned ms, unsigned rate)
+{
+  for (unsigned t = 0; t < ms; t++) {
+    for (unsigned k = 0; k < rate; k++) { send((t * rate + k) % NUM_QUEUES); }
+    usleep(1000);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t flood = 2000000;
+  elastic_config cfg;
+
+  cfg.max_workers = 4;
+  cfg.high_depth = 512;
+  cfg.low_depth = 16;
+  if (argc > 1) { flood = strtoull(argv[1], NULL, 10); }
+  if (argc > 2) { cfg.max_workers = strtoul(argv[2], NULL, 10); }
+  for (long c = 0; c < sysconf(_SC_NPROCESSORS_ONLN); c++) { cfg.cpus.push_back(c); }
+
+  pool_t pool(cfg);
+  for (size_t i = 0; i < NUM_QUEUES; i++) {
+    if ( pool.attach(&queues[i]) == pool_t::ATTACH_FULL ) { return 1; }
+  }
+  pool.start();
+
+  trickle(200, 8);
+  std::cout << "quiet: " << pool.active_workers() << " workers" << std::endl;
+
+  for (uint64_t k = 0; k < flood; k++) { send(k % NUM_QUEUES); }
+  std::cout << "flood: " << pool.active_workers() << " workers" << std::endl;
+
+  trickle(300, 8);
+  std::cout << "quiet: " << pool.active_workers() << " workers" << std::endl;
+
+  // consumer batching keeps the last elements until more arrive behind them, the pool's
+  // workers flush them; stop() drains whatever is left
+  pool.stop();
+
+  uint64_t sent = 0, got = 0, bad = 0;
+  for (size_t i = 0; i < NUM_QUEUES; i++) {
+    sent += seq[i];
+    got += received[i];
+    bad += errors[i];
+  }
+  std::cout << got << "/" << sent << " elements, " << bad << " out of order, " << pool.scale_ups()
+    << " scale-ups, " << pool.scale_downs() << " scale-downs, " << pool.reassignments()
+    << " queue moves" << std::endl;
+  return (bad || got != sent) ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// queue<> used directly against queue<> through producer_end/consumer_end handles, one
+// producer and one consumer thread. The handle run is split in two halves with the handles
+// released and taken again in between, and a second handle of a side must come back empty.
+//
+//   test_ends [elements [producer_cpu consumer_cpu]]
+
+#include <iostream>
+#include <cstdlib>
+#include <utility>
+#include <pthread.h>
+#include <unistd.h>
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+typedef queue<> queue_t;
+
+static queue_t q;
+static uint64_t test_size = 50000000;
+static int producer_cpu = 0;
+static int consumer_cpu = 1;
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+struct run_info {
+  bool handles;
+  uint64_t cycles;
+  uint64_t errors;
+};
+
+template<typename C>
+static void consume(C &c, uint64_t from, uint64_t to, uint64_t &errors)
+{
+  uint64_t value, spins = 0;
+  for (uint64_t i = from; i < to; i++) {
+    while ( c.dequeue(&value) != queue_t::SUCCESS ) { wait(spins); }
+    if ( value != i ) { ++errors; }
+  }
+}
+
+template<typename P>
+static void produce(P &p, uint64_t from, uint64_t to)
+{
+  uint64_t spins = 0;
+  for (uint64_t i = from; i < to; i++) {
+    while ( p.enqueue(i) != queue_t::SUCCESS ) { wait(spins); }
+  }
+}
+
+void * consumer(void *arg)
+{
+  run_info *r = (run_info *)arg;
+  uint64_t const half = test_size / 2 + 1;
+
+  cpu::pin(consumer_cpu);
+  uint64_t const start_c = cpu::read_tsc();
+  if ( r->handles ) {
+    queue_t::consumer_end c = q.consumer();
+    if ( !c || q.consumer() ) { ++r->errors; return NULL; }
+    consume(c, 1, half, r->errors);
+    c.release();
+    queue_t::consumer_end c2 = q.consumer(); // carries on where c stopped
+    queue_t::consumer_end c3(std::move(c2));
+    if ( c2 || !c3 ) { ++r->errors; }
+    consume(c3, half, test_size + 1, r->errors);
+  }
+  else {
+    consume(q, 1, test_size + 1, r->errors);
+  }
+  r->cycles = cpu::read_tsc() - start_c;
+  return NULL;
+}
+
+static uint64_t run(bool handles)
+{
+  run_info r = { handles, 0, 0 };
+  uint64_t const half = test_size / 2 + 1;
+  uint64_t const end = test_size + 1 + queue_t::consumer_batch_size();
+  pthread_t t;
+
+  q.reset();
+  pthread_create(&t, NULL, consumer, &r);
+  cpu::pin(producer_cpu);
+
+  uint64_t const start_p = cpu::read_tsc();
+  if ( handles ) {
+    queue_t::producer_end p = q.producer();
+    if ( !p || q.producer() ) { ++r.errors; }
+    produce(p, 1, half);
+    p = q.producer(); // empty: p itself is still out
+    if ( p ) { ++r.errors; }
+    queue_t::producer_end p2 = q.producer();
+    produce(p2, half, end);
+  }
+  else {
+    produce(q, 1, end);
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  pthread_join(t, NULL);
+
+  // drain the padding so the next run starts from an empty queue
+  uint64_t value;
+  while ( q.dequeue_unbatched(&value) == queue_t::SUCCESS ) { }
+
+  std::cout << (handles ? "handles: " : "queue<>: ") << "producer " << (stop_p - start_p) / test_size
+    << " cycles/op, consumer " << r.cycles / test_size << " cycles/op, " << r.errors << " errors" << std::endl;
+  return r.errors;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t errors = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 3) {
+    producer_cpu = atoi(argv[2]);
+    consumer_cpu = atoi(argv[3]);
+  }
+  long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  producer_cpu %= cpus;
+  consumer_cpu %= cpus;
+
+  errors += run(false);
+  errors += run(true);
+  return errors ? 1 : 0;
+}
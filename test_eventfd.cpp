@@ -0,0 +1,151 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// An epoll consumer sleeping on two evented_queue<>s fed in bursts with pauses in between.
+// The producer never calls publish(): a lost wake-up leaves the consumer asleep for good.
+// Before that, one thread checks that a consumer arming in the middle of a notify window is
+// signalled by the very next element, not by the next window.
+//
+//   test_eventfd [bursts]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "evented.hpp"
+#include "cpu.hpp"
+
+#define NUM_QUEUES 2
+#define MAX_BURST 3000
+#define PAUSE_US 200
+
+typedef evented_queue<> queue_t;
+
+static queue_t queues[NUM_QUEUES];
+static uint64_t bursts = 2000;
+static uint64_t expected[NUM_QUEUES];
+
+// Drain, arm, enqueue one element past the start of the window: exactly one eventfd write.
+static uint64_t check_mid_window()
+{
+  evented_queue<queue<>, true, 64> *q = new evented_queue<queue<>, true, 64>();
+  uint64_t value, count = 0, errors = 0;
+
+  for (uint64_t i = 1; i <= 10; i++) { q->enqueue(i); }     // opens the window
+  while ( q->dequeue(&value) == queue_t::SUCCESS ) { }
+  uint64_t const before = q->signalled();
+  if ( read(q->fd(), &count, sizeof(count)) > 0 ) { }      // drop the window-start signal
+  if ( !q->arm() ) { ++errors; }
+  q->enqueue(11);
+  if ( q->signalled() != before + 1 ) { ++errors; }
+  if ( read(q->fd(), &count, sizeof(count)) != sizeof(count) || count != 1 ) { ++errors; }
+  q->enqueue(12);                                           // disarmed: no second write
+  if ( q->signalled() != before + 1 ) { ++errors; }
+
+  std::cout << "mid-window arm: " << q->signalled() - before << " signal(s), "
+    << errors << " errors" << std::endl;
+  delete q;
+  return errors;
+}
+
+void * consumer(void *arg)
+{
+  uint64_t value, received = 0, wakeups = 0, errors = 0, total = 0;
+  uint64_t next[NUM_QUEUES];
+  struct epoll_event ev, events[NUM_QUEUES];
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+
+  int const ep = epoll_create1(EPOLL_CLOEXEC);
+  for (int q = 0; q < NUM_QUEUES; q++) {
+    ev.events = EPOLLIN;
+    ev.data.u32 = q;
+    epoll_ctl(ep, EPOLL_CTL_ADD, queues[q].fd(), &ev);
+    next[q] = 1;
+    total += expected[q];
+  }
+
+  while ( received < total ) {
+    bool sleep = true;
+    for (int q = 0; q < NUM_QUEUES; q++) {
+      while ( queues[q].dequeue(&value) == queue_t::SUCCESS ) {
+        if ( value != next[q]++ ) { ++errors; }
+        ++received;
+      }
+      if ( !queues[q].arm() ) { sleep = false; }
+    }
+    if ( sleep && received < total ) {
+      epoll_wait(ep, events, NUM_QUEUES, -1);
+      ++wakeups;
+    }
+  }
+  close(ep);
+
+  std::cout << "consumer: " << received << " elements, " << wakeups << " wakeups, "
+    << errors << " out of order" << std::endl;
+  return (void *)errors;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  void *errors;
+  unsigned long seed = 1;
+  uint64_t sizes[NUM_QUEUES], b;
+  int q;
+
+  if (argc > 1) { bursts = strtoull(argv[1], NULL, 10); }
+
+  if ( check_mid_window() ) { return 1; }
+
+  /* the consumer needs the totals up front; replay the same bursts below */
+  for (b = 0; b < bursts; b++) {
+    for (q = 0; q < NUM_QUEUES; q++) {
+      seed = seed * 1103515245 + 12345;
+      expected[q] += 1 + (seed >> 16) % MAX_BURST;
+    }
+  }
+
+  cpu::pin(0);
+  pthread_create(&consumer_thread, NULL, consumer, NULL);
+
+  seed = 1;
+  uint64_t next[NUM_QUEUES] = { 1, 1 };
+  for (b = 0; b < bursts; b++) {
+    for (q = 0; q < NUM_QUEUES; q++) {
+      seed = seed * 1103515245 + 12345;
+      sizes[q] = 1 + (seed >> 16) % MAX_BURST;
+      for (uint64_t i = 0; i < sizes[q]; i++) {
+        while ( queues[q].enqueue(next[q]) != queue_t::SUCCESS ) { cpu::relax(); }
+        next[q]++;
+      }
+    }
+    usleep(PAUSE_US);
+  }
+
+  pthread_join(consumer_thread, &errors);
+  for (q = 0; q < NUM_QUEUES; q++) {
+    std::cout << "queue " << q << ": " << expected[q] << " elements, "
+      << queues[q].signalled() << " eventfd signals" << std::endl;
+  }
+  return errors ? 1 : 0;
+}
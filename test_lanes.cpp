@@ -0,0 +1,141 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Control-message latency under a bulk flood: control and bulk share one queue<> (FIFO),
+// then travel on separate lanes of a priority_channel<>.
+//
+//   test_lanes [bulk elements]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "lanes.hpp"
+#include "cpu.hpp"
+
+#define CONTROL_EVERY 4096 /* bulk elements */
+#define SERVICE_CYCLES 100 /* consumer work per element */
+#define CONTROL_BIT (0x1UL << 63)
+
+typedef queue<> fifo_t;
+typedef priority_channel<2> lanes_t;
+
+static fifo_t fifo;
+static lanes_t lanes;
+static uint64_t test_size = 10000000;
+
+struct result {
+  uint64_t controls;
+  uint64_t latency_sum;
+  uint64_t latency_max;
+  uint64_t cycles_per_op;
+};
+
+static inline void service(uint64_t cycles)
+{
+  uint64_t const until = cpu::read_tsc() + cycles;
+  while ( cpu::read_tsc() < until ) { }
+}
+
+static inline void account(result *r, uint64_t sent)
+{
+  uint64_t const latency = cpu::read_tsc() - sent;
+  r->controls ++;
+  r->latency_sum += latency;
+  if ( latency > r->latency_max ) { r->latency_max = latency; }
+}
+
+void * fifo_consumer(void *arg)
+{
+  result *r = (result *)arg;
+  uint64_t value, bulk = 0;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  uint64_t const start_c = cpu::read_tsc();
+  while ( bulk < test_size ) {
+    while ( fifo.dequeue(&value) != fifo_t::SUCCESS ) { cpu::relax(); }
+    if ( value & CONTROL_BIT ) { account(r, value & ~CONTROL_BIT); continue; }
+    service(SERVICE_CYCLES);
+    bulk ++;
+  }
+  r->cycles_per_op = (cpu::read_tsc() - start_c) / test_size;
+  return NULL;
+}
+
+void * lanes_consumer(void *arg)
+{
+  result *r = (result *)arg;
+  uint64_t value, bulk = 0;
+  size_t lane;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  uint64_t const start_c = cpu::read_tsc();
+  while ( bulk < test_size ) {
+    while ( lanes.dequeue(&value, &lane) != lanes_t::SUCCESS ) { cpu::relax(); }
+    if ( lane == 0 ) { account(r, value); continue; }
+    service(SERVICE_CYCLES);
+    bulk ++;
+  }
+  r->cycles_per_op = (cpu::read_tsc() - start_c) / test_size;
+  return NULL;
+}
+
+template<typename PUSH_BULK, typename PUSH_CONTROL>
+void producer(PUSH_BULK push_bulk, PUSH_CONTROL push_control)
+{
+  for (uint64_t i = 1; i <= test_size + fifo_t::consumer_batch_size(); i++) {
+    while ( !push_bulk(i) ) { cpu::relax(); }
+    if ( i % CONTROL_EVERY == 0 ) {
+      while ( !push_control(cpu::read_tsc()) ) { cpu::relax(); }
+    }
+  }
+}
+
+static void print(char const *name, result const &r)
+{
+  std::cout << name << ": consumer " << r.cycles_per_op << " cycles/op, "
+    << r.controls << " control messages, latency avg "
+    << (r.controls ? r.latency_sum / r.controls : 0) << " max " << r.latency_max << " cycles" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  result fifo_result = result(), lanes_result = result();
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  cpu::pin(0);
+
+  pthread_create(&consumer_thread, NULL, fifo_consumer, &fifo_result);
+  producer([](uint64_t v) { return fifo.enqueue(v) == fifo_t::SUCCESS; },
+           [](uint64_t v) { return fifo.enqueue(v | CONTROL_BIT) == fifo_t::SUCCESS; });
+  pthread_join(consumer_thread, NULL);
+  print("fifo ", fifo_result);
+
+  pthread_create(&consumer_thread, NULL, lanes_consumer, &lanes_result);
+  producer([](uint64_t v) { return lanes.enqueue(1, v) == lanes_t::SUCCESS; },
+           [](uint64_t v) { return lanes.enqueue(0, v) == lanes_t::SUCCESS; });
+  pthread_join(consumer_thread, NULL);
+  print("lanes", lanes_result);
+  std::cout << "lanes: " << lanes.preemptions() << " bulk batches cut short" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// One producer, one consumer: queue<> (consumer zeroes every slot) against lap_queue<> (consumer
+// only reads the slots), single and bulk enqueue. lap_queue<> carries 0, 1, 2, ... to show that
+// 0 is an ordinary value there.
+//
+//   test_lap [elements [producer_cpu consumer_cpu]]
+
+#include <iostream>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "lap.hpp"
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+#define BULK 32
+
+static uint64_t test_size = 50000000;
+static int producer_cpu = 0;
+static int consumer_cpu = 1;
+
+template<typename Q>
+struct run_info {
+  Q q;
+  uint64_t first;     // value of the first element
+  uint64_t cycles;
+  uint64_t errors;
+};
+
+template<typename Q>
+void * consumer(void *arg)
+{
+  run_info<Q> *r = static_cast<run_info<Q> *>(arg);
+  uint64_t value, spins = 0;
+
+  cpu::pin(consumer_cpu);
+  uint64_t const start_c = cpu::read_tsc();
+  for (uint64_t i = 0; i < test_size; i++) {
+    while ( r->q.dequeue(&value) != Q::SUCCESS ) {
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+    if ( value != r->first + i ) { ++r->errors; }
+  }
+  r->cycles = cpu::read_tsc() - start_c;
+  return NULL;
+}
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+// Bulk enqueue where the queue has one, element by element otherwise.
+template<typename Q>
+size_t put_bulk(Q &q, uint64_t const *values, size_t n)
+{
+  size_t i = 0;
+  while ( i < n && q.enqueue(values[i]) == Q::SUCCESS ) { ++i; }
+  return i;
+}
+
+template<size_t S, typename E, size_t P>
+size_t put_bulk(lap_queue<S, E, P> &q, uint64_t const *values, size_t n)
+{
+  return q.enqueue_bulk(values, n);
+}
+
+template<typename Q>
+uint64_t run(char const *name, uint64_t first, uint64_t padding, bool bulk)
+{
+  run_info<Q> *r = new run_info<Q>();
+  pthread_t t;
+  uint64_t spins = 0;
+
+  r->first = first;
+  r->errors = 0;
+  pthread_create(&t, NULL, consumer<Q>, r);
+  cpu::pin(producer_cpu);
+
+  uint64_t const total = test_size + padding;
+  uint64_t const start_p = cpu::read_tsc();
+  if ( bulk ) {
+    uint64_t buf[BULK];
+    for (uint64_t i = 0; i < total; ) {
+      size_t const n = (total - i) < BULK ? (size_t)(total - i) : BULK;
+      for (size_t k = 0; k < n; k++) { buf[k] = first + i + k; }
+      size_t done = 0;
+      while ( done < n ) {
+        size_t const m = put_bulk(r->q, buf + done, n - done);
+        if ( m == 0 ) { wait(spins); }
+        done += m;
+      }
+      i += n;
+    }
+  }
+  else {
+    for (uint64_t i = 0; i < total; i++) {
+      while ( r->q.enqueue(first + i) != Q::SUCCESS ) { wait(spins); }
+    }
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  pthread_join(t, NULL);
+
+  std::cout << name << ": producer " << (stop_p - start_p) / test_size << " cycles/op, consumer "
+    << r->cycles / test_size << " cycles/op, " << r->errors << " errors" << std::endl;
+  uint64_t const errors = r->errors;
+  delete r;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  typedef queue<> zeroing_t;
+  typedef lap_queue<> lap_t;
+  uint64_t errors = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 3) {
+    producer_cpu = atoi(argv[2]);
+    consumer_cpu = atoi(argv[3]);
+  }
+  long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  producer_cpu %= cpus;
+  consumer_cpu %= cpus;
+
+  errors += run<zeroing_t>("queue<>          ", 1, zeroing_t::consumer_batch_size(), false);
+  errors += run<lap_t>("lap_queue<>      ", 0, 0, false);
+  errors += run<lap_t>("lap_queue<> bulk ", 0, 0, true);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Many lean_channel<>s sharing one slab, one producer and one consumer thread serving all of
+// them. The producer sends bursts of random length to random channels, a few hot channels get
+// most of the traffic; the consumer sweeps all channels and checks every channel's order. Prints
+// the footprint of the idle channels against queue<>, and the slab's segments at the peak and
+// after the consumer caught up.
+//
+//   test_lean [channels [elements]]
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include "lean.hpp"
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+#define HOT_CHANNELS 16
+#define MAX_BURST 1000
+
+typedef lean_channel<> channel_t;
+
+static channel_t::slab_t slab;
+static std::vector<channel_t *> channels;
+static uint64_t test_size = 10000000;
+
+void * consumer(void *arg)
+{
+  size_t const n = channels.size();
+  std::vector<uint32_t> expected(n, 1U);
+  uint64_t value, received = 0, errors = 0, spins = 0;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  while ( received < test_size ) {
+    bool any = false;
+    for (size_t c = 0; c < n; c++) {
+      while ( channels[c]->dequeue(&value) == channel_t::SUCCESS ) {
+        if ( value != expected[c] ) { ++errors; }
+        expected[c] = (uint32_t)value + 1U;
+        ++received;
+        any = true;
+      }
+    }
+    if ( !any && (++spins & 0xf) == 0 ) { sched_yield(); }
+  }
+  return (void *)errors;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t n = 100000;
+  pthread_t consumer_thread;
+  void *errors;
+
+  if (argc > 1) { n = strtoul(argv[1], NULL, 10); }
+  if (argc > 2) { test_size = strtoull(argv[2], NULL, 10); }
+  if (n < HOT_CHANNELS) { n = HOT_CHANNELS; }
+
+  channels.resize(n);
+  for (size_t c = 0; c < n; c++) { channels[c] = new channel_t(slab); }
+
+  std::cout << n << " idle channels: " << sizeof(channel_t) << " bytes each, "
+    << slab.segments_in_use() << " segments (queue<>: " << sizeof(queue<>) << " bytes each)" << std::endl;
+
+  std::vector<uint32_t> seq(n, 1U);
+  unsigned long seed = 1;
+  uint64_t sent = 0, spins = 0;
+
+  cpu::pin(0);
+  pthread_create(&consumer_thread, NULL, consumer, NULL);
+
+  uint64_t const start_p = cpu::read_tsc();
+  while ( sent < test_size ) {
+    seed = seed * 1103515245 + 12345;
+    size_t const c = ((seed >> 8) & 3) ? (seed >> 16) % HOT_CHANNELS : (seed >> 16) % n;
+    seed = seed * 1103515245 + 12345;
+    uint64_t burst = 1 + (seed >> 16) % MAX_BURST;
+    if ( burst > test_size - sent ) { burst = test_size - sent; }
+    for (uint64_t i = 0; i < burst; i++) {
+      while ( channels[c]->enqueue(seq[c]) != channel_t::SUCCESS ) {
+        cpu::relax();
+        if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+      }
+      ++seq[c];
+    }
+    sent += burst;
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+
+  pthread_join(consumer_thread, &errors);
+
+  size_t touched = 0;
+  for (size_t c = 0; c < n; c++) { touched += seq[c] > 1U; }
+
+  std::cout << "producer: " << (stop_p - start_p) / test_size << " cycles/op, "
+    << (uint64_t)errors << " out of order" << std::endl;
+  std::cout << "segments of " << channel_t::slab_t::segment_bytes() << " bytes: peak "
+    << slab.segments_peak() << ", in use after drain " << slab.segments_in_use() << " for "
+    << touched << " channels used, " << slab.segments_allocated() << " allocated" << std::endl;
+
+  for (size_t c = 0; c < n; c++) { delete channels[c]; }
+  return errors ? 1 : 0;
+}
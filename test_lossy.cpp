@@ -0,0 +1,144 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Lossy channels against a consumer slower than the producer. The producer sends 1, 2, ..., N
+// without ever waiting and the consumer burns `work` cycles per element. Checks that whatever
+// arrives is strictly increasing and that delivered + lost == N, where lost is dropped() for
+// drop_newest_queue<> and skipped() for overwrite_queue<>. The producer's cycles/op show it
+// is not slowed down by the full ring.
+//
+//   test_lossy [elements [work [producer_cpu consumer_cpu]]]
+
+#include <iostream>
+#include <cstdlib>
+#include <atomic>
+#include <pthread.h>
+#include <unistd.h>
+#include "lossy.hpp"
+#include "cpu.hpp"
+
+static uint64_t test_size = 10000000;
+static uint64_t work = 200;
+static int producer_cpu = 0;
+static int consumer_cpu = 1;
+
+template<typename Q>
+struct run_info {
+  Q q;
+  std::atomic<bool> done;
+  uint64_t delivered;
+  uint64_t errors;
+};
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+// Whatever consumer batching still holds back once the producer has finished.
+template<typename Q>
+typename Q::ReturnCode take_rest(drop_newest_queue<Q> &q, uint64_t *value)
+{
+  return q.dequeue_unbatched(value);
+}
+
+template<size_t S, typename E>
+typename overwrite_queue<S, E>::ReturnCode take_rest(overwrite_queue<S, E> &q, E *value)
+{
+  return q.dequeue(value);
+}
+
+template<typename Q>
+void * consumer(void *arg)
+{
+  run_info<Q> *r = static_cast<run_info<Q> *>(arg);
+  uint64_t value, last = 0, spins = 0;
+
+  cpu::pin(consumer_cpu);
+  for(;;) {
+    if ( r->q.dequeue(&value) != Q::SUCCESS ) {
+      if ( !r->done.load(std::memory_order_acquire) ) {
+        wait(spins);
+        continue;
+      }
+      if ( r->q.dequeue(&value) != Q::SUCCESS && take_rest(r->q, &value) != Q::SUCCESS ) {
+        break;
+      }
+    }
+    if ( value <= last ) { ++r->errors; }
+    last = value;
+    ++r->delivered;
+    uint64_t const until = cpu::read_tsc() + work;
+    while ( cpu::read_tsc() < until ) { }
+  }
+  return NULL;
+}
+
+static uint64_t dropped_of(drop_newest_queue<> const &q) { return q.dropped(); }
+static uint64_t dropped_of(overwrite_queue<> const &q) { return q.skipped(); }
+
+template<typename Q>
+uint64_t run(char const *name)
+{
+  run_info<Q> *r = new run_info<Q>();
+  pthread_t t;
+
+  r->done.store(false);
+  r->delivered = 0;
+  r->errors = 0;
+  pthread_create(&t, NULL, consumer<Q>, r);
+  cpu::pin(producer_cpu);
+
+  uint64_t const start_p = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size; i++) {
+    r->q.enqueue(i);
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  r->done.store(true, std::memory_order_release);
+  pthread_join(t, NULL);
+
+  uint64_t const lost = dropped_of(r->q);
+  if ( r->delivered + lost != test_size ) { ++r->errors; }
+  std::cout << name << ": producer " << (stop_p - start_p) / test_size << " cycles/op, delivered "
+    << r->delivered << ", lost " << lost << ", " << r->errors << " errors" << std::endl;
+  uint64_t const errors = r->errors;
+  delete r;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t errors = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 2) { work = strtoull(argv[2], NULL, 10); }
+  if (argc > 4) {
+    producer_cpu = atoi(argv[3]);
+    consumer_cpu = atoi(argv[4]);
+  }
+  long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  producer_cpu %= cpus;
+  consumer_cpu %= cpus;
+
+  errors += run<drop_newest_queue<> >("drop_newest_queue<>");
+  errors += run<overwrite_queue<> >("overwrite_queue<>  ");
+  return errors ? 1 : 0;
+}
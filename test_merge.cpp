@@ -0,0 +1,156 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// NUM_INPUTS producers send time-ordered events (random gaps between timestamps) through their
+// own queue<>, one kway_merge<> consumer checks that the merged stream is ordered and complete.
+// Producer 0 goes quiet halfway and only advances its watermark, the others end at different
+// times and close their inputs.
+// Before that, one thread checks that an input set aside as idle rejoins while the other input
+// keeps flowing, instead of only when the merge blocks.
+//
+//   test_merge [events_per_producer]
+
+#include <iostream>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "merge.hpp"
+#include "cpu.hpp"
+
+#define NUM_INPUTS 4
+#define SOURCE_BITS 8
+
+// Events carry their source in the low bits, the timestamp above.
+struct event_time {
+  uint64_t operator()(uint64_t v) const { return v >> SOURCE_BITS; }
+};
+
+typedef queue<> queue_t;
+typedef kway_merge<NUM_INPUTS, queue_t, event_time> merge_t;
+
+static queue_t inputs[NUM_INPUTS];
+static merge_t merger;
+static uint64_t test_size = 2000000;
+
+struct producer_info {
+  int id;
+  uint64_t count;
+};
+
+void * producer(void *arg)
+{
+  producer_info *p = (producer_info *)arg;
+  unsigned long seed = p->id + 1;
+  uint64_t ts = 1, spins = 0;
+
+  cpu::pin((p->id + 1) % sysconf(_SC_NPROCESSORS_ONLN));
+  for (uint64_t i = 0; i < p->count; i++) {
+    seed = seed * 1103515245 + 12345;
+    ts += 1 + (seed >> 16) % 16;
+    if ( p->id == 0 && i == p->count / 2 ) {
+      // quiet period: no events, but promise nothing older than ts comes
+      merger.advance(0, ts);
+      usleep(20000);
+    }
+    while ( inputs[p->id].enqueue((ts << SOURCE_BITS) | p->id) != queue_t::SUCCESS ) {
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+  }
+  merger.close(p->id);
+  return NULL;
+}
+
+// Input 1 goes idle, input 0 streams without a gap; input 1 then sends one event, which has to
+// come out within a poll period although the merge never blocks.
+static uint64_t check_idle_rejoin()
+{
+  typedef kway_merge<2, queue_t, event_time, 64> pair_t;
+  queue_t *q = new queue_t[2];
+  pair_t *m = new pair_t();
+  uint64_t value, sent_at = 0, seen_at = 0, errors = 0, popped = 0;
+
+  m->attach(0, &q[0]);
+  m->attach(1, &q[1]);
+  m->set_idle_timeout(1);
+  q[0].enqueue(1 << SOURCE_BITS);
+  while ( m->dequeue(&value) != pair_t::SUCCESS ) { } // input 1 blocks, then is set aside
+
+  for (uint64_t ts = 2; ts < 1000 && seen_at == 0; ts++) {
+    q[0].enqueue(ts << SOURCE_BITS);
+    if ( ts == 100 ) {
+      q[1].enqueue((ts << SOURCE_BITS) | 1);
+      sent_at = popped;
+    }
+    if ( m->dequeue(&value) != pair_t::SUCCESS ) { ++errors; } // input 0 always has one
+    ++popped;
+    if ( value & 1 ) { seen_at = popped; }
+  }
+  if ( seen_at == 0 || seen_at - sent_at > 2 * 64 ) { ++errors; }
+
+  std::cout << "idle rejoin: after " << (seen_at ? seen_at - sent_at : 0) << " events, "
+    << errors << " errors" << std::endl;
+  delete m;
+  delete [] q;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t threads[NUM_INPUTS];
+  producer_info info[NUM_INPUTS];
+  uint64_t value, last = 0, received = 0, expected = 0, errors = 0, spins = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+
+  if ( check_idle_rejoin() ) { return 1; }
+
+  for (int i = 0; i < NUM_INPUTS; i++) {
+    merger.attach(i, &inputs[i]);
+    info[i].id = i;
+    info[i].count = test_size - i * (test_size / (2 * NUM_INPUTS)); // inputs end at different times
+    expected += info[i].count;
+  }
+  for (int i = 0; i < NUM_INPUTS; i++) {
+    pthread_create(&threads[i], NULL, producer, &info[i]);
+  }
+
+  cpu::pin(0);
+  uint64_t const start_c = cpu::read_tsc();
+  while ( !merger.finished() ) {
+    if ( merger.dequeue(&value) != merge_t::SUCCESS ) {
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+      continue;
+    }
+    uint64_t const ts = value >> SOURCE_BITS;
+    if ( ts < last ) { ++errors; }
+    last = ts;
+    ++received;
+  }
+  uint64_t const stop_c = cpu::read_tsc();
+
+  for (int i = 0; i < NUM_INPUTS; i++) { pthread_join(threads[i], NULL); }
+
+  std::cout << "merge: " << received << "/" << expected << " events from " << NUM_INPUTS
+    << " inputs, " << (stop_c - start_c) / (received ? received : 1) << " cycles/event, "
+    << errors << " out of order, " << merger.late() << " late" << std::endl;
+  return (errors || received != expected) ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// mirror_ring: checks that the two mappings alias, then one producer and one consumer pass
+// variable-size records (1 .. 2000 bytes, a pattern derived from the sequence number) and a
+// stream of uint64_t copied in chunks of varying size. The ring is small so that records and
+// chunks straddle the wrap point many times; the consumer checks every byte and counts how
+// many straddled.
+//
+//   test_mirror [records [producer_cpu consumer_cpu]]
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include "mirror.hpp"
+#include "cpu.hpp"
+
+#define RING_BYTES (64 * 1024)
+#define MAX_RECORD 2000
+#define MAX_CHUNK 777
+
+static uint64_t test_size = 2000000;
+static int producer_cpu = 0;
+static int consumer_cpu = 1;
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+static inline uint32_t record_len(uint64_t seq)
+{
+  return (uint32_t)((seq * 2654435761ULL) >> 7) % MAX_RECORD + 1U;
+}
+
+static inline uint8_t record_byte(uint64_t seq, uint32_t k)
+{
+  return (uint8_t)(seq * 31U + k * 7U);
+}
+
+struct run_info {
+  mirror_ring *q;
+  uint64_t cycles;
+  uint64_t errors;
+  uint64_t straddled;
+};
+
+void * record_consumer(void *arg)
+{
+  run_info *r = static_cast<run_info *>(arg);
+  uint64_t spins = 0, offset = 0;
+
+  cpu::pin(consumer_cpu);
+  uint64_t const start_c = cpu::read_tsc();
+  for (uint64_t i = 0; i < test_size; i++) {
+    uint32_t len;
+    uint8_t const *p;
+    while ( (p = static_cast<uint8_t const *>(r->q->front_record(&len))) == NULL ) { wait(spins); }
+    if ( len != record_len(i) ) {
+      ++r->errors;
+    }
+    else {
+      for (uint32_t k = 0; k < len; k++) {
+        if ( p[k] != record_byte(i, k) ) { ++r->errors; break; }
+      }
+    }
+    size_t const n = mirror_ring::record_bytes(len);
+    if ( (offset & (r->q->capacity() - 1)) + n > r->q->capacity() ) { ++r->straddled; }
+    offset += n;
+    r->q->pop_record(len);
+  }
+  r->cycles = cpu::read_tsc() - start_c;
+  return NULL;
+}
+
+void * stream_consumer(void *arg)
+{
+  run_info *r = static_cast<run_info *>(arg);
+  uint64_t spins = 0, offset = 0, next = 0;
+  uint64_t const total = test_size * sizeof(uint64_t);
+
+  cpu::pin(consumer_cpu);
+  uint64_t const start_c = cpu::read_tsc();
+  while ( offset < total ) {
+    size_t n;
+    uint64_t const *p = static_cast<uint64_t const *>(r->q->peek(&n));
+    if ( p == NULL ) { wait(spins); continue; }
+    n /= sizeof(uint64_t);
+    for (size_t k = 0; k < n; k++) {
+      if ( p[k] != next++ ) { ++r->errors; }
+    }
+    size_t const bytes = n * sizeof(uint64_t);
+    if ( (offset & (r->q->capacity() - 1)) + bytes > r->q->capacity() ) { ++r->straddled; }
+    offset += bytes;
+    r->q->release(bytes);
+  }
+  r->cycles = cpu::read_tsc() - start_c;
+  return NULL;
+}
+
+static uint64_t report(char const *name, run_info const &r, uint64_t producer_cycles, uint64_t bytes)
+{
+  std::cout << name << ": producer " << producer_cycles / test_size << " cycles/op, consumer "
+    << r.cycles / test_size << " cycles/op, " << (double)bytes / r.cycles << " bytes/cycle, "
+    << r.straddled << " spans across the wrap, " << r.errors << " errors" << std::endl;
+  return r.errors;
+}
+
+static uint64_t run_records(mirror_ring &q)
+{
+  run_info r = { &q, 0, 0, 0 };
+  pthread_t t;
+  uint64_t spins = 0, bytes = 0;
+  uint8_t buf[MAX_RECORD];
+
+  pthread_create(&t, NULL, record_consumer, &r);
+  cpu::pin(producer_cpu);
+  uint64_t const start_p = cpu::read_tsc();
+  for (uint64_t i = 0; i < test_size; i++) {
+    uint32_t const len = record_len(i);
+    for (uint32_t k = 0; k < len; k++) { buf[k] = record_byte(i, k); }
+    while ( !q.enqueue_record(buf, len) ) { wait(spins); }
+    bytes += len;
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  pthread_join(t, NULL);
+
+  return report("records", r, stop_p - start_p, bytes);
+}
+
+static uint64_t run_stream(mirror_ring &q)
+{
+  run_info r = { &q, 0, 0, 0 };
+  pthread_t t;
+  uint64_t spins = 0;
+
+  pthread_create(&t, NULL, stream_consumer, &r);
+  cpu::pin(producer_cpu);
+  uint64_t const start_p = cpu::read_tsc();
+  for (uint64_t i = 0; i < test_size; ) {
+    uint64_t n = (i * 40503U) % MAX_CHUNK + 1U;
+    if ( n > test_size - i ) { n = test_size - i; }
+    uint64_t *p;
+    while ( (p = static_cast<uint64_t *>(q.reserve(n * sizeof(uint64_t)))) == NULL ) { wait(spins); }
+    for (uint64_t k = 0; k < n; k++) { p[k] = i + k; }
+    q.commit(n * sizeof(uint64_t));
+    i += n;
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  pthread_join(t, NULL);
+
+  return report("stream ", r, stop_p - start_p, test_size * sizeof(uint64_t));
+}
+
+// A store just below the end of the ring must show up at its start through the second mapping.
+static uint64_t check_alias(mirror_ring &q)
+{
+  size_t const cap = q.capacity();
+  uint8_t *const p = static_cast<uint8_t *>(q.reserve(cap));
+  uint64_t errors = 0;
+
+  if ( p == NULL ) { return 1; }
+  q.commit(cap - 8);
+  size_t n;
+  uint8_t const *c = static_cast<uint8_t const *>(q.peek(&n));
+  q.release(n);
+  // head now sits 8 bytes before the end; write 16 bytes across the wrap
+  uint8_t *const w = static_cast<uint8_t *>(q.reserve(16));
+  for (int k = 0; k < 16; k++) { w[k] = (uint8_t)(0xa0 + k); }
+  q.commit(16);
+  for (int k = 0; k < 8; k++) {
+    if ( c[k] != 0xa8 + k ) { ++errors; }
+  }
+  c = static_cast<uint8_t const *>(q.peek(&n));
+  if ( n != 16 || memcmp(c, w, 16) != 0 ) { ++errors; }
+  q.release(n);
+
+  std::cout << "alias  : " << cap << " bytes mapped twice, " << errors << " errors" << std::endl;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t errors = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 3) {
+    producer_cpu = atoi(argv[2]);
+    consumer_cpu = atoi(argv[3]);
+  }
+  long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  producer_cpu %= cpus;
+  consumer_cpu %= cpus;
+
+  {
+    mirror_ring q(RING_BYTES);
+    if ( !q.ok() ) { return 1; }
+    errors += check_alias(q);
+  }
+  {
+    mirror_ring q(RING_BYTES);
+    if ( !q.ok() ) { return 1; }
+    errors += run_records(q);
+  }
+  {
+    mirror_ring q(RING_BYTES);
+    if ( !q.ok() ) { return 1; }
+    errors += run_stream(q);
+  }
+  return errors ? 1 : 0;
+}
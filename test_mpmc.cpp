@@ -0,0 +1,213 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// N producers and M consumers on one mpmc_queue<>, then the same traffic through a
+// mutex-protected std::deque for comparison. Every consumer checks that the elements of each
+// producer arrive in order and the totals are compared at the end.
+//
+//   test_mpmc [producers consumers [elements_per_producer]]
+
+#include <iostream>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "mpmc.hpp"
+#include "cpu.hpp"
+
+#define MAX_THREADS 64
+#define PRODUCER_BITS 8
+
+typedef mpmc_queue<> queue_t;
+
+static queue_t q;
+static int producers = 2;
+static int consumers = 2;
+static uint64_t test_size = 10000000;
+
+static std::atomic<uint64_t> received;
+static std::atomic<uint64_t> claims;
+static std::atomic<uint64_t> errors;
+static std::atomic<uint64_t> checksum;
+
+// Same interface on a std::deque behind one lock, what the thread pools use today.
+struct locked_queue {
+  std::mutex m;
+  std::deque<uint64_t> d;
+
+  bool enqueue(uint64_t v)
+  {
+    std::lock_guard<std::mutex> g(m);
+    if ( d.size() >= queue_t::queue_size() ) { return false; }
+    d.push_back(v);
+    return true;
+  }
+
+  bool dequeue(uint64_t *v)
+  {
+    std::lock_guard<std::mutex> g(m);
+    if ( d.empty() ) { return false; }
+    *v = d.front();
+    d.pop_front();
+    return true;
+  }
+};
+
+static locked_queue lq;
+static bool use_lock = false;
+
+struct thread_info {
+  int id;
+  pthread_barrier_t *barrier;
+  uint64_t cycles;
+};
+
+static inline void pin(int id)
+{
+  cpu::pin(id % sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+void * producer(void *arg)
+{
+  thread_info *t = (thread_info *)arg;
+  queue_t::producer p(q);
+  uint64_t spins = 0;
+
+  pin(t->id);
+  pthread_barrier_wait(t->barrier);
+
+  uint64_t const start_c = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size; i++) {
+    uint64_t const v = (i << PRODUCER_BITS) | t->id;
+    if ( use_lock ) {
+      while ( !lq.enqueue(v) ) { sched_yield(); }
+    }
+    else {
+      while ( p.enqueue(v) != queue_t::SUCCESS ) {
+        cpu::relax();
+        if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+      }
+    }
+  }
+  p.flush();
+  t->cycles = cpu::read_tsc() - start_c;
+  claims += p.claims();
+  return NULL;
+}
+
+void * consumer(void *arg)
+{
+  thread_info *t = (thread_info *)arg;
+  queue_t::consumer c(q);
+  uint64_t last[MAX_THREADS] = { 0 };
+  uint64_t const total = test_size * producers;
+  uint64_t value, sum = 0, n = 0, unreported = 0, spins = 0;
+
+  pin(t->id);
+  pthread_barrier_wait(t->barrier);
+
+  uint64_t const start_c = cpu::read_tsc();
+  while ( received.load(std::memory_order_relaxed) < total || c.pending() ) {
+    bool const ok = use_lock ? lq.dequeue(&value) : c.dequeue(&value) == queue_t::SUCCESS;
+    if ( !ok ) {
+      // publish the local count while idle, the others wait for it to reach total
+      received += unreported;
+      unreported = 0;
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+      continue;
+    }
+    uint64_t const from = value & ((1U << PRODUCER_BITS) - 1);
+    uint64_t const seq = value >> PRODUCER_BITS;
+    if ( seq <= last[from] ) { ++errors; }
+    last[from] = seq;
+    sum += seq;
+    ++n;
+    if ( ++unreported == 0x400 ) {
+      received += unreported;
+      unreported = 0;
+    }
+  }
+  received += unreported;
+  t->cycles = cpu::read_tsc() - start_c;
+  checksum += sum;
+  claims += c.claims();
+  return NULL;
+}
+
+static uint64_t run(bool locked)
+{
+  pthread_t threads[MAX_THREADS];
+  thread_info info[MAX_THREADS];
+  pthread_barrier_t barrier;
+  int const n = producers + consumers;
+
+  use_lock = locked;
+  received = 0;
+  claims = 0;
+  errors = 0;
+  checksum = 0;
+
+  pthread_barrier_init(&barrier, NULL, n);
+  for (int i = 0; i < n; i++) {
+    info[i].id = i < producers ? i : i - producers;
+    info[i].barrier = &barrier;
+    pthread_create(&threads[i], NULL, i < producers ? producer : consumer, &info[i]);
+  }
+  for (int i = 0; i < n; i++) { pthread_join(threads[i], NULL); }
+  pthread_barrier_destroy(&barrier);
+
+  uint64_t producer_cycles = 0;
+  for (int i = 0; i < producers; i++) { producer_cycles += info[i].cycles; }
+  uint64_t const ops = test_size * producers;
+  uint64_t const expected = producers * (test_size * (test_size + 1) / 2);
+
+  std::cout << (locked ? "mutex+deque: " : "mpmc_queue:  ")
+    << producer_cycles / ops << " producer cycles/op, "
+    << received.load() << " elements";
+  if ( !locked ) { std::cout << ", " << claims.load() << " counter claims"; }
+  std::cout << ", " << errors.load() << " out of order, checksum "
+    << (checksum.load() == expected ? "ok" : "BAD") << std::endl;
+
+  return errors.load() + (checksum.load() != expected) + (received.load() != ops);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 2) {
+    producers = atoi(argv[1]);
+    consumers = atoi(argv[2]);
+  }
+  if (argc > 3) { test_size = strtoull(argv[3], NULL, 10); }
+  if ( producers < 1 || consumers < 1 || producers + consumers > MAX_THREADS ||
+       producers >= (1 << PRODUCER_BITS) ) {
+    std::cerr << "Error: bad thread counts" << std::endl;
+    return 1;
+  }
+
+  std::cout << producers << " producer(s), " << consumers << " consumer(s), "
+    << test_size << " elements each, batch " << queue_t::batch_size() << std::endl;
+
+  uint64_t failures = run(false);
+  failures += run(true);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// One producer/consumer pair per NUMA placement policy of the queue memory.
+// Pick the two cpus on different sockets to see the cross-socket difference; cpu numbers are
+// taken modulo the number of online cpus.
+//
+//   test_numa [producer_cpu consumer_cpu [elements]]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "numa.hpp"
+#include "fifo2.hpp"
+#include "cpu.hpp"
+
+typedef queue<> queue_t;
+
+static uint64_t test_size = 10000000;
+static int producer_cpu = 0;
+static int consumer_cpu = 1;
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+struct run_info {
+  queue_t *q;
+  pthread_barrier_t *barrier;
+  uint64_t cycles;
+};
+
+void * consumer(void *arg)
+{
+  run_info *r = (run_info *)arg;
+  uint64_t value, spins = 0;
+
+  cpu::pin(consumer_cpu);
+  pthread_barrier_wait(r->barrier);
+
+  uint64_t const start_c = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size; i++) {
+    while ( r->q->dequeue(&value) != queue_t::SUCCESS ) { wait(spins); }
+  }
+  r->cycles = cpu::read_tsc() - start_c;
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  pthread_barrier_t barrier;
+  uint64_t spins = 0;
+
+  if (argc > 2) {
+    producer_cpu = atoi(argv[1]);
+    consumer_cpu = atoi(argv[2]);
+  }
+  if (argc > 3) { test_size = strtoull(argv[3], NULL, 10); }
+  producer_cpu %= sysconf(_SC_NPROCESSORS_ONLN);
+  consumer_cpu %= sysconf(_SC_NPROCESSORS_ONLN);
+
+  std::cout << "producer cpu " << producer_cpu << " (node " << numa_node_of_cpu(producer_cpu) << "), "
+    << "consumer cpu " << consumer_cpu << " (node " << numa_node_of_cpu(consumer_cpu) << "), "
+    << numa_nodes() << " node(s)" << std::endl;
+
+  numa_policy const policies[] = { NUMA_FIRST_TOUCH, NUMA_PRODUCER, NUMA_CONSUMER, NUMA_INTERLEAVE };
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+    run_info r;
+    r.q = numa_new<queue_t>(policies[p], producer_cpu, consumer_cpu);
+    if ( !r.q ) { return 1; }
+    r.barrier = &barrier;
+
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&consumer_thread, NULL, consumer, &r);
+
+    cpu::pin(producer_cpu);
+    pthread_barrier_wait(&barrier);
+    uint64_t const start_p = cpu::read_tsc();
+    for (uint64_t i = 1; i <= test_size + queue_t::consumer_batch_size(); i++) {
+      while ( r.q->enqueue(i) != queue_t::SUCCESS ) { wait(spins); }
+    }
+    uint64_t const stop_p = cpu::read_tsc();
+    pthread_join(consumer_thread, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    std::cout << numa_policy_name(policies[p]) << ": ring on node " << numa_node_of_addr(r.q)
+      << ", producer " << (stop_p - start_p) / test_size << " cycles/op"
+      << ", consumer " << r.cycles / test_size << " cycles/op" << std::endl;
+
+    numa_delete(r.q);
+  }
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Round-trip time between two cores over a duplex_channel<>, for every ordered pair of the
+// given cpus (all online cpus by default), unbatched and batched-with-flush.
+// Prints the RTT distribution in cycles per pair.
+//
+//   test_pingpong [round_trips [cpu cpu ...]]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "duplex.hpp"
+#include "cpu.hpp"
+
+#define WARMUP 1000
+
+static uint64_t round_trips = 100000;
+static uint64_t const STOP = duplex_channel<>::PAYLOAD_MASK;
+
+// Spin, but let the other side run now and then when both share a cpu.
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+template<typename CHANNEL>
+uint64_t round_trip(CHANNEL &ch, uint64_t x)
+{
+  uint16_t id, rid;
+  uint64_t result, spins = 0;
+  while ( ch.send(x, &id) != CHANNEL::SUCCESS ) { wait(spins); }
+  while ( ch.receive(&rid, &result) != CHANNEL::SUCCESS ) { wait(spins); }
+  return rid == id ? result : 0;
+}
+
+template<typename CHANNEL>
+struct pair_run {
+  CHANNEL ch;
+  int server_cpu;
+  uint64_t errors;
+};
+
+template<typename CHANNEL>
+void * server(void *arg)
+{
+  pair_run<CHANNEL> *r = static_cast<pair_run<CHANNEL> *>(arg);
+  uint16_t id;
+  uint64_t x, spins = 0;
+
+  cpu::pin(r->server_cpu);
+  for(;;) {
+    while ( r->ch.next_request(&id, &x) != CHANNEL::SUCCESS ) { wait(spins); }
+    while ( r->ch.reply(id, x + 1) != CHANNEL::SUCCESS ) { wait(spins); }
+    if ( x == STOP ) { break; }
+  }
+  return NULL;
+}
+
+static void report(char const *mode, int client_cpu, int server_cpu, std::vector<uint64_t> &rtt,
+  uint64_t errors)
+{
+  std::sort(rtt.begin(), rtt.end());
+  size_t const n = rtt.size();
+  std::cout << std::setw(9) << mode << "  " << std::setw(3) << client_cpu << " -> "
+    << std::setw(3) << server_cpu
+    << "  min " << std::setw(6) << rtt[0]
+    << "  p50 " << std::setw(6) << rtt[n / 2]
+    << "  p90 " << std::setw(6) << rtt[n * 9 / 10]
+    << "  p99 " << std::setw(7) << rtt[n * 99 / 100]
+    << "  p99.9 " << std::setw(8) << rtt[n * 999 / 1000]
+    << "  max " << std::setw(9) << rtt[n - 1]
+    << (errors ? "  BAD REPLIES" : "") << std::endl;
+}
+
+template<typename CHANNEL>
+uint64_t ping_pong(char const *mode, int client_cpu, int server_cpu)
+{
+  pair_run<CHANNEL> *r = new pair_run<CHANNEL>();
+  std::vector<uint64_t> rtt;
+  pthread_t t;
+
+  r->server_cpu = server_cpu;
+  r->errors = 0;
+  rtt.reserve(round_trips);
+
+  cpu::pin(client_cpu);
+  pthread_create(&t, NULL, server<CHANNEL>, r);
+
+  for (uint64_t i = 1; i <= WARMUP + round_trips; i++) {
+    uint64_t const start_c = cpu::read_tsc();
+    uint64_t const reply = round_trip(r->ch, i);
+    uint64_t const stop_c = cpu::read_tsc();
+    if ( reply != i + 1 ) { ++r->errors; }
+    if ( i > WARMUP ) { rtt.push_back(stop_c - start_c); }
+  }
+  round_trip(r->ch, STOP);
+  pthread_join(t, NULL);
+
+  report(mode, client_cpu, server_cpu, rtt, r->errors);
+  uint64_t const errors = r->errors;
+  delete r;
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<int> cpus;
+  uint64_t errors = 0;
+
+  if (argc > 1) { round_trips = strtoull(argv[1], NULL, 10); }
+  for (int i = 2; i < argc; i++) { cpus.push_back(atoi(argv[i])); }
+  if ( cpus.empty() ) {
+    for (long c = 0; c < sysconf(_SC_NPROCESSORS_ONLN); c++) { cpus.push_back(c); }
+  }
+  if ( round_trips == 0 ) { round_trips = 1; }
+
+  std::cout << round_trips << " round trips per pair, RTT in cycles" << std::endl;
+  for (size_t a = 0; a < cpus.size(); a++) {
+    for (size_t b = 0; b < cpus.size(); b++) {
+      if ( a == b && cpus.size() > 1 ) { continue; }
+      errors += ping_pong< duplex_channel<1024, false> >("unbatched", cpus[a], cpus[b]);
+      errors += ping_pong< duplex_channel<1024, true> >("batched", cpus[a], cpus[b]);
+    }
+  }
+  return errors ? 1 : 0;
+}
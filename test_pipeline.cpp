@@ -0,0 +1,154 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Sample pipeline: read -> parse -> filter -> aggregate over a file of "key,value" records.
+//
+//   test_pipeline [file [records]]
+//
+// The file is generated (with `records` lines) when it does not exist yet. The aggregates are
+// checked against a single-threaded pass over the same file: a pipeline that loses or
+// duplicates elements fails.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "pipeline.hpp"
+
+#define NUM_KEYS 64
+
+struct record {
+  uint32_t key;
+  int64_t value;
+};
+
+static bool generate(char const *path, uint64_t records)
+{
+  FILE *f = fopen(path, "w");
+  if ( !f ) {
+    perror("fopen");
+    return false;
+  }
+  unsigned long next = 1;
+  for(uint64_t i = 0; i < records; ++i) {
+    next = next * 1103515245 + 12345;
+    fprintf(f, "%lu,%" PRId64 "\n", (next >> 16) % NUM_KEYS, (int64_t)(i % 1000) - 100);
+  }
+  fclose(f);
+  return true;
+}
+
+// read -> parse -> filter -> aggregate without the pipeline. Returns false if unreadable.
+static bool reference(char const *path, std::vector<int64_t> &sums, std::vector<uint64_t> &counts,
+  uint64_t *lines)
+{
+  FILE *f = fopen(path, "r");
+  if ( !f ) {
+    perror("fopen");
+    return false;
+  }
+  char line[256];
+  while ( fgets(line, sizeof(line), f) ) {
+    char *end;
+    ++*lines;
+    unsigned long const key = strtoul(line, &end, 10);
+    if ( *end != ',' || key >= NUM_KEYS ) { continue; }
+    int64_t const value = strtoll(end + 1, NULL, 10);
+    if ( value > 0 ) {
+      sums[key] += value;
+      counts[key] ++;
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  char const *path = (argc > 1) ? argv[1] : "pipeline_records.csv";
+  uint64_t records = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1000000;
+
+  if ( access(path, R_OK) != 0 ) {
+    std::cout << "generating " << records << " records in " << path << std::endl;
+    if ( !generate(path, records) ) { return 1; }
+  }
+
+  FILE *in = fopen(path, "r");
+  if ( !in ) {
+    perror("fopen");
+    return 1;
+  }
+
+  long const ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<int64_t> sums(NUM_KEYS, 0);
+  std::vector<uint64_t> counts(NUM_KEYS, 0);
+  uint64_t malformed = 0, read = 0, parsed = 0;
+
+  pipeline p;
+  p.source<std::string>("read", 0 % ncpu, [in, &read](pipeline::emitter<std::string> &out) {
+      char line[256];
+      if ( !fgets(line, sizeof(line), in) ) { return false; }
+      ++read;
+      out.push(std::string(line));
+      return true;
+    })
+   .then<record>("parse", 1 % ncpu, [&malformed, &parsed](std::string &line, pipeline::emitter<record> &out) {
+      char *end;
+      record r;
+      ++parsed;
+      r.key = strtoul(line.c_str(), &end, 10);
+      if ( *end != ',' || r.key >= NUM_KEYS ) { ++malformed; return; }
+      r.value = strtoll(end + 1, NULL, 10);
+      out.push(r);
+    })
+   .then<record>("filter", 2 % ncpu, [](record &r, pipeline::emitter<record> &out) {
+      if ( r.value > 0 ) { out.push(r); }
+    })
+   .sink("aggregate", 3 % ncpu, [&sums, &counts](record &r) {
+      sums[r.key] += r.value;
+      counts[r.key] ++;
+    });
+
+  p.run();
+  fclose(in);
+
+  int64_t total = 0;
+  uint64_t n = 0;
+  for(size_t k = 0; k < NUM_KEYS; ++k) {
+    total += sums[k];
+    n += counts[k];
+  }
+  std::vector<int64_t> expected_sums(NUM_KEYS, 0);
+  std::vector<uint64_t> expected_counts(NUM_KEYS, 0);
+  uint64_t lines = 0, errors = 0;
+  if ( !reference(path, expected_sums, expected_counts, &lines) ) { return 1; }
+  if ( read != lines || parsed != lines ) { ++errors; }
+  for(size_t k = 0; k < NUM_KEYS; ++k) {
+    if ( sums[k] != expected_sums[k] || counts[k] != expected_counts[k] ) { ++errors; }
+  }
+
+  std::cout << "aggregated " << n << " records over " << NUM_KEYS << " keys, sum " << total
+    << ", malformed " << malformed << ", " << errors << " errors" << std::endl;
+  p.report(std::cout);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Buffers passed from producer to consumer: malloc/free across threads over queue<>,
+// then message_pool<> with its return channel.
+//
+//   test_pool [messages]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.hpp"
+#include "cpu.hpp"
+
+struct message {
+  uint64_t seq;
+  char payload[120];
+};
+
+typedef queue<> queue_t;
+typedef message_pool<message> pool_t;
+
+static queue_t ptrs;
+static pool_t pool;
+static uint64_t test_size = 10000000;
+
+void * malloc_consumer(void *arg)
+{
+  uint64_t value, errors = 0;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  for (uint64_t i = 1; i <= test_size; i++) {
+    while ( ptrs.dequeue(&value) != queue_t::SUCCESS &&
+            ptrs.dequeue_unbatched(&value) != queue_t::SUCCESS ) { cpu::relax(); }
+    message *m = (message *)value;
+    if ( m->seq != i || m->payload[0] != (char)i ) { ++errors; }
+    free(m);
+  }
+  return (void *)errors;
+}
+
+void * pool_consumer(void *arg)
+{
+  uint64_t errors = 0;
+  message *m;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  for (uint64_t i = 1; i <= test_size; i++) {
+    while ( !(m = pool.receive()) ) { pool.flush(); cpu::relax(); }
+    if ( m->seq != i || m->payload[0] != (char)i ) { ++errors; }
+    pool.release(m);
+  }
+  pool.flush();
+  return (void *)errors;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  void *errors_malloc, *errors_pool;
+  uint64_t start_p, stop_p;
+  message *m;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  cpu::pin(0);
+
+  pthread_create(&consumer_thread, NULL, malloc_consumer, NULL);
+  start_p = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size; i++) {
+    m = (message *)malloc(sizeof(message));
+    m->seq = i;
+    m->payload[0] = (char)i;
+    while ( ptrs.enqueue((uint64_t)m) != queue_t::SUCCESS ) { cpu::relax(); }
+  }
+  pthread_join(consumer_thread, &errors_malloc);
+  stop_p = cpu::read_tsc();
+  std::cout << "malloc/free: " << (stop_p - start_p) / test_size << " cycles/op, "
+    << (uint64_t)errors_malloc << " errors" << std::endl;
+
+  pthread_create(&consumer_thread, NULL, pool_consumer, NULL);
+  start_p = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size; i++) {
+    while ( !(m = pool.acquire()) ) { cpu::relax(); }
+    m->seq = i;
+    m->payload[0] = (char)i;
+    pool.send(m);
+  }
+  pthread_join(consumer_thread, &errors_pool);
+  stop_p = cpu::read_tsc();
+  std::cout << "pool:        " << (stop_p - start_p) / test_size << " cycles/op, "
+    << (uint64_t)errors_pool << " errors, pool exhausted " << pool.exhausted() << " times" << std::endl;
+
+  return (errors_malloc || errors_pool) ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays the arrivals of a captured enqueue stream (fifo built with -DFIFO_CAPTURE, see
+// capture.h) against several queue variants: the producer enqueues every record at its
+// captured time, rescaled to this machine's TSC rate and divided by `speed`, the consumer
+// dequeues as fast as it can. Each element carries its scheduled time, so the consumer sees the
+// whole delay: backpressure on the producer plus the time spent in the queue.
+//
+// Without a capture file it first records one itself: a producer paced by BQ_WORKLOAD (bursty
+// arrivals by default, see workload.h) into a queue<>, written to test_replay.capture.
+//
+//   test_replay [capture|- [speed [producer_cpu consumer_cpu]]]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include "capture.h"
+#include "workload.h"
+#include "fifo2.hpp"
+#include "lap.hpp"
+#include "cpu.hpp"
+
+#define SELF_CAPTURE_SIZE 1000000
+#define SELF_CAPTURE_FILE "test_replay.capture"
+#define SELF_CAPTURE_WORKLOAD "arrival=bursty,gap=200,burst=64,idle=200000"
+
+static int producer_cpu = 0;
+static int consumer_cpu = 1;
+
+struct arrival {
+  uint64_t gap;    // cycles on this machine since the previous record
+  uint32_t count;  // elements
+};
+
+static std::vector<arrival> arrivals;
+static uint64_t total_elements;
+
+static inline void wait(uint64_t &spins)
+{
+  cpu::relax();
+  if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+}
+
+// Elements the consumer may hold back at the end of a stream, see queue<>::consumer_batch_size().
+template<typename Q>
+size_t padding() { return Q::consumer_batch_size(); }
+
+template<>
+size_t padding< lap_queue<> >() { return 0; }
+
+/* Self capture: a live queue<> under a synthetic arrival pattern. */
+
+static queue<> live;
+static capture_stream live_streams[2];
+
+void * live_consumer(void *arg)
+{
+  uint64_t value, spins = 0;
+
+  cpu::pin(consumer_cpu);
+  for (uint64_t i = 0; i < SELF_CAPTURE_SIZE; i++) {
+    while ( live.dequeue(&value) != queue<>::SUCCESS ) { wait(spins); }
+    capture_record(&live_streams[CAPTURE_DEQUEUE], cpu::read_tsc(), 1);
+  }
+  return NULL;
+}
+
+static int self_capture(char const *path)
+{
+  workload_config cfg;
+  workload w;
+  pthread_t t;
+  uint64_t spins = 0;
+
+  workload_default_config(&cfg);
+  if ( workload_parse(&cfg, getenv("BQ_WORKLOAD") ? getenv("BQ_WORKLOAD") : SELF_CAPTURE_WORKLOAD) ) {
+    return -1;
+  }
+  if ( workload_init(&w, &cfg, 1) || capture_open(&live_streams[CAPTURE_ENQUEUE], CAPTURE_ENQUEUE, 0, CAPTURE_BYTES)
+    || capture_open(&live_streams[CAPTURE_DEQUEUE], CAPTURE_DEQUEUE, 1, CAPTURE_BYTES) ) {
+    return -1;
+  }
+
+  pthread_create(&t, NULL, live_consumer, NULL);
+  cpu::pin(producer_cpu);
+  uint64_t next_c = cpu::read_tsc();
+  for (uint64_t i = 1; i <= SELF_CAPTURE_SIZE + queue<>::consumer_batch_size(); i++) {
+    next_c += workload_next_gap(&w);
+    while ( cpu::read_tsc() < next_c ) { }
+    while ( live.enqueue(i) != queue<>::SUCCESS ) { wait(spins); }
+    if ( i <= SELF_CAPTURE_SIZE ) { capture_record(&live_streams[CAPTURE_ENQUEUE], cpu::read_tsc(), 1); }
+  }
+  pthread_join(t, NULL);
+
+  capture_stream *streams[2] = { &live_streams[0], &live_streams[1] };
+  int const rc = capture_write(path, streams, 2);
+  capture_close(&live_streams[0]);
+  capture_close(&live_streams[1]);
+  workload_destroy(&w);
+  return rc;
+}
+
+/* Replay. */
+
+template<typename Q>
+struct replay_run {
+  Q q;
+  std::vector<uint64_t> latency;
+  uint64_t last_c;
+};
+
+template<typename Q>
+void * replay_consumer(void *arg)
+{
+  replay_run<Q> *r = static_cast<replay_run<Q> *>(arg);
+  uint64_t value, spins = 0;
+
+  cpu::pin(consumer_cpu);
+  for (uint64_t i = 0; i < total_elements; i++) {
+    while ( r->q.dequeue(&value) != Q::SUCCESS ) { wait(spins); }
+    r->latency.push_back(cpu::read_tsc() - value);
+  }
+  r->last_c = cpu::read_tsc();
+  return NULL;
+}
+
+template<typename Q>
+void replay(char const *name, uint64_t hz)
+{
+  replay_run<Q> *r = new replay_run<Q>();
+  pthread_t t;
+  uint64_t spins = 0, behind = 0;
+
+  r->latency.reserve(total_elements);
+  pthread_create(&t, NULL, replay_consumer<Q>, r);
+  cpu::pin(producer_cpu);
+
+  uint64_t const start_c = cpu::read_tsc() + hz / 1000; // 1 ms to get going
+  uint64_t due = start_c;
+  for (size_t k = 0; k < arrivals.size(); k++) {
+    due += arrivals[k].gap;
+    uint64_t now;
+    while ( (now = cpu::read_tsc()) < due ) { }
+    if ( now - due > behind ) { behind = now - due; }
+    for (uint32_t c = 0; c < arrivals[k].count; c++) {
+      while ( r->q.enqueue(due) != Q::SUCCESS ) { wait(spins); }
+    }
+  }
+  for (size_t k = 0; k < padding<Q>(); k++) {
+    while ( r->q.enqueue(1) != Q::SUCCESS ) { wait(spins); }
+  }
+  pthread_join(t, NULL);
+
+  std::vector<uint64_t> &l = r->latency;
+  std::sort(l.begin(), l.end());
+  size_t const n = l.size();
+  double const secs = (double)(r->last_c - start_c) / hz;
+  std::cout << std::setw(22) << name << std::fixed << std::setprecision(2)
+    << std::setw(9) << n / secs / 1e6 << " M/s"
+    << "  p50 " << std::setw(7) << l[n / 2]
+    << "  p90 " << std::setw(7) << l[n * 9 / 10]
+    << "  p99 " << std::setw(8) << l[n * 99 / 100]
+    << "  p99.9 " << std::setw(9) << l[n * 999 / 1000]
+    << "  max " << std::setw(10) << l[n - 1]
+    << "  producer behind " << behind << std::endl;
+  delete r;
+}
+
+int main(int argc, char *argv[])
+{
+  char const *path = (argc > 1 && argv[1][0] != '-') ? argv[1] : NULL;
+  double speed = (argc > 2) ? atof(argv[2]) : 1.0;
+  capture_stream streams[CAPTURE_MAX_STREAMS];
+  uint64_t capture_hz;
+
+  if (argc > 4) {
+    producer_cpu = atoi(argv[3]);
+    consumer_cpu = atoi(argv[4]);
+  }
+  long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  producer_cpu %= cpus;
+  consumer_cpu %= cpus;
+  if ( speed <= 0 ) { speed = 1.0; }
+
+  if ( !path ) {
+    path = SELF_CAPTURE_FILE;
+    if ( self_capture(path) ) { return 1; }
+  }
+  int const n = capture_read(path, streams, CAPTURE_MAX_STREAMS, &capture_hz);
+  if ( n < 0 ) { return 1; }
+
+  uint64_t const hz = capture_tsc_hz();
+  std::cout << path << ": captured at " << capture_hz / 1000000 << " MHz, replayed at "
+    << hz / 1000000 << " MHz, speed " << speed << std::endl;
+
+  int input = -1;
+  for (int i = 0; i < n; i++) {
+    capture_stream const &s = streams[i];
+    double const secs = (double)(s.last_tsc - s.first_tsc) / capture_hz;
+    std::cout << "  " << (s.side == CAPTURE_ENQUEUE ? "enqueue" : "dequeue") << " stream " << s.id
+      << ": " << s.elements << " elements in " << s.records << " records, " << s.len << " bytes, "
+      << s.dropped << " dropped, " << std::setprecision(3) << s.elements / (secs > 0 ? secs : 1) / 1e6
+      << " M/s captured" << std::endl;
+    if ( input < 0 && s.side == CAPTURE_ENQUEUE ) { input = i; }
+  }
+  if ( input < 0 ) {
+    std::cerr << path << ": no enqueue stream" << std::endl;
+    return 1;
+  }
+
+  // gaps in this machine's cycles
+  double const scale = (double)hz / capture_hz / speed;
+  size_t pos = 0;
+  uint64_t gap;
+  uint32_t count;
+  bool first = true;
+  while ( capture_next(&streams[input], &pos, &gap, &count) ) {
+    arrival a;
+    a.gap = first ? 0 : (uint64_t)(gap * scale);
+    a.count = count;
+    arrivals.push_back(a);
+    total_elements += count;
+    first = false;
+  }
+
+  std::cout << "latency in cycles from scheduled arrival to dequeue" << std::endl;
+  replay< queue<> >("queue<8192>", hz);
+  replay< queue<1024> >("queue<1024>", hz);
+  replay< queue<128> >("queue<128>", hz);
+  replay< queue<8192, uint64_t, 1000, false> >("queue<8192> unbatched", hz);
+  replay< lap_queue<> >("lap_queue<>", hz);
+
+  for (int i = 0; i < n; i++) { capture_close(&streams[i]); }
+  if ( strcmp(path, SELF_CAPTURE_FILE) == 0 ) { unlink(path); }
+  return 0;
+}
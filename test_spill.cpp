@@ -0,0 +1,96 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A producer that never waits, feeding a consumer that is periodically slow, through a small
+// ring backed by a spill file. Checks that every element arrives once and in order.
+//
+//   test_spill [elements [spill_dir]]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "spill.hpp"
+#include "cpu.hpp"
+
+#define SLOW_EVERY (1024 * 64)	/* the consumer stalls once every that many elements */
+#define SLOW_CYCLES 2000000
+#define SPILL_BYTES (64ULL << 20)
+
+typedef spill_queue< queue<1024> > queue_t;
+
+static queue_t *q;
+static uint64_t test_size = 10000000;
+
+void * consumer(void *arg)
+{
+  uint64_t value, errors = 0, spins = 0, max_backlog = 0;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+
+  uint64_t const start_c = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size; i++) {
+    while ( q->dequeue(&value) != queue_t::SUCCESS ) {
+      cpu::relax();
+      if ( (++spins & 0xff) == 0 ) { sched_yield(); }
+    }
+    if ( value != i ) { ++errors; }
+    if ( i % SLOW_EVERY == 0 ) {
+      uint64_t const b = q->spill_backlog();
+      if ( b > max_backlog ) { max_backlog = b; }
+      uint64_t const until = cpu::read_tsc() + SLOW_CYCLES; // analytics hiccup
+      while ( cpu::read_tsc() < until ) { cpu::relax(); }
+    }
+  }
+  uint64_t const stop_c = cpu::read_tsc();
+
+  std::cout << "consumer: " << (stop_c - start_c) / test_size << " cycles/op, "
+    << errors << " out of order, largest spill backlog " << max_backlog << std::endl;
+  return (void *)errors;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  void *errors;
+  char const *dir = "/tmp";
+  uint64_t full = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 2) { dir = argv[2]; }
+
+  q = new queue_t(dir, SPILL_BYTES);
+  pthread_create(&consumer_thread, NULL, consumer, NULL);
+  cpu::pin(0);
+
+  uint64_t const start_p = cpu::read_tsc();
+  for (uint64_t i = 1; i <= test_size + queue_t::consumer_batch_size(); i++) {
+    // only when the spill file is full as well
+    while ( q->enqueue(i) != queue_t::SUCCESS ) { ++full; sched_yield(); }
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+
+  pthread_join(consumer_thread, &errors);
+  std::cout << "producer: " << (stop_p - start_p) / test_size << " cycles/op, "
+    << q->spilled_count() << " elements spilled, " << full << " times full" << std::endl;
+  delete q;
+  return errors ? 1 : 0;
+}
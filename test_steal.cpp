@@ -0,0 +1,258 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// stealing_executor<> against a pool of workers around one std::deque under a mutex and a
+// condition variable. The same tasks go to both. A task's argument is its index, the
+// submitter records the submission time per index, and the task burns `work` cycles. Every
+// `workers`-th batch of SUBMIT_BATCH tasks is heavy (heavy times the work), so the executor's
+// round-robin submission puts all the heavy tasks into worker 0's inbox and the other workers
+// have to steal. Reports tasks per kilocycle, latency percentiles (submission to start, in
+// cycles) and how many tasks were stolen; checks that every task ran exactly once.
+//
+//   test_steal [tasks [workers [work [heavy]]]]
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include "steal.hpp"
+#include "cpu.hpp"
+
+#define SUBMIT_BATCH 64
+
+typedef stealing_executor<64, 1024 * 8, SUBMIT_BATCH> executor_t;
+
+static uint64_t test_size = 1000000;
+static size_t workers = 4;
+static uint64_t work = 100;
+static uint64_t heavy = 20;
+
+// What the tasks record, one slot per worker.
+struct task_stats {
+  std::vector<uint64_t> latency;
+} __attribute__ ((aligned(64)));
+
+static task_stats stats[64];
+static uint64_t *submitted;   // submission time per task
+static uint8_t *ran;          // times each task ran
+
+static void spin(uint64_t cycles)
+{
+  uint64_t const until = cpu::read_tsc() + cycles;
+  while ( cpu::read_tsc() < until ) { }
+}
+
+static void light_task(void *, uint64_t arg, size_t worker)
+{
+  stats[worker].latency.push_back(cpu::read_tsc() - submitted[arg]);
+  ++ran[arg];
+  spin(work);
+}
+
+static void heavy_task(void *, uint64_t arg, size_t worker)
+{
+  stats[worker].latency.push_back(cpu::read_tsc() - submitted[arg]);
+  ++ran[arg];
+  spin(work * heavy);
+}
+
+static bool is_heavy(uint64_t i) { return (i / SUBMIT_BATCH) % workers == 0; }
+
+// The baseline: one locked deque, workers wait on a condition variable.
+class locked_pool
+{
+public:
+  typedef void (*task_fn)(void *ctx, uint64_t arg, size_t worker);
+
+  locked_pool(size_t n) : num_workers(n), stopping(false), waiting(0)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~locked_pool()
+  {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  uint8_t add_function(task_fn fn, void *ctx)
+  {
+    functions.push_back(std::make_pair(fn, ctx));
+    return (uint8_t)(functions.size() - 1);
+  }
+
+  void start()
+  {
+    for(size_t w = 0; w < num_workers; ++w) {
+      args[w].pool = this;
+      args[w].id = w;
+      pthread_create(&threads[w], NULL, worker_main, &args[w]);
+    }
+  }
+
+  void submit(uint64_t t)
+  {
+    pthread_mutex_lock(&lock);
+    tasks.push_back(t);
+    if ( waiting ) { pthread_cond_signal(&cond); }
+    pthread_mutex_unlock(&lock);
+  }
+
+  void stop()
+  {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for(size_t w = 0; w < num_workers; ++w) { pthread_join(threads[w], NULL); }
+  }
+
+private:
+  struct worker_arg {
+    locked_pool *pool;
+    size_t id;
+  };
+
+  static void * worker_main(void *arg)
+  {
+    worker_arg *const a = static_cast<worker_arg *>(arg);
+    locked_pool *const p = a->pool;
+    for(;;) {
+      pthread_mutex_lock(&p->lock);
+      while ( p->tasks.empty() && !p->stopping ) {
+        ++p->waiting;
+        pthread_cond_wait(&p->cond, &p->lock);
+        --p->waiting;
+      }
+      if ( p->tasks.empty() ) {
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+      }
+      uint64_t const t = p->tasks.front();
+      p->tasks.pop_front();
+      pthread_mutex_unlock(&p->lock);
+
+      std::pair<task_fn, void *> const &f = p->functions[(t >> executor_t::ARG_BITS) - 1U];
+      f.first(f.second, t & executor_t::ARG_MASK, a->id);
+    }
+  }
+
+  size_t const num_workers;
+  std::vector<std::pair<task_fn, void *> > functions;
+  pthread_t threads[64];
+  worker_arg args[64];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  std::deque<uint64_t> tasks;
+  bool stopping;
+  size_t waiting;
+};
+
+template<typename P>
+uint64_t run(char const *name, P &pool)
+{
+  for(size_t w = 0; w < workers; ++w) {
+    stats[w].latency.clear();
+    stats[w].latency.reserve(test_size);
+  }
+  std::fill(ran, ran + test_size, 0);
+  uint8_t const light = pool.add_function(light_task, NULL);
+  uint8_t const heavy_f = pool.add_function(heavy_task, NULL);
+  if ( light == executor_t::FUNCTIONS_FULL || heavy_f == executor_t::FUNCTIONS_FULL ) { return 1; }
+  pool.start();
+
+  uint64_t const start_c = cpu::read_tsc();
+  for (uint64_t i = 0; i < test_size; i++) {
+    submitted[i] = cpu::read_tsc();
+    pool.submit(executor_t::task(is_heavy(i) ? heavy_f : light, i));
+  }
+  pool.stop();
+  uint64_t const cycles = cpu::read_tsc() - start_c;
+
+  std::vector<uint64_t> l;
+  uint64_t errors = 0;
+  for(size_t w = 0; w < workers; ++w) {
+    l.insert(l.end(), stats[w].latency.begin(), stats[w].latency.end());
+  }
+  for (uint64_t i = 0; i < test_size; i++) {
+    if ( ran[i] != 1 ) { ++errors; }
+  }
+  std::sort(l.begin(), l.end());
+  size_t const n = l.size();
+  std::cout << std::setw(20) << name << std::fixed << std::setprecision(1)
+    << std::setw(8) << (double)n * 1e3 / cycles << " tasks/kcycle"
+    << "  p50 " << std::setw(9) << l[n / 2]
+    << "  p99 " << std::setw(10) << l[n * 99 / 100]
+    << "  max " << std::setw(11) << l[n - 1];
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t errors = 0;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+  if (argc > 2) { workers = strtoul(argv[2], NULL, 10); }
+  if (argc > 3) { work = strtoull(argv[3], NULL, 10); }
+  if (argc > 4) { heavy = strtoull(argv[4], NULL, 10); }
+  if ( workers == 0 ) { workers = 1; }
+  if ( workers > 64 ) { workers = 64; }
+  submitted = new uint64_t[test_size];
+  ran = new uint8_t[test_size];
+
+  {
+    // the function table is full after MAX_FUNCTIONS
+    executor_t *ex = new executor_t(1);
+    for (size_t f = 0; f < executor_t::MAX_FUNCTIONS; f++) {
+      if ( ex->add_function(light_task, NULL) != f ) { ++errors; }
+    }
+    if ( ex->add_function(light_task, NULL) != executor_t::FUNCTIONS_FULL ) { ++errors; }
+    delete ex;
+  }
+
+  {
+    locked_pool pool(workers);
+    uint64_t const e = run("mutex+condvar deque", pool);
+    std::cout << "  " << e << " errors" << std::endl;
+    errors += e;
+  }
+  {
+    executor_t *ex = new executor_t(workers);
+    uint64_t const e = run("stealing_executor<>", *ex);
+    uint64_t stolen = 0, steals = 0, empty = 0;
+    for(size_t w = 0; w < workers; ++w) {
+      stolen += ex->stolen(w);
+      steals += ex->steals(w);
+      empty += ex->empty_steals(w);
+    }
+    std::cout << "  stolen " << stolen << " in " << steals << " steals (" << empty << " empty), "
+      << e << " errors" << std::endl;
+    errors += e;
+    delete ex;
+  }
+  delete [] submitted;
+  delete [] ran;
+  return errors ? 1 : 0;
+}
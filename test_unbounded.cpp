@@ -0,0 +1,81 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Producer never waits: the consumer starts late, so the queue has to grow to hold the backlog,
+// and it must still come out in order.
+//
+//   test_unbounded [elements]
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include "unbounded.hpp"
+#include "cpu.hpp"
+
+typedef queue<1024> segment_t;
+typedef unbounded_queue<segment_t> queue_t;
+
+static queue_t q;
+static uint64_t test_size = 10000000;
+
+void * consumer(void *arg)
+{
+  uint64_t value, i, errors = 0;
+
+  cpu::pin(1 % sysconf(_SC_NPROCESSORS_ONLN));
+  usleep(50000); // let the producer run ahead
+
+  uint64_t const start_c = cpu::read_tsc();
+  for (i = 1; i <= test_size; i++) {
+    while ( q.dequeue(&value) != queue_t::SUCCESS ) { cpu::relax(); }
+    if ( value != i ) { ++errors; }
+  }
+  uint64_t const stop_c = cpu::read_tsc();
+
+  std::cout << "consumer: " << (stop_c - start_c) / test_size << " cycles/op, "
+    << errors << " out of order" << std::endl;
+  return (void *)errors;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t consumer_thread;
+  void *errors;
+
+  if (argc > 1) { test_size = strtoull(argv[1], NULL, 10); }
+
+  cpu::pin(0);
+  pthread_create(&consumer_thread, NULL, consumer, NULL);
+
+  uint64_t const start_p = cpu::read_tsc();
+  // like test4, a trailing consumer batch lets the consumer claim the last real elements
+  for (uint64_t i = 1; i <= test_size + segment_t::consumer_batch_size(); i++) {
+    q.enqueue(i);
+  }
+  uint64_t const stop_p = cpu::read_tsc();
+  std::cout << "producer: " << (stop_p - start_p) / test_size << " cycles/op" << std::endl;
+
+  pthread_join(consumer_thread, &errors);
+
+  std::cout << "segments allocated: " << q.segments_allocated() << std::endl;
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+__thread struct trace_buffer *trace_local;
+
+static struct trace_buffer *buffers[TRACE_MAX_THREADS];
+static uint32_t num_buffers;
+
+static const char *event_names[TRACE_NUM_EVENTS] = {
+	"?", "prod-claim", "prod-full", "cons-claim", "backtrack", "cons-empty", "stall"
+};
+
+const char *trace_event_name(uint16_t event)
+{
+	return event < TRACE_NUM_EVENTS ? event_names[event] : "?";
+}
+
+int trace_thread_init(uint32_t thread_id)
+{
+	struct trace_buffer *b;
+	uint32_t slot;
+
+	if (trace_local)
+		return 0;
+	if (posix_memalign((void **)&b, 64, sizeof(*b))) {
+		perror("trace: posix_memalign");
+		return -1;
+	}
+	/* touch the whole ring now so recording never takes a page fault */
+	memset(b, 0, sizeof(*b));
+	b->thread_id = thread_id;
+
+	slot = __sync_fetch_and_add(&num_buffers, 1);
+	if (slot >= TRACE_MAX_THREADS) {
+		fprintf(stderr, "trace: more than %d threads\n", TRACE_MAX_THREADS);
+		free(b);
+		return -1;
+	}
+	buffers[slot] = b;
+	trace_local = b;
+	return 0;
+}
+
+/* File layout, native endianness:
+ *	uint64_t magic, uint32_t threads, uint32_t TRACE_SIZE
+ *	per thread: uint32_t thread_id, uint32_t count, count records oldest first */
+int trace_dump(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	uint64_t magic = TRACE_MAGIC;
+	uint32_t size = TRACE_SIZE, n, i;
+
+	if (!f) {
+		perror("trace: fopen");
+		return -1;
+	}
+	n = num_buffers < TRACE_MAX_THREADS ? num_buffers : TRACE_MAX_THREADS;
+	fwrite(&magic, sizeof(magic), 1, f);
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(&size, sizeof(size), 1, f);
+
+	for (i = 0; i < n; i++) {
+		struct trace_buffer *b = buffers[i];
+		uint64_t first = b->pos > TRACE_SIZE ? b->pos - TRACE_SIZE : 0;
+		uint32_t count = (uint32_t)(b->pos - first);
+		uint64_t k;
+
+		fwrite(&b->thread_id, sizeof(b->thread_id), 1, f);
+		fwrite(&count, sizeof(count), 1, f);
+		for (k = first; k < b->pos; k++)
+			fwrite(&b->rec[k & (TRACE_SIZE - 1)], sizeof(struct trace_record), 1, f);
+	}
+
+	if (fclose(f)) {
+		perror("trace: fclose");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TRACE_B_QUQUQ_H_
+#define _TRACE_B_QUQUQ_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Binary trace of queue congestion events, built with -DFIFO_TRACE.
+ *
+ * Every thread that calls trace_thread_init() gets its own ring of TRACE_SIZE records; the
+ * queue code appends to the calling thread's ring with TRACE(), which is a TSC read and three
+ * stores, no lock, no syscall and no shared cache line. Threads that never called
+ * trace_thread_init() are not traced. When a ring wraps the oldest records are overwritten,
+ * so a dump holds the last TRACE_SIZE events of each thread.
+ *
+ * trace_dump() writes all rings to a file once the threads are done; trace_decode turns it
+ * into a timeline. Without FIFO_TRACE, TRACE() compiles to nothing. */
+
+#ifndef TRACE_SIZE
+#define TRACE_SIZE (1024 * 64)	/* records per thread, 2^N */
+#endif
+#define TRACE_MAX_THREADS 64
+#define TRACE_MAGIC 0x3145434152545142ULL	/* "BQTRACE1" */
+
+enum trace_event {
+	TRACE_PROD_CLAIM = 1,	/* index: new batch_head */
+	TRACE_PROD_FULL,	/* index: slot found occupied */
+	TRACE_CONS_CLAIM,	/* index: new batch_tail, arg: batch size */
+	TRACE_BACKTRACK,	/* index: probed slot found empty, arg: batch size tried */
+	TRACE_CONS_EMPTY,	/* index: tail, backtracking gave up */
+	TRACE_STALL,		/* index: cycles spent in wait_ticks() */
+	TRACE_NUM_EVENTS
+};
+
+struct trace_record {
+	uint64_t	tsc;
+	uint32_t	index;
+	uint16_t	event;
+	uint16_t	arg;
+};
+
+struct trace_buffer {
+	uint64_t	pos;		/* records written, the ring holds the last TRACE_SIZE */
+	uint32_t	thread_id;
+	uint32_t	pad;
+	struct trace_record rec[TRACE_SIZE];
+};
+
+extern __thread struct trace_buffer *trace_local;
+
+static inline uint64_t trace_tsc()
+{
+	uint32_t msw, lsw;
+	__asm__ __volatile__("rdtsc" : "=d"(msw), "=a"(lsw));
+	return ((uint64_t)msw << 32) | lsw;
+}
+
+static inline void trace_record(uint16_t event, uint32_t index, uint16_t arg)
+{
+	struct trace_buffer *b = trace_local;
+	struct trace_record *r;
+
+	if (!b)
+		return;
+	r = &b->rec[b->pos++ & (TRACE_SIZE - 1)];
+	r->tsc = trace_tsc();
+	r->index = index;
+	r->event = event;
+	r->arg = arg;
+}
+
+#if defined(FIFO_TRACE)
+#define TRACE(event, index, arg) trace_record((event), (index), (arg))
+#else
+#define TRACE(event, index, arg) do { } while (0)
+#endif
+
+/* Give the calling thread a ring (once, later calls keep it). Returns 0, or -1 if out of memory or slots. */
+int trace_thread_init(uint32_t thread_id);
+
+/* Write every ring to path. Call once the traced threads have stopped. Returns 0 or -1. */
+int trace_dump(const char *path);
+
+const char *trace_event_name(uint16_t event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) 2011 Junchang Wang <junchang.wang@gmail.com>
+ *
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Offline decoder for trace_dump() files.
+ *
+ *	trace_decode [-s] fifo.trace
+ *
+ * Prints the records of all threads merged into one timeline (cycles since the first record),
+ * then per thread the number of each event and the cycles spent stalled. -s prints only the
+ * summary. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "trace.h"
+
+struct entry {
+	struct trace_record r;
+	uint32_t thread_id;
+};
+
+struct summary {
+	uint32_t thread_id;
+	uint64_t events[TRACE_NUM_EVENTS];
+	uint64_t stall_cycles;
+};
+
+static int by_tsc(const void *a, const void *b)
+{
+	uint64_t x = ((const struct entry *)a)->r.tsc, y = ((const struct entry *)b)->r.tsc;
+	return x < y ? -1 : x > y;
+}
+
+static void print_record(const struct entry *e, uint64_t t0)
+{
+	printf("%14" PRIu64 "  thread %-3u %-10s ", e->r.tsc - t0, e->thread_id,
+		trace_event_name(e->r.event));
+	switch (e->r.event) {
+	case TRACE_PROD_CLAIM:
+		printf("batch_head=%u\n", e->r.index);
+		break;
+	case TRACE_PROD_FULL:
+		printf("slot %u occupied\n", e->r.index);
+		break;
+	case TRACE_CONS_CLAIM:
+		printf("batch_tail=%u (%u)\n", e->r.index, e->r.arg);
+		break;
+	case TRACE_BACKTRACK:
+		printf("slot %u empty, batch %u\n", e->r.index, e->r.arg);
+		break;
+	case TRACE_CONS_EMPTY:
+		printf("tail=%u\n", e->r.index);
+		break;
+	case TRACE_STALL:
+		printf("%u cycles\n", e->r.index);
+		break;
+	default:
+		printf("index=%u arg=%u\n", e->r.index, e->r.arg);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct summary sums[TRACE_MAX_THREADS];
+	struct entry *all = NULL;
+	uint64_t magic, total = 0, k;
+	uint32_t threads, size, t, e;
+	int summary_only = 0;
+	const char *path;
+	FILE *f;
+
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		summary_only = 1;
+		argv++;
+		argc--;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "usage: trace_decode [-s] file\n");
+		return 1;
+	}
+	path = argv[1];
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != TRACE_MAGIC ||
+	    fread(&threads, sizeof(threads), 1, f) != 1 ||
+	    fread(&size, sizeof(size), 1, f) != 1 || threads > TRACE_MAX_THREADS) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		return 1;
+	}
+
+	memset(sums, 0, sizeof(sums));
+	for (t = 0; t < threads; t++) {
+		uint32_t count;
+
+		if (fread(&sums[t].thread_id, sizeof(uint32_t), 1, f) != 1 ||
+		    fread(&count, sizeof(count), 1, f) != 1 || count > size) {
+			fprintf(stderr, "%s: truncated\n", path);
+			return 1;
+		}
+		all = realloc(all, (total + count) * sizeof(*all));
+		if (!all && total + count > 0) {
+			perror("realloc");
+			return 1;
+		}
+		for (k = 0; k < count; k++) {
+			struct entry *en = &all[total + k];
+			if (fread(&en->r, sizeof(en->r), 1, f) != 1) {
+				fprintf(stderr, "%s: truncated\n", path);
+				return 1;
+			}
+			en->thread_id = sums[t].thread_id;
+			if (en->r.event < TRACE_NUM_EVENTS)
+				sums[t].events[en->r.event]++;
+			if (en->r.event == TRACE_STALL)
+				sums[t].stall_cycles += en->r.index;
+		}
+		total += count;
+	}
+	fclose(f);
+
+	if (!summary_only && total > 0) {
+		qsort(all, total, sizeof(*all), by_tsc);
+		for (k = 0; k < total; k++)
+			print_record(&all[k], all[0].r.tsc);
+		printf("\n");
+	}
+
+	for (t = 0; t < threads; t++) {
+		int any = 0;
+
+		printf("thread %u:", sums[t].thread_id);
+		for (e = 1; e < TRACE_NUM_EVENTS; e++) {
+			if (sums[t].events[e]) {
+				printf(" %s %" PRIu64, trace_event_name(e), sums[t].events[e]);
+				any = 1;
+			}
+		}
+		printf("%s stalled %" PRIu64 " cycles\n", any ? "," : "", sums[t].stall_cycles);
+	}
+
+	free(all);
+	return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ *  B-Queue -- An efficient and practical queueing for fast core-to-core
+ *             communication
+ *
+ *  Copyright (C) Marcin Sobieszczanski
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _UNBOUNDED_B_QUQUQ_H_
+#define _UNBOUNDED_B_QUQUQ_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "fifo2.hpp"
+
+// Unbounded SPSC queue made of a chain of fixed-size queue<> segments.
+//
+// Inside a segment enqueue/dequeue are exactly queue<>'s (batching included). When the current
+// segment is full the producer links in a fresh one and carries on, so enqueue() never returns
+// BUFFER_FULL. The consumer follows the link once it has drained a segment the producer left;
+// the drained segment is rewound and handed back to the producer through a small recycle ring,
+// so in steady state no segment is allocated or freed.
+//
+// SEGMENT should not use producer batching: a full producer batch costs CONGESTION_PENALTY
+// cycles before queue<> reports BUFFER_FULL, which is the stall this queue exists to avoid.
+
+template<typename SEGMENT = queue<>, size_t RECYCLE_SIZE = 64>
+class unbounded_queue
+{
+public:
+  typedef typename SEGMENT::element_type element_type;
+  typedef typename SEGMENT::ReturnCode ReturnCode;
+  static const ReturnCode SUCCESS = SEGMENT::SUCCESS;
+  static const ReturnCode BUFFER_EMPTY = SEGMENT::BUFFER_EMPTY;
+
+  explicit unbounded_queue(size_t preallocated = 1) : allocated(1U), draining(false)
+  {
+    prod = cons = new segment();
+    for(size_t i = 0U; i < preallocated; ++i) {
+      if ( recycled.enqueue(reinterpret_cast<uint64_t>(new segment())) != recycle_t::SUCCESS ) { break; }
+      ++allocated;
+    }
+  }
+
+  ~unbounded_queue()
+  {
+    for(segment *s = cons; s; ) {
+      segment *n = s->next.load(std::memory_order_relaxed);
+      delete s;
+      s = n;
+    }
+    uint64_t p;
+    while ( recycled.dequeue(&p) == recycle_t::SUCCESS ) {
+      delete reinterpret_cast<segment *>(p);
+    }
+  }
+
+  // Never fails.
+  ReturnCode enqueue(element_type value)
+  {
+    if ( prod->q.enqueue(value) == SEGMENT::SUCCESS ) {
+      return SUCCESS;
+    }
+
+    segment *s = this->fresh_segment();
+    s->q.enqueue(value); // an empty segment always has room
+    prod->next.store(s, std::memory_order_release);
+    prod = s;
+
+    return SUCCESS;
+  }
+
+  ReturnCode dequeue(element_type *value)
+  {
+    if ( !draining ) {
+      if ( cons->q.dequeue(value) == SEGMENT::SUCCESS ) {
+        return SUCCESS;
+      }
+      if ( !cons->next.load(std::memory_order_acquire) ) {
+        return BUFFER_EMPTY;
+      }
+      // the producer has moved on: what is left in this segment is final,
+      // including the tail that consumer batching would hold back
+      draining = true;
+    }
+
+    if ( cons->q.dequeue_unbatched(value) == SEGMENT::SUCCESS ) {
+      return SUCCESS;
+    }
+
+    segment *n = cons->next.load(std::memory_order_relaxed);
+    this->retire(cons);
+    cons = n;
+    draining = false;
+
+    return this->dequeue(value);
+  }
+
+  // Segments obtained from the allocator so far (constant once the queue reached steady state).
+  size_t segments_allocated() const { return allocated; }
+
+private:
+  typedef queue<RECYCLE_SIZE, uint64_t, 0, false, false, false, false> recycle_t;
+
+  struct segment {
+    SEGMENT q;
+    std::atomic<segment *> next;
+
+    segment() : next(NULL) { }
+  };
+
+  segment * fresh_segment()
+  {
+    uint64_t p;
+    if ( recycled.dequeue(&p) == recycle_t::SUCCESS ) {
+      return reinterpret_cast<segment *>(p);
+    }
+    ++allocated;
+    return new segment();
+  }
+
+  void retire(segment *s)
+  {
+    s->q.reset();
+    s->next.store(NULL, std::memory_order_relaxed);
+    if ( recycled.enqueue(reinterpret_cast<uint64_t>(s)) != recycle_t::SUCCESS ) {
+      // more segments in flight than the recycle ring holds, only after a long burst
+      delete s;
+    }
+  }
+
+  /* Mostly accessed by producer. */
+  segment *prod __attribute__ ((aligned(64)));
+  size_t allocated;
+
+  /* Mostly accessed by consumer. */
+  segment *cons __attribute__ ((aligned(64)));
+  bool draining;
+
+  /* Segments travel back from consumer to producer. */
+  recycle_t recycled;
+} __attribute__ ((aligned(64)));
+
+#endif
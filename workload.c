@@ -21,76 +21,268 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <sched.h>
 #include <stdint.h>
-#include "fifo.h"
+#include <math.h>
 #include "workload.h"
 
-/* All the consumers Read it. */
-static char volatile src[MEM_LEN];
+static inline uint64_t workload_tsc()
+{
+        uint64_t        time;
+        uint32_t        msw   , lsw;
+        __asm__         __volatile__("rdtsc\n\t"
+                        "movl %%edx, %0\n\t"
+                        "movl %%eax, %1\n\t"
+                        :         "=r"         (msw), "=r"(lsw)
+                        :
+                        :         "%edx"      , "%eax");
+        time = ((uint64_t) msw << 32) | lsw;
+        return time;
+}
+
+/* xorshift64*, state is per thread (struct workload) so there is no shared seed */
+static inline uint64_t next_rand(struct workload *w)
+{
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 2685821657736338717ULL;
+}
+
+/* true once every `probab` calls on average */
+static inline int one_in(struct workload *w, unsigned probab)
+{
+	return probab > 0 && (next_rand(w) >> 32) % probab == 0;
+}
 
-/* All the consumers Write to it. */
-/* FIXME: there is cache thrashing */
-static char volatile dst[MEM_LEN];
+/* uniform in (0, 1] */
+static inline double uniform(struct workload *w)
+{
+	return ((next_rand(w) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
 
-/* RAND_MAX assumed to be 32767 */
-int myrand(unsigned long * next) {
-	*next = *next * 1103515245 + 12345;
-	return((unsigned)(*next/65536) % 32768);
+static inline uint64_t exponential(struct workload *w, uint64_t mean)
+{
+	return (uint64_t)(-log(uniform(w)) * (double)mean);
 }
 
-/* making myrand works fine on 64bit systems. */
-#define MY_RAND_MAX (32767)
-#define rand myrand
+void workload_default_config(struct workload_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->probab_memcpy = PROBAB_MEMCPY;
+	cfg->probab_malloc = PROBAB_MALLOC;
+	cfg->probab_yield = PROBAB_YIELD;
+	cfg->probab_workload = PROBAB_WORKLOAD;
+	cfg->workload = WORKLOAD;
+	cfg->mem_len = MEM_LEN;
+	cfg->arrival = ARRIVAL_NONE;
+}
 
-/* FIXME: function rand() is not reentrant
- *        Check "man 3 rand"
- *        We need rand_r(), however it contains a lock
-*/
+/* A plain decimal number no larger than max: no sign, no trailing characters. */
+static int parse_number(const char *key, const char *s, unsigned long long max,
+			unsigned long long *out)
+{
+	char *end;
+
+	errno = 0;
+	*out = strtoull(s, &end, 10);
+	if (*s < '0' || *s > '9' || *end || errno || *out > max) {
+		fprintf(stderr, "workload: bad value for %s: \"%s\"\n", key, s);
+		return -1;
+	}
+	return 0;
+}
+
+int workload_parse(struct workload_config *cfg, const char *spec)
+{
+	char key[32], value[32];
+	unsigned long long v, count;
+	char *colon;
+	int n;
+
+	while (*spec) {
+		if (sscanf(spec, "%31[^=]=%31[^,]%n", key, value, &n) != 2) {
+			fprintf(stderr, "workload: cannot parse \"%s\"\n", spec);
+			return -1;
+		}
+		spec += n;
+		if (*spec == ',')
+			spec++;
 
-inline unsigned long workload(unsigned long *next)
+		if (!strcmp(key, "work")) {
+			colon = strchr(value, ':');
+			if (colon) {
+				*colon = '\0';
+				/* a busy loop of no iterations is not a workload */
+				if (parse_number(key, colon + 1, ULONG_MAX, &count))
+					return -1;
+				if (count == 0) {
+					fprintf(stderr, "workload: work count must be > 0\n");
+					return -1;
+				}
+				cfg->workload = count;
+			}
+			if (parse_number(key, value, UINT_MAX, &v))
+				return -1;
+			cfg->probab_workload = v;
+		} else if (!strcmp(key, "memcpy")) {
+			if (parse_number(key, value, UINT_MAX, &v))
+				return -1;
+			cfg->probab_memcpy = v;
+		} else if (!strcmp(key, "malloc")) {
+			if (parse_number(key, value, UINT_MAX, &v))
+				return -1;
+			cfg->probab_malloc = v;
+		} else if (!strcmp(key, "yield")) {
+			if (parse_number(key, value, UINT_MAX, &v))
+				return -1;
+			cfg->probab_yield = v;
+		} else if (!strcmp(key, "len")) {
+			/* workload_run() touches the last byte of both buffers */
+			if (parse_number(key, value, SIZE_MAX, &v))
+				return -1;
+			if (v == 0) {
+				fprintf(stderr, "workload: len must be > 0\n");
+				return -1;
+			}
+			cfg->mem_len = v;
+		} else if (!strcmp(key, "arrival")) {
+			if (!strcmp(value, "none"))
+				cfg->arrival = ARRIVAL_NONE;
+			else if (!strcmp(value, "constant"))
+				cfg->arrival = ARRIVAL_CONSTANT;
+			else if (!strcmp(value, "poisson"))
+				cfg->arrival = ARRIVAL_POISSON;
+			else if (!strcmp(value, "bursty"))
+				cfg->arrival = ARRIVAL_BURSTY;
+			else {
+				fprintf(stderr, "workload: unknown arrival \"%s\"\n", value);
+				return -1;
+			}
+		} else if (!strcmp(key, "gap")) {
+			if (parse_number(key, value, UINT64_MAX, &v))
+				return -1;
+			cfg->mean_gap = v;
+		} else if (!strcmp(key, "burst")) {
+			if (parse_number(key, value, UINT64_MAX, &v))
+				return -1;
+			cfg->burst_len = v;
+		} else if (!strcmp(key, "idle")) {
+			if (parse_number(key, value, UINT64_MAX, &v))
+				return -1;
+			cfg->idle_gap = v;
+		} else {
+			fprintf(stderr, "workload: unknown key \"%s\"\n", key);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int workload_config_from_env(struct workload_config *cfg)
+{
+	const char *spec = getenv("BQ_WORKLOAD");
+
+	workload_default_config(cfg);
+	return spec ? workload_parse(cfg, spec) : 0;
+}
+
+int workload_init(struct workload *w, const struct workload_config *cfg, uint64_t seed)
+{
+	memset(w, 0, sizeof(*w));
+	w->cfg = *cfg;
+	w->rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+
+	if (cfg->probab_memcpy > 0) {
+		if (posix_memalign((void **)&w->src, 64, cfg->mem_len) ||
+		    posix_memalign((void **)&w->dst, 64, cfg->mem_len)) {
+			perror("workload: posix_memalign");
+			return -1;
+		}
+		memset(w->src, 1, cfg->mem_len);
+		memset(w->dst, 0, cfg->mem_len);
+	}
+	return 0;
+}
+
+void workload_destroy(struct workload *w)
+{
+	free(w->src);
+	free(w->dst);
+	w->src = w->dst = NULL;
+}
+
+unsigned long workload_run(struct workload *w)
 {
 	unsigned long result = 0;
-	int seed;
-#if (PROBAB_MEMCPY>0)
-	seed = 1 + (int)( (float)PROBAB_MEMCPY * (rand(next) / (MY_RAND_MAX + 1.0)));
-	if(seed == 2) {
-		//printf(" PROBAB_MEMCPY \n ");
-		memcpy((char *)dst, (char *)src, MEM_LEN);
+	unsigned long i;
+
+	if (one_in(w, w->cfg.probab_memcpy)) {
+		memcpy(w->dst, w->src, w->cfg.mem_len);
+		result += w->dst[w->cfg.mem_len - 1];
 	}
-#endif
-
-#if (PROBAB_MALLOC>0)
-	seed = 1 + (int)( (float)PROBAB_MALLOC * (rand(next) / (MY_RAND_MAX + 1.0)));
-	if(seed == 2) {
-		//printf(" PROBAB_MALLOC \n ");
-		temp = (char *)malloc(MEM_LEN);
-		temp[MEM_LEN-1] = '1';
+
+	if (one_in(w, w->cfg.probab_malloc)) {
+		char * volatile temp = (char *)malloc(w->cfg.mem_len);
+		temp[w->cfg.mem_len - 1] = '1';
 		free(temp);
 	}
-#endif
 
-#if (PROBAB_YIELD>0)
-	seed = 1 + (int)( (float)PROBAB_YIELD * (rand(next) / (MY_RAND_MAX + 1.0)));
-	if(seed == 2) {
-		//printf(" PROBAB_YIELD \n ");
+	if (one_in(w, w->cfg.probab_yield))
 		sched_yield();
-	}
-#endif
 
-#if (PROBAB_WORKLOAD>0)
-	unsigned long i;
-	seed = 1 + (int)( (float)PROBAB_WORKLOAD * (rand(next) / (MY_RAND_MAX + 1.0)));
-	if(seed == 2) {
-		//printf(" PROBAB_LOAD \n ");
-		//wait_ticks(WORKLOAD);
-		for(i=0; i<WORKLOAD; i++) {
+	if (one_in(w, w->cfg.probab_workload)) {
+		for (i = 0; i < w->cfg.workload; i++) {
 			result += i;
 			result += result;
+			__asm__ __volatile__("" : "+r"(result));
 		}
 	}
-#endif
 	return result;
 }
 
+uint64_t workload_next_gap(struct workload *w)
+{
+	switch (w->cfg.arrival) {
+	case ARRIVAL_CONSTANT:
+		return w->cfg.mean_gap;
+	case ARRIVAL_POISSON:
+		return exponential(w, w->cfg.mean_gap);
+	case ARRIVAL_BURSTY:
+		if (w->burst_left > 0) {
+			w->burst_left--;
+			return w->cfg.mean_gap;
+		}
+		/* geometric burst length with mean burst_len */
+		w->burst_left = w->cfg.burst_len > 1 ?
+			exponential(w, w->cfg.burst_len - 1) : 0;
+		return exponential(w, w->cfg.idle_gap);
+	default:
+		return 0;
+	}
+}
+
+uint64_t workload_calibrate(struct workload *w, uint64_t rounds)
+{
+	uint64_t i, start_c, stop_c, saved = w->rng;
+	volatile unsigned long sink = 0;
+
+	if (rounds == 0)
+		rounds = 1;
+
+	/* warm up buffers and branch predictors first */
+	for (i = 0; i < rounds / 10; i++)
+		sink += workload_run(w);
+
+	start_c = workload_tsc();
+	for (i = 0; i < rounds; i++)
+		sink += workload_run(w);
+	stop_c = workload_tsc();
+
+	w->rng = saved;
+	w->overhead = (stop_c - start_c) / rounds;
+	return w->overhead;
+}
@@ -19,16 +19,89 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef _WORKLOAD_B_QUQUQ_H_
+#define _WORKLOAD_B_QUQUQ_H_
 
-#define PROBAB (100)
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Defaults of the runtime configuration (the former compile-time knobs).
+ * A PROBAB_* value of P means "once every P elements on average", 0 means never. */
 #define PROBAB_MEMCPY 0
 #define MEM_LEN (1024*4)
 #define PROBAB_MALLOC 0
 #define PROBAB_YIELD 0
-#define PROBAB_LOCK 0
 #define PROBAB_WORKLOAD 10
 #define WORKLOAD (2000)
-#define AVG_WORKLOAD (0) 
 
+#define CALIBRATION_ROUNDS (1000000)
+
+/* How the producer spaces its elements. */
+enum arrival_model {
+	ARRIVAL_NONE = 0,	/* back to back, as fast as the queue takes them */
+	ARRIVAL_CONSTANT,	/* every mean_gap cycles */
+	ARRIVAL_POISSON,	/* exponential gaps with mean mean_gap */
+	ARRIVAL_BURSTY		/* on/off: bursts of ~burst_len elements mean_gap apart,
+				   separated by exponential idle periods with mean idle_gap */
+};
+
+struct workload_config {
+	/* consumer side, per element */
+	unsigned	probab_memcpy;
+	unsigned	probab_malloc;
+	unsigned	probab_yield;
+	unsigned	probab_workload;
+	unsigned long	workload;	/* iterations of the busy loop */
+	size_t		mem_len;	/* memcpy and malloc size */
+
+	/* producer side */
+	enum arrival_model arrival;
+	uint64_t	mean_gap;	/* cycles */
+	uint64_t	burst_len;	/* elements */
+	uint64_t	idle_gap;	/* cycles */
+};
+
+/* Per-thread state: every consumer gets its own buffers and random sequence. */
+struct workload {
+	struct workload_config cfg;
+	uint64_t	rng;
+	char		*src;
+	char		*dst;
+	uint64_t	overhead;	/* cycles per workload_run(), see workload_calibrate() */
+	uint64_t	burst_left;
+};
+
+void workload_default_config(struct workload_config *cfg);
+
+/* Comma separated key=value list over the defaults, e.g.
+ *   "work=10:2000,memcpy=100,len=4096,malloc=0,yield=0,arrival=bursty,gap=200,burst=64,idle=100000"
+ * work=P:N runs N busy iterations once every P elements. Values are plain decimal numbers;
+ * len and N must be > 0. Returns 0, or -1 (with a message) on a bad spec. */
+int workload_parse(struct workload_config *cfg, const char *spec);
+
+/* Configuration from the BQ_WORKLOAD environment variable, defaults if unset. */
+int workload_config_from_env(struct workload_config *cfg);
+
+int workload_init(struct workload *w, const struct workload_config *cfg, uint64_t seed);
+void workload_destroy(struct workload *w);
+
+/* Consumer: the synthetic work for one element. */
+unsigned long workload_run(struct workload *w);
+
+/* Producer: cycles to wait before the next element. */
+uint64_t workload_next_gap(struct workload *w);
+
+/* Average cost of workload_run() on the calling thread's core over `rounds` calls, also
+ * stored in w->overhead. Call it after pinning, before the measured loop, and subtract
+ * w->overhead from the per-element result. */
+uint64_t workload_calibrate(struct workload *w, uint64_t rounds);
+
+#ifdef __cplusplus
+}
+#endif
 
-inline unsigned long workload(unsigned long *next);
+#endif